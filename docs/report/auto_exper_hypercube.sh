@@ -10,6 +10,11 @@ DSET="-d data/train-images.idx3-ubyte"
 QSET="-q data/t10k-images.idx3-ubyte"
 TYPE="-type mnist"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_mnist.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 OUT_CSV=docs/report/results/hypercube.csv
 OUT_TXT=docs/report/results/hypercube_output.txt
 echo "kproj,M,probes,Recall@N,AF,QPS,tApprox" > $OUT_CSV
@@ -19,7 +24,7 @@ for kproj in 10 12 14; do
   for M in 20 50 100; do
     for probes in 10 15 20; do
       echo "Running Hypercube (kproj=$kproj, M=$M, probes=$probes)"
-      ./search $DSET $QSET $TYPE -hypercube -kproj $kproj -M $M -probes $probes \
+      ./search $DSET $QSET $TYPE -gt "$GT" -hypercube -kproj $kproj -M $M -probes $probes \
         -w 4.0 -N 1 -R 2000 -range false -o docs/report/results/tmp_cube.txt
 
       recall=$(grep "Recall@N" docs/report/results/tmp_cube.txt | awk '{print $2}')
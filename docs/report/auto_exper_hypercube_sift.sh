@@ -9,6 +9,11 @@ DSET="-d data/sift_base.fvecs"
 QSET="-q data/sift_query.fvecs"
 TYPE="-type sift"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_sift.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 OUT_CSV=docs/report/results/hypercube_sift.csv
 OUT_TXT=docs/report/results/hypercube_sift_output.txt
 
@@ -20,7 +25,7 @@ for kproj in 10 12 14; do
   for M in 100 300 500; do
     for probes in 10 20 30; do
       echo "Running Hypercube SIFT (kproj=$kproj, M=$M, probes=$probes)"
-      ./search $DSET $QSET $TYPE -hypercube -kproj $kproj -M $M -probes $probes \
+      ./search $DSET $QSET $TYPE -gt "$GT" -hypercube -kproj $kproj -M $M -probes $probes \
         -w 4.0 -N 1 -R 2 -range false -o docs/report/results/tmp_cube_sift.txt
 
       recall=$(grep "Recall@N" docs/report/results/tmp_cube_sift.txt | awk '{print $2}')
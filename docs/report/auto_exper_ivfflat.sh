@@ -10,6 +10,11 @@ DSET="-d data/train-images.idx3-ubyte"
 QSET="-q data/t10k-images.idx3-ubyte"
 TYPE="-type mnist"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_mnist.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 OUT_CSV=docs/report/results/ivfflat.csv
 OUT_TXT=docs/report/results/ivfflat_output.txt
 echo "kclusters,nprobe,_,Recall@N,AF,QPS,tApprox" > $OUT_CSV
@@ -18,7 +23,7 @@ echo "=== IVFFLAT EXPERIMENT RESULTS ===" > $OUT_TXT
 for kclusters in 20 50 100; do
   for nprobe in 1 5 10; do
     echo "Running IVFFlat (kclusters=$kclusters, nprobe=$nprobe)"
-    ./search $DSET $QSET $TYPE -ivfflat -kclusters $kclusters -nprobe $nprobe \
+    ./search $DSET $QSET $TYPE -gt "$GT" -ivfflat -kclusters $kclusters -nprobe $nprobe \
       -N 1 -R 2000 -range false -o docs/report/results/tmp_ivf.txt > docs/report/results/tmp_ivf.txt
 
     recall=$(grep "Recall@N" docs/report/results/tmp_ivf.txt | awk '{print $2}')
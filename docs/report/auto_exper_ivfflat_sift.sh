@@ -10,6 +10,11 @@ DSET="-d data/sift_base.fvecs"
 QSET="-q data/sift_query.fvecs"
 TYPE="-type sift"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_sift.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 OUT_CSV=docs/report/results/ivfflat_sift.csv
 OUT_TXT=docs/report/results/ivfflat_sift_output.txt
 
@@ -20,7 +25,7 @@ echo "=== IVFFLAT SIFT EXPERIMENT RESULTS ===" > $OUT_TXT
 for kclusters in 20 50 100; do
   for nprobe in 5 10 20; do
     echo "Running IVFFlat SIFT (kclusters=$kclusters, nprobe=$nprobe)"
-    ./search $DSET $QSET $TYPE -ivfflat -kclusters $kclusters -nprobe $nprobe \
+    ./search $DSET $QSET $TYPE -gt "$GT" -ivfflat -kclusters $kclusters -nprobe $nprobe \
       -N 1 -R 2 -range false -o docs/report/results/tmp_ivf_sift.txt > docs/report/results/tmp_ivf_sift.txt
 
     recall=$(grep "Recall@N" docs/report/results/tmp_ivf_sift.txt | awk '{print $2}')
@@ -10,6 +10,11 @@ DSET="-d data/train-images.idx3-ubyte"
 QSET="-q data/t10k-images.idx3-ubyte"
 TYPE="-type mnist"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_mnist.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 OUT_CSV=docs/report/results/ivfpq.csv
 OUT_TXT=docs/report/results/ivfpq_output.txt
 echo "kclusters,nprobe,M,nbits,Recall@N,AF,QPS,tApprox" > $OUT_CSV
@@ -22,7 +27,7 @@ for kclusters in 20 50 100; do
       for nbits in 6 8; do
 
         echo "Running IVFPQ (kclusters=$kclusters, nprobe=$nprobe, M=$M, nbits=$nbits)"
-        ./search $DSET $QSET $TYPE -ivfpq \
+        ./search $DSET $QSET $TYPE -gt "$GT" -ivfpq \
           -kclusters $kclusters -nprobe $nprobe \
           -M $M -nbits $nbits \
           -N 1 -R 2000 -range false \
@@ -13,6 +13,11 @@ DSET="-d data/train-images.idx3-ubyte"
 QSET="-q data/t10k-images.idx3-ubyte"
 TYPE="-type mnist"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_mnist.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 # Step 3: Define output files
 OUT_CSV=docs/report/results/lsh.csv
 OUT_TXT=docs/report/results/lsh_output.txt
@@ -25,7 +30,7 @@ for k in 4 6 8; do
     w=4.0
 
     echo "Running LSH (k=$k, L=$L, w=$w)"
-    ./search $DSET $QSET $TYPE -lsh -k $k -L $L -w $w \
+    ./search $DSET $QSET $TYPE -gt "$GT" -lsh -k $k -L $L -w $w \
       -N 1 -R 2000 -range false -o docs/report/results/tmp_lsh.txt
 
     # Step 5: Extract metrics from output
@@ -10,6 +10,11 @@ DSET="-d data/sift_base.fvecs"
 QSET="-q data/sift_query.fvecs"
 TYPE="-type sift"
 
+# --- Ground truth: exact neighbours computed once, reused by every run below ---
+GT="docs/report/results/gt_sift.ivecs"
+mkdir -p docs/report/results
+[ -f "$GT" ] || ./search $DSET $QSET $TYPE -build_gt -gt "$GT"
+
 # --- Output files ---
 OUT_CSV=docs/report/results/lsh_sift.csv
 OUT_TXT=docs/report/results/lsh_sift_output.txt
@@ -22,7 +27,7 @@ for k in 4 6 8; do
   for L in 5 10 15; do
     w=4.0
     echo "Running LSH SIFT (k=$k, L=$L, w=$w)"
-    ./search $DSET $QSET $TYPE -lsh -k $k -L $L -w $w \
+    ./search $DSET $QSET $TYPE -gt "$GT" -lsh -k $k -L $L -w $w \
       -N 1 -R 2 -range false -o docs/report/results/tmp_lsh_sift.txt
 
     recall=$(grep "Recall@N" docs/report/results/tmp_lsh_sift.txt | awk '{print $2}')
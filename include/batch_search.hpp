@@ -0,0 +1,58 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+#include "parallel.hpp"
+
+// Batch query execution: the whole query set is spread over a thread pool and
+// every query is timed individually, so throughput (QPS) and tail latency can be
+// reported the way a serving deployment would see them.
+
+// One query's answer: (id, distance) pairs, nearest first
+using Neighbors = std::vector<std::pair<int, double>>;
+
+template <class Result>
+struct BatchRun {
+    std::vector<Result> answers;     // answers[qi]
+    std::vector<double> latency_ms;  // latency_ms[qi]
+    double wall_s = 0.0;             // wall time of the whole batch
+    int threads = 1;
+
+    double qps() const { return wall_s > 0.0 ? answers.size() / wall_s : 0.0; }
+
+    double mean_ms() const {
+        double s = 0.0;
+        for (double v : latency_ms) s += v;
+        return latency_ms.empty() ? 0.0 : s / latency_ms.size();
+    }
+
+    // nearest-rank percentile of the per-query latencies, p in [0,100]
+    double percentile_ms(double p) const {
+        if (latency_ms.empty()) return 0.0;
+        std::vector<double> v(latency_ms);
+        std::sort(v.begin(), v.end());
+        size_t rank = static_cast<size_t>(p / 100.0 * v.size() + 0.999999);
+        rank = std::min(std::max<size_t>(rank, 1), v.size());
+        return v[rank - 1];
+    }
+};
+
+// Runs fn(qi) for qi in [0, Q) on `threads` threads and times each call.
+template <class Fn>
+auto run_query_batch(int Q, int threads, Fn&& fn) -> BatchRun<decltype(fn(0))> {
+    using clock = std::chrono::steady_clock;
+    BatchRun<decltype(fn(0))> run;
+    run.answers.resize(std::max(0, Q));
+    run.latency_ms.assign(std::max(0, Q), 0.0);
+    run.threads = std::max(1, threads);
+
+    const auto start = clock::now();
+    parallel_for(0, Q, run.threads, [&](int qi) {
+        const auto t0 = clock::now();
+        run.answers[qi] = fn(qi);
+        run.latency_ms[qi] = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+    });
+    run.wall_s = std::chrono::duration<double>(clock::now() - start).count();
+    return run;
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "dataset_io.hpp"
+
+// Little helpers for the on-disk index formats (LSH, Hypercube, IVFFlat, IVFPQ).
+//
+// File = 8-byte magic, u32 format version, then the fields of the index in a fixed
+// order. Every array is stored as [u64 count][padding to 64 bytes][raw elements],
+// so a reader over a memory-mapped file can hand out aligned zero-copy views
+// (centroids, codebooks, vector copies) instead of copying them.
+// Values are stored in native byte order (little-endian on every target we use).
+
+constexpr size_t kIndexAlign = 64;
+
+class BinWriter {
+public:
+    explicit BinWriter(const std::string& path) : path_(path), out_(path, std::ios::binary) {
+        if (!out_) throw std::runtime_error("Cannot open file for writing: " + path);
+    }
+
+    void header(const char (&magic)[9], uint32_t version) {
+        raw(magic, 8);
+        pod(version);
+    }
+
+    template <class T>
+    void pod(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "pod() needs a trivially copyable type");
+        raw(&v, sizeof(T));
+    }
+
+    template <class T>
+    void array(const T* p, size_t n) {
+        pod(static_cast<uint64_t>(n));
+        align();
+        raw(p, n * sizeof(T));
+    }
+
+    template <class T>
+    void vec(const std::vector<T>& v) { array(v.data(), v.size()); }
+
+    void str(const std::string& s) { array(s.data(), s.size()); }
+
+    // rows are written back to back (views with a larger stride are compacted)
+    template <class T>
+    void matrix(const DenseMatrix<T>& M) {
+        pod(static_cast<int32_t>(M.n));
+        pod(static_cast<int32_t>(M.d));
+        pod(static_cast<uint64_t>(static_cast<size_t>(M.n) * M.d));
+        align();
+        for (int i = 0; i < M.n; ++i) raw(M.row(i), sizeof(T) * M.d);
+    }
+
+    void close() {
+        out_.close();
+        if (!out_) throw std::runtime_error("Write failed: " + path_);
+    }
+
+private:
+    void raw(const void* p, size_t bytes) {
+        out_.write(static_cast<const char*>(p), static_cast<std::streamsize>(bytes));
+        pos_ += bytes;
+    }
+    void align() {
+        static const char zeros[kIndexAlign] = {};
+        raw(zeros, (kIndexAlign - pos_ % kIndexAlign) % kIndexAlign);
+    }
+
+    std::string path_;
+    std::ofstream out_;
+    size_t pos_ = 0;
+};
+
+// Reads an index file through a private mapping; matrix() returns views into it.
+class BinReader {
+public:
+    explicit BinReader(const std::string& path) : path_(path), file_(std::make_shared<MappedFile>(path)) {}
+
+    // checks magic and version; `what` names the index type in error messages
+    void header(const char (&magic)[9], uint32_t version, const std::string& what) {
+        if (file_->size() < 12 || std::memcmp(file_->data(), magic, 8) != 0)
+            throw std::runtime_error(path_ + " is not a " + what + " index file");
+        pos_ = 8;
+        const uint32_t v = pod<uint32_t>();
+        if (v != version)
+            throw std::runtime_error(path_ + ": unsupported " + what + " index version " +
+                                     std::to_string(v) + " (expected " + std::to_string(version) + ")");
+    }
+
+    template <class T>
+    T pod() {
+        T v;
+        std::memcpy(&v, take(sizeof(T)), sizeof(T));
+        return v;
+    }
+
+    // pointer to `n` elements inside the mapping (valid as long as file() is alive)
+    template <class T>
+    const T* array(size_t& n) {
+        n = static_cast<size_t>(pod<uint64_t>());
+        align();
+        if (n > (file_->size() - pos_) / sizeof(T)) fail();
+        return reinterpret_cast<const T*>(take(n * sizeof(T)));
+    }
+
+    template <class T>
+    std::vector<T> vec() {
+        size_t n = 0;
+        const T* p = array<T>(n);
+        return std::vector<T>(p, p + n);
+    }
+
+    std::string str() {
+        size_t n = 0;
+        const char* p = array<char>(n);
+        return std::string(p, n);
+    }
+
+    // zero-copy view into the mapped file (the matrix keeps the mapping alive)
+    template <class T>
+    DenseMatrix<T> matrix() {
+        DenseMatrix<T> M;
+        M.n = pod<int32_t>();
+        M.d = pod<int32_t>();
+        const uint64_t count = pod<uint64_t>();
+        if (M.n < 0 || M.d < 0 || count != static_cast<uint64_t>(M.n) * static_cast<uint64_t>(M.d)) fail();
+        align();
+        if (count > (file_->size() - pos_) / sizeof(T)) fail();
+        M.view = reinterpret_cast<T*>(const_cast<unsigned char*>(file_->data()) + pos_); // read-only view
+        M.stride = static_cast<size_t>(M.d);
+        M.file = file_;
+        take(count * sizeof(T));
+        return M;
+    }
+
+    const std::shared_ptr<MappedFile>& file() const { return file_; }
+
+private:
+    [[noreturn]] void fail() const { throw std::runtime_error(path_ + ": truncated or corrupt index file"); }
+
+    const unsigned char* take(size_t bytes) {
+        if (bytes > file_->size() - pos_) fail();
+        const unsigned char* p = file_->data() + pos_;
+        pos_ += bytes;
+        return p;
+    }
+    void align() {
+        const size_t pad = (kIndexAlign - pos_ % kIndexAlign) % kIndexAlign;
+        take(pad);
+    }
+
+    std::string path_;
+    std::shared_ptr<MappedFile> file_;
+    size_t pos_ = 0;
+};
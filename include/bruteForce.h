@@ -4,6 +4,7 @@
 #include <vector>
 #include <utility>
 #include "vector_utils.h"
+#include "dataset_io.hpp"
 
 //Brute force nearest neighbor search
 //exact number of NN using L2
@@ -17,7 +18,7 @@ namespace brute {
     //N - number of nearest neighbors to return
     //we return a Vector of pairs (index in dataset, distance)
     std::vector<std::pair<int, double>>
-    knnSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float> query, int N);
+    knnSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float>& query, int N);
     
 
     //Finding all points within a given radius(range search)
@@ -26,7 +27,33 @@ namespace brute {
     //R - search radius
     // we return a Vctor of indices of points within R dist
     std::vector<int>
-    rangeSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float> query, double R);
+    rangeSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float>& query, double R);
+
+    //same two searches directly on a Matrix (float, e.g. SIFT) or on raw MNIST bytes (MatrixU8)
+    //rows are read in place (no vector<vector> copy); uint8 data uses the exact integer kernel
+    std::vector<std::pair<int, double>>
+    knnSearch(const Matrix& dataset, const float* query, int N);
+    std::vector<std::pair<int, double>>
+    knnSearch(const MatrixU8& dataset, const uint8_t* query, int N);
+
+    std::vector<int>
+    rangeSearch(const Matrix& dataset, const float* query, double R);
+    std::vector<int>
+    rangeSearch(const MatrixU8& dataset, const uint8_t* query, double R);
+
+    //Exact kNN for a whole batch of queries (ground truth):
+    //distances come from ||x||^2 + ||q||^2 - 2<x,q>, with the inner products computed for
+    //tiles of queries x base rows by the blocked SIMD kernel (dist::ip_block), a bounded heap
+    //per query, and query tiles spread over `threads` threads (0 = all hardware threads).
+    //The best N+margin get their exact distance recomputed before sorting; a query whose cut
+    //cannot be proven safe against the rounding error of the decomposition is rescanned exactly.
+    //result[qi] = N nearest (index, distance) of query qi, ascending
+    std::vector<std::vector<std::pair<int, double>>>
+    knnSearchBatch(const Matrix& dataset, const Matrix& queries, int N, int threads = 0);
+
+    //uint8 data: exact integer distances, one query per task (no decomposition needed)
+    std::vector<std::vector<std::pair<int, double>>>
+    knnSearchBatch(const MatrixU8& dataset, const MatrixU8& queries, int N, int threads = 0);
 
     //NEW - Full knn graph for all points in dataset for project2 using knnSearch inside it
     std::vector<int>
@@ -1,20 +1,99 @@
 #pragma once
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <fstream>
+#include <memory>
 #include <cstdint>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---- memory-mapped file ----------------------------------------------------
+
+// Whole-file read-only mapping, shared (via shared_ptr) by every Matrix view into it.
+// The pages are PROT_READ: views into it must never be written through.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Cannot open file: " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { ::close(fd); throw std::runtime_error("Cannot stat file: " + path); }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ > 0) {
+            void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) { ::close(fd); throw std::runtime_error("Cannot mmap file: " + path); }
+            data_ = static_cast<unsigned char*>(p);
+        }
+        ::close(fd); // the mapping stays valid after close
+    }
+    ~MappedFile() { if (data_) ::munmap(data_, size_); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+};
 
-struct Matrix {
+// ---- dense row-major matrix ------------------------------------------------
+
+// Either owns its data (flattened in `a`) or is a zero-copy view into a mapped
+// file, where row i starts at view + i*stride (stride >= d skips per-row headers).
+template <class T>
+struct DenseMatrix {
     int n = 0;     // number of vectors
     int d = 0;     // dimension
-    std::vector<float> a; // flattened: size = n*d
+    std::vector<T> a; // flattened: size = n*d (empty for file views)
+
+    T* view = nullptr;                 // first row of a file view (nullptr when owning); read-only
+    size_t stride = 0;                 // distance between rows of a view, in elements
+    std::shared_ptr<MappedFile> file;  // keeps the mapping alive
+
+    bool is_view() const { return view != nullptr; }
+    size_t row_stride() const { return view ? stride : static_cast<size_t>(d); } // elements between rows
 
-    float* row(int i)             { return a.data() + static_cast<size_t>(i) * d; }
-    const float* row(int i) const { return a.data() + static_cast<size_t>(i) * d; }
+    T* row(int i)             { return view ? view + static_cast<size_t>(i) * stride : a.data() + static_cast<size_t>(i) * d; }
+    const T* row(int i) const { return view ? view + static_cast<size_t>(i) * stride : a.data() + static_cast<size_t>(i) * d; }
 };
 
+using Matrix   = DenseMatrix<float>;    // SIFT (fvecs) and all float data
+using MatrixU8 = DenseMatrix<uint8_t>;  // raw MNIST pixels
+
+// Non-owning view of M's rows: no copy, shares M's file mapping if M is a view.
+// An owning M must outlive the view (and not be resized).
+template <class T>
+DenseMatrix<T> matrix_view(const DenseMatrix<T>& M) {
+    DenseMatrix<T> V;
+    V.n = M.n;
+    V.d = M.d;
+    V.view = const_cast<T*>(M.row(0));
+    V.stride = M.row_stride();
+    V.file = M.file;
+    return V;
+}
+
+// Copies vector-of-vectors rows into one contiguous owning matrix (all rows must have the same size).
+inline DenseMatrix<float> matrix_from_rows(const std::vector<std::vector<float>>& rows) {
+    DenseMatrix<float> M;
+    M.n = static_cast<int>(rows.size());
+    M.d = rows.empty() ? 0 : static_cast<int>(rows[0].size());
+    M.a.resize(static_cast<size_t>(M.n) * M.d);
+    for (int i = 0; i < M.n; ++i) {
+        if (static_cast<int>(rows[i].size()) != M.d) throw std::runtime_error("matrix_from_rows: rows of different sizes");
+        std::copy(rows[i].begin(), rows[i].end(), M.row(i));
+    }
+    return M;
+}
+
 // ---- utilities -------------------------------------------------------------
 
 inline uint32_t read_u32_be(std::ifstream& in) {
@@ -29,81 +108,111 @@ inline void require(bool cond, const char* msg) {
 
 // ---- MNIST (.idx3-ubyte) → Big-Endian header + pixels ---------------------
 
-// If normalize=true, pixels become [0,1]; else [0,255] as floats.
-inline Matrix load_mnist_images(const std::string& path, bool normalize=false) {
-    std::ifstream in(path, std::ios::binary);
-    if (!in) throw std::runtime_error("Cannot open MNIST file: " + path);
+// Zero-copy view of the raw uint8 pixels (the 16-byte header is skipped).
+inline MatrixU8 map_mnist_images(const std::string& path) {
+    auto file = std::make_shared<MappedFile>(path);
+    require(file->size() >= 16, "MNIST: file too small for header");
 
-    const uint32_t magic = read_u32_be(in);
-    const uint32_t n     = read_u32_be(in);
-    const uint32_t rows  = read_u32_be(in);
-    const uint32_t cols  = read_u32_be(in);
+    const unsigned char* h = file->data();
+    auto be32 = [h](int off) {
+        return (uint32_t(h[off]) << 24) | (uint32_t(h[off+1]) << 16) | (uint32_t(h[off+2]) << 8) | uint32_t(h[off+3]);
+    };
+    const uint32_t magic = be32(0);
+    const uint32_t n     = be32(4);
+    const uint32_t rows  = be32(8);
+    const uint32_t cols  = be32(12);
 
     require(magic == 0x00000803u, "MNIST: wrong magic (expected 2051)");
     require(rows > 0 && cols > 0, "MNIST: invalid image size");
 
     const uint64_t d64 = uint64_t(rows) * cols;
     require(d64 <= INT32_MAX, "MNIST: dimension too large");
-    const int d = static_cast<int>(d64);
+    require(n <= INT32_MAX, "MNIST: too many images");
+    require(16 + uint64_t(n) * d64 <= file->size(), "MNIST: unexpected EOF while reading pixels");
 
-    Matrix M;
+    MatrixU8 M;
     M.n = static_cast<int>(n);
-    M.d = d;
-    M.a.resize(static_cast<size_t>(M.n) * M.d);
+    M.d = static_cast<int>(d64);
+    M.view = const_cast<uint8_t*>(file->data() + 16);
+    M.stride = static_cast<size_t>(M.d);
+    M.file = std::move(file);
+    return M;
+}
 
-    std::vector<unsigned char> buf(d);
+// Expands bytes to floats (for engines that work on float vectors only).
+inline Matrix to_float(const MatrixU8& px, float scale = 1.0f) {
+    Matrix M;
+    M.n = px.n;
+    M.d = px.d;
+    M.a.resize(static_cast<size_t>(M.n) * M.d);
     for (int i = 0; i < M.n; ++i) {
-        if (!in.read(reinterpret_cast<char*>(buf.data()), d))
-            throw std::runtime_error("MNIST: unexpected EOF while reading pixels");
-        if (normalize) {
-            for (int j = 0; j < d; ++j) M.a[size_t(i)*d + j] = buf[j] / 255.0f;
-        } else {
-            for (int j = 0; j < d; ++j) M.a[size_t(i)*d + j] = static_cast<float>(buf[j]);
-        }
+        const uint8_t* src = px.row(i);
+        float* dst = M.row(i);
+        for (int j = 0; j < M.d; ++j) dst[j] = src[j] * scale;
     }
     return M;
 }
 
-// ---- SIFT (.fvecs) → Little-Endian blocks [int dim][dim floats] -----------
+// If normalize=true, pixels become [0,1]; else [0,255] as floats.
+inline Matrix load_mnist_images(const std::string& path, bool normalize=false) {
+    return to_float(map_mnist_images(path), normalize ? 1.0f / 255.0f : 1.0f);
+}
 
-// Reads until EOF. Verifies all vectors share the same dimension.
-inline Matrix load_fvecs(const std::string& path) {
-    std::ifstream in(path, std::ios::binary);
-    if (!in) throw std::runtime_error("Cannot open fvecs file: " + path);
+// ---- SIFT (.fvecs / .ivecs) → Little-Endian blocks [int dim][dim values] --
 
-    // Determine file size to pre-allocate roughly
-    in.seekg(0, std::ios::end);
-    std::streampos end = in.tellg();
-    in.seekg(0, std::ios::beg);
+// Zero-copy view: the file is mapped and rows are read in place with a stride
+// of dim+1 elements, skipping each record's 4-byte dimension header.
+// All records must share the same dimension: every header is checked (one
+// 4-byte read per record, cheap next to the first pass over the data).
+// `fmt` only prefixes the error messages ("fvecs", "ivecs").
+template <class T>
+inline DenseMatrix<T> map_vecs(const std::string& path, const std::string& fmt) {
+    static_assert(sizeof(T) == 4, "vecs records hold 4-byte values");
+    auto fail = [&fmt](const char* msg) { throw std::runtime_error(fmt + ": " + msg); };
 
-    Matrix M;
-    int common_d = -1;
-    std::vector<float> data;
-    data.reserve(static_cast<size_t>( (end / 4) )); // rough upper bound
+    auto file = std::make_shared<MappedFile>(path);
+    if (file->size() < 4) fail("file contains zero vectors");
 
-    while (true) {
+    auto dim_at = [&file](size_t off) {
         int32_t d = 0;
-        in.read(reinterpret_cast<char*>(&d), 4);
-        if (!in) {
-            // normal EOF (no partial record)
-            break;
-        }
-        require(d > 0 && d <= 65536, "fvecs: invalid dimension");
-        if (common_d == -1) common_d = d;
-        require(d == common_d, "fvecs: mixed dimensions are not supported");
+        std::memcpy(&d, file->data() + off, 4);
+        return d;
+    };
 
-        const size_t off = data.size();
-        data.resize(off + static_cast<size_t>(d));
+    const int32_t d = dim_at(0);
+    if (d <= 0 || d > 65536) fail("invalid dimension");
 
-        // read d floats
-        in.read(reinterpret_cast<char*>(data.data() + off), sizeof(float) * static_cast<size_t>(d));
-        require(static_cast<bool>(in), "fvecs: unexpected EOF inside a vector");
-        ++M.n;
-    }
+    const size_t rec = 4 + sizeof(T) * static_cast<size_t>(d);
+    if (file->size() % rec != 0) fail("unexpected EOF inside a vector (or mixed dimensions)");
+    const size_t n = file->size() / rec;
+    if (n > INT32_MAX) fail("too many vectors");
+    for (size_t i = 1; i < n; ++i)
+        if (dim_at(i * rec) != d) fail("mixed dimensions are not supported");
 
-    if (M.n == 0) throw std::runtime_error("fvecs: file contains zero vectors");
-    M.d = common_d;
-    M.a = std::move(data);
-    require(static_cast<int>(M.a.size()) == M.n * M.d, "fvecs: size mismatch");
+    DenseMatrix<T> M;
+    M.n = static_cast<int>(n);
+    M.d = d;
+    M.view = reinterpret_cast<T*>(const_cast<unsigned char*>(file->data()) + 4);
+    M.stride = static_cast<size_t>(d) + 1;
+    M.file = std::move(file);
     return M;
 }
+
+using MatrixI32 = DenseMatrix<int32_t>; // ivecs (e.g. ground-truth neighbour ids)
+
+inline Matrix load_fvecs(const std::string& path) { return map_vecs<float>(path, "fvecs"); }
+
+inline MatrixI32 load_ivecs(const std::string& path) { return map_vecs<int32_t>(path, "ivecs"); }
+
+// Writes n rows of k ids (row-major in `ids`) as ivecs.
+inline void save_ivecs(const std::string& path, const std::vector<int32_t>& ids, int n, int k) {
+    require(static_cast<size_t>(n) * k == ids.size(), "ivecs: size does not match n*k");
+    std::ofstream out(path, std::ios::binary);
+    if (!out) throw std::runtime_error("Cannot open file for writing: " + path);
+    const int32_t dim = k;
+    for (int i = 0; i < n; ++i) {
+        out.write(reinterpret_cast<const char*>(&dim), 4);
+        out.write(reinterpret_cast<const char*>(ids.data() + static_cast<size_t>(i) * k), sizeof(int32_t) * k);
+    }
+    if (!out) throw std::runtime_error("Write failed: " + path);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Distance kernels shared by every engine (brute force, LSH, Hypercube, k-means, IVFFlat, IVFPQ).
+// Each kernel has a scalar reference version and SSE / AVX2 / AVX-512 variants; the
+// fastest variant supported by the running CPU is selected once at start-up.
+
+namespace dist {
+
+    enum class Level { Scalar = 0, SSE = 1, AVX2 = 2, AVX512 = 3 };
+
+    // Function table of one SIMD level
+    struct Kernels {
+        float (*l2_sq)(const float* a, const float* b, int d);          // ||a - b||^2
+        float (*inner_product)(const float* a, const float* b, int d);  // <a, b>
+        uint32_t (*l2_sq_u8)(const uint8_t* a, const uint8_t* b, int d); // exact integer ||a - b||^2
+        float (*l2_sq_u8f32)(const uint8_t* a, const float* b, int d);  // bytes vs float (e.g. centroids)
+        void (*ip_block)(const float* q, size_t q_stride, int nq,
+                         const float* x, size_t x_stride, int nx, int d, float* out); // see ip_block below
+        void (*pq4_scan)(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out); // see pq4_scan below
+    };
+
+    // ---- dispatched kernels (use these in hot loops) ----
+
+    // squared Euclidean distance ||a - b||^2
+    float l2_sq(const float* a, const float* b, int d);
+
+    // inner product <a, b>
+    float inner_product(const float* a, const float* b, int d);
+
+    // uint8 vectors (MNIST pixels): exact u8 x u8 -> u32, no float expansion of the data
+    uint32_t l2_sq(const uint8_t* a, const uint8_t* b, int d);
+
+    // uint8 point against a float vector (k-means / IVF centroids are fractional)
+    float l2_sq(const uint8_t* a, const float* b, int d);
+
+    // Inner products of a tile of nq queries with a tile of nx base rows (GEMM-style):
+    // out[i*nx + j] = <q_i, x_j>, rows are q_stride / x_stride floats apart.
+    // Several queries share every load of a base row, so the tile stays in registers/L1.
+    void ip_block(const float* q, size_t q_stride, int nq,
+                  const float* x, size_t x_stride, int nx, int d, float* out);
+
+    // 4-bit PQ fast-scan of one block of 32 codes: codes = M groups of 16 bytes, byte j holding the
+    // code of vector j (low nibble) and of vector j+16 (high nibble); lut = M x 16 uint8 distances.
+    // out[j] = sum over m of lut[m*16 + code_m(j)] (exact in uint16 for M <= 257).
+    // The LUTs sit in registers and are looked up with pshufb, 16 codes per instruction.
+    void pq4_scan(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out);
+
+    // ---- dispatch control ----
+
+    // best level supported by this CPU (and by the compiler)
+    Level detect_level();
+
+    // level currently used by l2_sq / inner_product
+    Level active_level();
+
+    // kernels of a given level, clamped to the best level this CPU supports (AVX512 on an AVX2 CPU -> AVX2)
+    const Kernels& kernels(Level lv);
+
+    // printable name of a level ("scalar", "sse", "avx2", "avx512")
+    const char* level_name(Level lv);
+}
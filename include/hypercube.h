@@ -3,29 +3,59 @@
 
 #include <vector>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
 #include <utility>
 #include "vector_utils.h"
+#include "binary_io.hpp"
+#include "projection.hpp"
+#include "parallel.hpp"
 
 //Hypercube ANN for Euclidean distance (L2)
 //h_i(p) = floor((v_i * p + t_i)/w),   v_i ~ N(0,1)^d,  t_i ~ U(0,w)
-//f_i: Z -> {0,1} (random but consistent per i)
-//g(p) = [ f_1(h_1(p)), ..., f_k(h_k(p)) ]  (k-bit vertex)
+//f_i: Z -> {0,1}: top bit of a 64-bit mix of (salt_i, h), salt_i derived from the seed, so f is
+//stateless and every query is a pure function of the index (const, safe from many threads)
+//g(p) = [ f_1(h_1(p)), ..., f_k(h_k(p)) ]  (k-bit vertex, bit i of a 64-bit mask = f_i, so k <= 64)
 //Build: For each point p: compute g(p) and insert its index into cube[g(p)]. 
 //Query (KNN / Range):- Compute g(q), look in that vertex and in up to "probes" nearby vertices (small Hamming distance),
 // examining at most `M` points total *  - Compute true distances for collected candidates and return top-N / within R
+//The nearby vertices are g(q) XOR a fixed list of masks in Hamming-ball order (weight 0, 1, 2, ...),
+//computed once per index and g(q) is hashed into a stack buffer, so probing allocates nothing.
 
 namespace cube {
-    //L2 hash function (projection + shift + binning)
-    class HFunction {
-        public: 
-            HFunction(int dim, double w); //constructor
-            int hash(const std::vector<float>& p) const; //compute h(p)
-        private:
-            std::vector<float> v; //random projection Gaussian vector N(0, 1)^
-            double t_off; //random offset in [0, w)
-            double w_bucket; //bucket width
+    using Vertex = uint64_t;
+
+    //vertex -> point indices in CSR form: the points of all vertices in one array, grouped by
+    //vertex in index order. k <= 24: dense offsets over all 2^k vertices (vertex v is
+    //points[offsets[v] .. offsets[v+1])); larger k: only the non-empty vertices, with sorted keys
+    //found by binary search.
+    struct VertexTable {
+        static constexpr int kDenseMaxBits = 24;
+
+        bool sparse = false; //layout: keys + offsets (k > kDenseMaxBits) or dense offsets
+        std::vector<Vertex> keys; //sorted non-empty vertices (sparse form), empty in dense form
+        std::vector<uint32_t> offsets; //dense: 2^k + 1, sparse: keys.size() + 1
+        std::vector<unsigned> points;
+
+        //builds the table from vertex[i] of points i = 0..n-1 (dense form on `threads` threads,
+        //same layout for any count)
+        void build(const std::vector<Vertex>& vertex, int k, int threads = 1);
+
+        //points of vertex v as [first, last) (empty range if the vertex is empty)
+        std::pair<const unsigned*, const unsigned*> find(Vertex v) const {
+            size_t pos;
+            if(!sparse){
+                if(v + 1 >= offsets.size()) return {nullptr, nullptr};
+                pos = static_cast<size_t>(v);
+            } else {
+                auto it = std::lower_bound(keys.begin(), keys.end(), v);
+                if(it == keys.end() || *it != v) return {nullptr, nullptr};
+                pos = static_cast<size_t>(it - keys.begin());
+            }
+            const unsigned* base = points.data();
+            return {base + offsets[pos], base + offsets[pos + 1]};
+        }
     };
 
     //hypercube index class
@@ -39,17 +69,32 @@ namespace cube {
         public:
             Hypercube(int dim, int k, double w, int M, int probes, unsigned seed = 1);
 
-            //build index from dataset
+            //build index from dataset: base is referenced, not copied (it must outlive the index);
+            //the vector-of-vectors overload copies the rows once, contiguously
+            void buildIndex(const Matrix& base);
             void buildIndex(const std::vector<std::vector<float>>& dataset);
 
-            //approximate k-NN search
+            //approximate k-NN search (pointer overloads: query of dim floats)
+            std::vector<std::pair<int, double>>
+            searchKNN(const float* query, int N) const;
             std::vector<std::pair<int, double>>
             searchKNN(const std::vector<float>& query, int N) const;
 
             //range search within radius R
             std::vector<int>
+            searchRadius(const float* query, double R) const;
+            std::vector<int>
             searchRadius(const std::vector<float>& query, double R) const;
 
+            //versioned binary index file: k, w, seed, projections and vertex buckets
+            //(M and probes are query knobs and keep the constructor's values)
+            void saveIndex(const std::string& path) const;
+            void loadIndex(const std::string& path, const Matrix& base);
+            void loadIndex(const std::string& path, const std::vector<std::vector<float>>& dataset);
+
+            //threads of buildIndex (0 = all hardware threads); the index does not depend on it
+            void setBuildThreads(int threads) { build_threads_ = threads; }
+
         private:
             int dimension; //dimensionality of vectors
             int k_bits; //num of bits (cube dimension)
@@ -57,26 +102,49 @@ namespace cube {
             int M_points; //max num of points to examine per query
             int probes_v; //max num of vertices to visit per query
             unsigned seed_; //rng seed
+            int build_threads_ = 0; //threads of buildIndex (0 = all)
+
 
+            RandomProjections h_F; //the k h-functions, one row each
 
-            std::vector<HFunction> h_F; //k H-Functions
+            // f_i salts: f_i(h) = fBit(f_salt[i], h) for each i in [0..k)
+            std::vector<uint64_t> f_salt;
 
-            // f_i tables: for each i in [0..k), map h_i(p) -> {0,1}
-            // mutable so we can lazily fill during const queries
-            mutable std::vector<std::unordered_map<int,int>> f_tables;
+            //cube: k-bit vertex -> indices of points
+            VertexTable cube_;
 
-            //cube: key = k-bit vertex striing, value = indices of points
-            std::unordered_map<std::string, std::vector<unsigned>> cube_;
+            //XOR masks of the vertices to visit, in Hamming-ball order (mask 0 = home first)
+            std::vector<Vertex> probe_masks_;
 
-            //stored dataset
-            std::vector<std::vector<float>> stored_dataset;
+            //base vectors: a view of the caller's Matrix, or of own_
+            Matrix base_;
+            std::shared_ptr<const Matrix> own_; //rows copied by the vector-of-vectors overloads
 
             //computing k-bit vertex for point p (g(p))
-            std::string hashToVertex(const std::vector<float>& p) const;
+            Vertex hashToVertex(const float* p) const;
+            Vertex hashToVertex(const int* h) const; //from the k h-values of a point
+
+            //masks of up to limit vertices in increasing Hamming distance order (lexicographic bit
+            //combinations within a distance); mask 0 ("home") counts as the 1st / never exceeds "limit"
+            static std::vector<Vertex> enumerateProbes(int k, int limit);
+
+            //salts of the k f-functions, a fixed function of the seed
+            static std::vector<uint64_t> makeSalts(int k, unsigned seed);
+
+            //splitmix64 finalizer: every input bit affects every output bit
+            static uint64_t mix64(uint64_t x) {
+                x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+                return x ^ (x >> 31);
+            }
+
+            //f_i(h): one bit, a deterministic hash of h under the salt of f_i
+            static int fBit(uint64_t salt, int h) { return static_cast<int>(mix64(salt ^ static_cast<uint32_t>(h)) >> 63); }
+
+            //indices in the probed vertices, at most M_points of them (distinct: a point lives in one vertex)
+            void collectCandidates(const float* query, std::vector<unsigned>& candidates) const;
 
-            //generating up to limit vertices in increasing Hamming distance order
-            //start: "home" (counts as 1st) / never exceeds "limit"
-            std::vector<std::string> enumerateProbes(const std::string& home, int limit) const;
+            void checkDim(const std::vector<float>& query) const; //throws on a query of the wrong size
 
         };
 
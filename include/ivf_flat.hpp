@@ -1,18 +1,44 @@
 #pragma once
+#include <string>
 #include <vector>
-#include "dataset_io.hpp"  // Matrix { int n,d; std::vector<float> a; float* row(int); }
+#include "dataset_io.hpp"  // Matrix { int n,d; float* row(int); } (owned or mmap view)
 #include "kmeans.hpp"      // KMeansParams, KMeansResult, kmeans_train
 
 // Δομή του IVFFlat index: coarse centroids + inverted lists με IDs βάσης
 struct IVFIndexFlat {
     Matrix centroids;                       // k × d
     std::vector<std::vector<int>> lists;    // lists[j] = IDs σημείων στο cluster j
+
+    // Προαιρετικό συνεχές αντίγραφο των διανυσμάτων ανά λίστα (contiguous layout):
+    // τα διανύσματα της λίστας j είναι οι γραμμές list_offset[j] .. list_offset[j+1]-1,
+    // με την ίδια σειρά όπως στο lists[j]. Κάθε probed λίστα σαρώνεται σειριακά αντί
+    // για τυχαία base.row(id). Κενό list_offset = μόνο IDs (διαβάζουμε από το base).
+    std::vector<size_t> list_offset;        // k+1
+    Matrix   vecs;                          // αντίγραφο για float base
+    MatrixU8 vecs8;                         // αντίγραφο για uint8 base (MNIST)
+
+    bool contiguous() const { return !list_offset.empty(); }
 };
 
 // Κατασκευή του IVFFlat:
 //  - Εκπαιδεύει k-means (με k-means++) στο base (προαιρετικά σε train_subset ≈ sqrt(n))
 //  - Δημιουργεί inverted lists χρησιμοποιώντας τις τελικές αναθέσεις
-IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int train_subset);
+//  - contiguous=true: κρατά και αντίγραφο των διανυσμάτων ταξινομημένο ανά λίστα
+//  - km: από εδώ παίρνει μόνο algo, threads και mini-batch (batch_size, batch_iters) του k-means
+//        (τα υπόλοιπα τα ορίζει ο builder· με mini-batch εκπαιδεύεται σε όλο το base, όχι σε train_subset)
+IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int train_subset,
+                            bool contiguous = false, const KMeansParams& km = KMeansParams());
+IVFIndexFlat build_ivf_flat(const MatrixU8& base, int kclusters, int seed, int train_subset,
+                            bool contiguous = false, const KMeansParams& km = KMeansParams()); // MNIST bytes
+
+// Μνήμη του index σε bytes (centroids + λίστες IDs + το αντίγραφο, αν υπάρχει)
+size_t ivf_flat_memory_bytes(const IVFIndexFlat& ivf);
+
+// Αποθήκευση / φόρτωση του index (versioned binary, βλ. binary_io.hpp).
+// Η φόρτωση κάνει mmap: centroids και αντίγραφο διανυσμάτων είναι views στο αρχείο.
+// n, d: διαστάσεις του base με το οποίο θα χρησιμοποιηθεί (ελέγχονται).
+void save_ivf_flat(const std::string& path, const IVFIndexFlat& ivf, int n, int d);
+IVFIndexFlat load_ivf_flat(const std::string& path, int n, int d);
 
 // Αποτέλεσμα top-N: IDs + αποστάσεις (αύξουσα σειρά)
 struct TopN {
@@ -28,6 +54,7 @@ TopN ivf_flat_query_topN(const IVFIndexFlat& ivf,
                          const float* q,
                          int nprobe,
                          int N);
+TopN ivf_flat_query_topN(const IVFIndexFlat& ivf, const MatrixU8& base, const uint8_t* q, int nprobe, int N);
 
 // Ερώτημα range-R:
 //  - Όπως πάνω, αλλά επιστρέφει ΟΛΑ τα IDs από τις nprobe λίστες με ||q - x|| ≤ R
@@ -36,3 +63,5 @@ std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf,
                                       const float* q,
                                       int nprobe,
                                       float R);
+std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf, const MatrixU8& base, const uint8_t* q,
+                                      int nprobe, float R);
@@ -1,6 +1,8 @@
 #pragma once
+#include <string>
 #include <vector>
 #include <cstdint>
+#include <cstring>
 #include "dataset_io.hpp"
 #include "kmeans.hpp"
 
@@ -11,23 +13,63 @@ struct PQCodebooks {
     int s = 256;       // codewords per subspace (2^nbits)
     int dsub = 0;      // dims per subspace (= d / M)
     std::vector<Matrix> C; // C[i]: s x dsub (centroids ανά υποχώρο)
+
+    // bytes ανά διάνυσμα: M*nbits bits πακεταρισμένα (nbits=6, M=16 -> 12 bytes αντί για 16)
+    size_t code_size() const { return ((size_t)M * nbits + 7) / 8; }
 };
 
+// Οι κώδικες ενός διανύσματος είναι συνεχόμενα bit fields των nbits (LSB πρώτα, ο υποχώρος i στο bit i*nbits).
+// Κάθε inverted list έχει kPQCodePad bytes padding στο τέλος, ώστε το pq_code να διαβάζει πάντα 4 bytes
+// (nbits <= 16 και shift <= 7 χωράνε σε 32 bits): load, shift, mask, χωρίς branches.
+constexpr size_t kPQCodePad = 3;
+
+inline uint32_t pq_code(const uint8_t* code, int i, int nbits) {
+    const size_t bit = (size_t)i * nbits;
+    uint32_t w;
+    std::memcpy(&w, code + (bit >> 3), sizeof(w));
+    return (w >> (bit & 7)) & ((1u << nbits) - 1);
+}
+
 // IVF+PQ index
 struct IVFIndexPQ {
     Matrix centroids;                       // k x d (coarse)
     PQCodebooks pq;                         // shared codebooks
+    // Προϋπολογισμένοι πίνακες ADC: ||q-c-r||² = ||q-c||² + (||r||² + 2<c,r>) - 2<q,r>.
+    // coarse_terms.row(c)[i*s + h] = ||C_i[h]||² + 2<c_i, C_i[h]> (ο όρος που δεν εξαρτάται από το q),
+    // οπότε ανά query χτίζεται ένας μόνο πίνακας -2<q_i, C_i[h]> (M x s) και όχι ένα LUT ανά λίστα.
+    // Για nbits > 8 ο πίνακας θα ήταν k*M*2^nbits floats: μένει 0 x 0 και οι όροι υπολογίζονται ανά λίστα.
+    Matrix coarse_terms;                    // k x (M*s)
+    // OPQ: ορθογώνιος πίνακας P (d x d) που περιστρέφει residuals και queries (y = P r) πριν χωριστούν
+    // σε υποχώρους, ώστε η διασπορά να μοιράζεται καλύτερα ανάμεσά τους. 0 x 0 = απλό PQ.
+    // Τα codebooks και τα coarse_terms είναι στον περιστραμμένο χώρο.
+    Matrix opq;
     std::vector<std::vector<int>> ids;      // inverted lists: ids[c]
-    std::vector<std::vector<uint8_t>> codes;// inverted lists: flat codes[c] (packed M bytes per vector)
+    std::vector<std::vector<uint8_t>> codes;// inverted lists: codes[c] = code_size() bytes ανά διάνυσμα (+kPQCodePad), κενό σε fast-scan
+
+    // 4-bit fast-scan (nbits=4): codes4[c] = η λίστα c σε blocks των 32 διανυσμάτων, κάθε block M ομάδες
+    // των 16 bytes (byte j: κώδικας του διανύσματος j στο χαμηλό nibble, του j+16 στο υψηλό), βλ. dist::pq4_scan
+    bool fast_scan = false;
+    std::vector<std::vector<uint8_t>> codes4;
 };
 
 // Κατασκευή IVFPQ:
 //  - coarse k-means (kclusters)
 //  - εκπαίδευση PQ codebooks (M, nbits) πάνω σε residuals
 //  - κωδικοποίηση residuals και χτίσιμο inverted lists
+//  - προϋπολογισμός των coarse_terms
+//  - km: algo και threads για όλα τα k-means (coarse και codebooks), mini-batch μόνο για το coarse
+//  - opq_iters > 0: OPQ (Ge et al., non-parametric), εναλλάσσει opq_iters φορές εκπαίδευση codebooks
+//    και Procrustes για την περιστροφή, πριν την τελική εκπαίδευση των codebooks
 IVFIndexPQ build_ivf_pq(const Matrix& base,
                         int kclusters, int M, int nbits,
-                        int seed, int train_subset);
+                        int seed, int train_subset,
+                        const KMeansParams& km = KMeansParams(), int opq_iters = 0);
+
+// Μετατρέπει ένα index με nbits=4 σε fast-scan layout (codes -> codes4, τα codes αδειάζουν).
+// Στο query οι float LUTs κβαντίζονται σε uint8 ανά λίστα και σαρώνονται 32 κώδικες τη φορά με pshufb.
+// Όσοι υποψήφιοι μπορεί ακόμη να μπουν στα αποτελέσματα (με περιθώριο για το σφάλμα στρογγυλοποίησης)
+// ξαναβαθμολογούνται με τα float LUTs, οπότε τα αποτελέσματα είναι ίδια με το κανονικό ADC.
+void ivf_pq_pack_fast_scan(IVFIndexPQ& ivf);
 
 // Top-N: ADC με LUTs στις nprobe λίστες
 struct TopNPQ {
@@ -35,11 +77,18 @@ struct TopNPQ {
     std::vector<float> dists;
 };
 
+// refine > 0: κρατάμε τους refine*N καλύτερους κατά ADC και τους ξαναβαθμολογούμε με ακριβή L2
+// πάνω στα αρχικά διανύσματα του base (στη μνήμη ή mmap), οπότε ids/dists είναι οι πραγματικοί top-N
+// ανάμεσα στους υποψηφίους. Το base διαβάζεται μόνο για αυτές τις γραμμές, όχι στο scan των λιστών.
 TopNPQ ivf_pq_query_topN(const IVFIndexPQ& ivf,
-                       const Matrix& base, // μόνο για d και για πιθανή επαλήθευση, δεν διαβάζουμε floats
-                       const float* q, int nprobe, int N);
+                       const Matrix& base, // διαβάζεται μόνο όταν refine > 0
+                       const float* q, int nprobe, int N, int refine = 0);
 
 // Range-R: επιστρέφει ids με approx απόσταση ≤ R
-std::vector<int> ivf_pq_query_range(const IVFIndexPQ& ivf,
-                                    const Matrix& base,
-                                    const float* q, int nprobe, float R);
+std::vector<int> ivf_pq_query_range(const IVFIndexPQ& ivf, const float* q, int nprobe, float R);
+
+// Αποθήκευση / φόρτωση (versioned binary, βλ. binary_io.hpp): coarse centroids,
+// codebooks, coarse_terms, opq, ids και codes (ή codes4 σε fast-scan). Η φόρτωση κάνει mmap (centroids/codebooks/coarse_terms = views).
+// n, d: διαστάσεις του base (ελέγχονται κατά τη φόρτωση).
+void save_ivf_pq(const std::string& path, const IVFIndexPQ& ivf, int n, int d);
+IVFIndexPQ load_ivf_pq(const std::string& path, int n, int d);
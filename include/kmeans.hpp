@@ -4,7 +4,14 @@
 #include <cstdint>
 #include <limits>
 #include <stdexcept>
-#include "dataset_io.hpp"  // Matrix { int n,d; std::vector<float> a; float* row(int); }
+#include "dataset_io.hpp"  // Matrix { int n,d; float* row(int); } (owned or mmap view)
+
+// Assignment step of the iterations.
+//  Lloyd:   every point against every centroid.
+//  Hamerly: triangle-inequality bounds (one upper bound to the own centroid, one lower bound to
+//           the second closest, half the distance to the nearest other centroid) skip most of the
+//           distance evaluations; the assignments, centroids and iterations are the same as Lloyd's.
+enum class KMeansAlgo { Lloyd, Hamerly };
 
 struct KMeansParams {
     int   k           = 50;     // number of clusters
@@ -13,15 +20,28 @@ struct KMeansParams {
     int   seed        = 1;      // RNG seed
     bool  use_kmeanspp = true;  // k-means++ initialization
     int   train_subset = -1;    // if >0, use that many points to train (e.g. sqrt(n)); else use all
+    int   threads     = 0;      // worker threads (0 = all hardware threads); the result does not depend on it
+    KMeansAlgo algo   = KMeansAlgo::Lloyd; // assignment step (same result either way)
+
+    // Mini-batch k-means (Sculley 2010): each step assigns batch_size random points and moves
+    // every centroid towards its points with a per-centroid learning rate 1/(points seen so far).
+    // Memory is O(batch_size + k*d) besides X (which may be an mmap view), time O(steps*batch*k*d)
+    // plus one final assignment pass, so it trains on the whole of a very large base.
+    // train_subset (if >0) restricts the points batches are drawn from; max_iters and algo do not apply.
+    int   batch_size  = 0;      // >0: mini-batch with that many points per step; 0 = full-batch Lloyd
+    int   batch_iters = 200;    // mini-batch steps (stops earlier when every centroid moves < tol)
 };
 
 struct KMeansResult {
     Matrix centroids;           // k x d
     std::vector<int> assign;    // size = X.n : nearest centroid id for each point in X
-    float final_sse = 0.0f;     // SSE on training set at convergence
-    int   iters     = 0;        // iterations performed
+    float final_sse = 0.0f;     // SSE on training set at convergence (mini-batch: on all of X)
+    int   iters     = 0;        // iterations performed (mini-batch: steps)
 };
 
 // Train k-means on X. If train_subset > 0, fit on a subsample but return
 // assignments for the FULL X using the final centroids.
 KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p);
+
+// Same on uint8 data (MNIST pixels); centroids stay float.
+KMeansResult kmeans_train(const MatrixU8& X, const KMeansParams& p);
@@ -3,66 +3,158 @@
 
 #include <vector>
 #include <string>
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <unordered_set>
 #include <random>
 #include <utility>
 #include <cstdint>
+#include <memory>
 #include "vector_utils.h"
 #include "vutils.hpp"
+#include "binary_io.hpp"
+#include "projection.hpp"
+#include "parallel.hpp"
 
 
 //Locality Sensitive Hashing for approximate nearest neighbor search with L2 distance(Euclidean distance)
 //implements h-and g- functions as described based on random projections and uniform offsets
-//uses STL unordered_map as the hash table
+//hash tables are built once into a flat CSR layout (see BucketTable)
 
 namespace lsh {
     
-    //class HFunction represents a single hash function h(p) = floor((v*p + t) / w)
-    class HFunction {
-        public:
-            HFunction(int dim, double w); //constructor - dim: dimension of input vectors, w: bucket width
-            int hash(const std::vector<float>& p) const; //compute h(p) for input vector p
-        private:
-            std::vector<float> v; //random projection vector N(0, 1)^d
-            double t_off; //random offset in [0, w)
-            double w_bucket; //bucket width
-        };
-
-    //class Gfunction represents a combination of k HFunctions  
+    //class GFunction combines the k h-values of one table into an ID and a bucket
+    //(the h-values themselves come from the LSH's shared projection matrix)
     class GFunction {
         public:
-            GFunction(int dim, double w, int k, int tableSize); //constructor
-            int computeHashValue(const std::vector<float>& p, unsigned int& id) const; 
+            GFunction(int k, int tableSize); //constructor
+            GFunction() = default; //empty, filled by read()
+            int computeHashValue(const int* h, unsigned int& id) const; //h: the k h-values of this g
+            void write(BinWriter& w) const; //serialization (coefficients, table size)
+            void read(BinReader& r);
+            bool consistent(int k) const; //a loaded g has k coefficients and nonzero moduli
         private:
-            std::vector<HFunction> hFunctions; //the k h functions of this g 
             std::vector<int> rand_coeffs; //random coefficients for combining h's into g
-            int table_size; //size of the hash table (number of buckets)
-            uint64_t M; //a large prime number for modulus
+            int table_size = 1; //size of the hash table (number of buckets)
+            uint64_t M = 4294967291ULL; //a large prime number for modulus
 
     };
 
+    //one hash table in CSR form: the (index, ID) pairs of all buckets in one array, grouped by
+    //bucket in index order, and an offsets array delimiting every bucket.
+    //bucket numbers lie in [0, table_size): when table_size is not much larger than the number of
+    //points the offsets are dense (bucket b is entries[offsets[b] .. offsets[b+1])), otherwise only
+    //the non-empty buckets are kept, with their numbers in sorted keys and found by binary search.
+    //a probe is one offsets lookup and a linear scan, with no per-bucket allocation.
+    struct BucketTable {
+        struct Entry { unsigned index, id; }; //(index into the dataset, ID of the g function)
+
+        std::vector<int> keys; //sorted non-empty bucket numbers (sparse form), empty in dense form
+        std::vector<uint32_t> offsets; //dense: table_size + 1, sparse: keys.size() + 1
+        std::vector<Entry> entries;
+
+        //builds the table from bucket[i], id[i] of points i = 0..n-1 (dense form on `threads`
+        //threads, same layout for any count)
+        void build(const std::vector<int>& bucket, const std::vector<unsigned>& id, int table_size, int threads = 1);
+
+        //entries of bucket b as [first, last) (empty range if the bucket is empty)
+        std::pair<const Entry*, const Entry*> find(int b) const {
+            size_t pos;
+            if(keys.empty()){
+                if(b < 0 || static_cast<size_t>(b) + 1 >= offsets.size()) return {nullptr, nullptr};
+                pos = static_cast<size_t>(b);
+            } else {
+                auto it = std::lower_bound(keys.begin(), keys.end(), b);
+                if(it == keys.end() || *it != b) return {nullptr, nullptr};
+                pos = static_cast<size_t>(it - keys.begin());
+            }
+            const Entry* base = entries.data();
+            return {base + offsets[pos], base + offsets[pos + 1]};
+        }
+
+        size_t memoryBytes() const {
+            return keys.size() * sizeof(int) + offsets.size() * sizeof(uint32_t) + entries.size() * sizeof(Entry);
+        }
+    };
 
     class LSH{
         public:
             LSH(int dim, int k, int L, double w, int tableSize = -1, unsigned seed = 1); //-1 for tableSize for auto  
-            void buildIndex(const std::vector<std::vector<float>>& dataset);
+            //the index references base (no copy): base must outlive the index
+            void buildIndex(const Matrix& base);
+            void buildIndex(const std::vector<std::vector<float>>& dataset); //copies the rows once, contiguously
+
+            //query: dimension() floats
+            std::vector<std::pair<int, double>> searchKNN(const float* query, int N) const;
+            std::vector<int> searchRadius(const float* query, double R) const;
             std::vector<std::pair<int, double>> searchKNN(const std::vector<float>& query, int N) const;
             std::vector<int> searchRadius(const std::vector<float>& query, double R) const;
 
+            //versioned binary index file: parameters, random projections and hash tables
+            //loadIndex replaces everything set by the constructor; base must be the one it was built on
+            //(referenced like in buildIndex)
+            void saveIndex(const std::string& path) const;
+            void loadIndex(const std::string& path, const Matrix& base);
+            void loadIndex(const std::string& path, const std::vector<std::vector<float>>& dataset);
+
+            size_t tableMemoryBytes() const; //bytes held by the L hash tables
+
+            //threads of buildIndex (0 = all hardware threads); the index does not depend on it
+            void setBuildThreads(int threads) { build_threads_ = threads; }
+
+            //multi-probe: extra buckets probed per table (0 = only the query's own bucket);
+            //a query knob, not stored in the index file
+            void setProbes(int T) { probes_ = std::max(0, T); }
+
+            //searchKNN when fewer than N candidates share the query's IDs, in stages that stop at
+            //`budget` candidates (never a scan of the whole dataset):
+            // 1) widen: probe `probes` perturbed buckets per table (multi-probe) with the ID filter
+            // 2) relax: fill up to N with entries of those buckets whatever their ID (same bucket,
+            //    other g value: no locality, it only completes the answer)
+            //a query that still has fewer than N candidates returns fewer than N results
+            void setFallback(int probes, int budget) { fallback_probes_ = std::max(0, probes); fallback_budget_ = std::max(1, budget); }
+
+            //how often each fallback stage fired since the index was built (thread-safe counters);
+            //scored = candidates whose distance searchKNN computed, over all queries
+            struct FallbackStats { uint64_t queries = 0, widened = 0, relaxed = 0, short_results = 0, scored = 0; };
+            FallbackStats fallbackStats() const;
+            void resetFallbackStats();
+
         private:
+            int bucketOf(int j, const int* hj, unsigned& id) const; //bucket in table j from its k h-values, sets the ID
+
+            //the query's L*k h-values, and with pos their positions inside the buckets (multi-probe)
+            void hashQuery(const float* query, std::vector<int>& h, std::vector<double>* pos) const;
+
+            //indices in the query's bucket and its `probes` perturbed buckets of every table, keeping
+            //only entries with the query's ID if match_id; stops once there are `budget` candidates.
+            //h, pos: from hashQuery (pos only read when probes > 0)
+            void collectCandidates(const int* h, const double* pos, std::unordered_set<unsigned>& candidates,
+                                   int probes, bool match_id, size_t budget) const;
+
+            void checkDim(const std::vector<float>& query) const; //throws on a query of the wrong size
+
             int dimension; //dimensionality of vectors
             int k_H; //k number of h-functions per g
             int L_Tables; // L number of hash tables
             double w_size; //window size
             int table_size;
             unsigned seed_;
+            int build_threads_ = 0; //threads of buildIndex (0 = all)
+            int probes_ = 0; //extra buckets per table (multi-probe)
+            int fallback_probes_ = 32; //probes per table of the widening stage
+            int fallback_budget_ = 2000; //max candidates gathered by the fallback stages
+
+            //fallback counters: queries, widened, relaxed, short results, scored candidates
+            mutable std::atomic<uint64_t> n_queries_{0}, n_widened_{0}, n_relaxed_{0}, n_short_{0}, n_scored_{0};
 
+            RandomProjections proj_; //the L*k h-functions, table j uses rows j*k .. j*k+k-1
             std::vector<GFunction> g_F; //G Functions (one per table)
 
-            //each table: bucket -> list of (index, ID) pairs
-            std::vector<std::unordered_map<int, std::vector<std::pair<unsigned, unsigned>>>> tables_;
-           // std::vector<std::unordered_map<int, std::vector<unsigned>>> tables_; //hash tables
-            std::vector<std::vector<float>> dataset; //stored dataset
+            //each table: bucket -> (index, ID) pairs, CSR layout
+            std::vector<BucketTable> tables_;
+            Matrix base_; //view of the base vectors (the caller's Matrix, or own_)
+            std::shared_ptr<const Matrix> own_; //rows copied by the vector-of-vectors overloads
     };
     
     }
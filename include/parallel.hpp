@@ -0,0 +1,113 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal fork-join helpers on std::thread (no external dependency).
+
+// Worker count used when the user does not choose one (-threads 0)
+inline int hardware_threads() {
+    unsigned h = std::thread::hardware_concurrency();
+    return h ? static_cast<int>(h) : 1;
+}
+
+// Runs fn(i) for every i in [begin, end) on up to `threads` threads (the caller is one of them).
+// Indices are handed out dynamically in chunks of `grain`, so uneven work balances out.
+// The first exception thrown by fn is rethrown in the caller once all threads have joined.
+template <class Fn>
+void parallel_for(int begin, int end, int threads, Fn&& fn, int grain = 1) {
+    if (end <= begin) return;
+    grain = std::max(1, grain);
+    const int chunks = (end - begin + grain - 1) / grain;
+    threads = std::max(1, std::min(threads, chunks));
+    if (threads == 1) {
+        for (int i = begin; i < end; ++i) fn(i);
+        return;
+    }
+
+    std::atomic<int> next(begin);
+    std::exception_ptr error;
+    std::mutex error_mu;
+
+    auto worker = [&]() {
+        try {
+            for (;;) {
+                const int lo = next.fetch_add(grain);
+                if (lo >= end) break;
+                const int hi = std::min(end, lo + grain);
+                for (int i = lo; i < hi; ++i) fn(i);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(error_mu);
+            if (!error) error = std::current_exception();
+            next.store(end); // let the other workers drain out
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (int t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+    if (error) std::rethrow_exception(error);
+}
+
+// Stable counting sort of the indices 0..n-1 by key[i] in [0, nkeys): `order` lists the indices
+// grouped by key, in index order inside a key, and key v owns order[offsets[v] .. offsets[v+1]).
+// Count, prefix sum and scatter run over contiguous chunks of the indices, each chunk with its
+// own nkeys counters, so the output is the same for any thread count. The chunk count is capped
+// so the counters stay within a few times n + nkeys.
+template <class Key>
+void counting_sort_by_key(const Key* key, size_t n, size_t nkeys, int threads,
+                          std::vector<uint32_t>& offsets, std::vector<unsigned>& order) {
+    static const size_t kMinChunk = size_t(1) << 14;
+    if (threads <= 0) threads = hardware_threads();
+    size_t chunks = std::min<size_t>(static_cast<size_t>(threads), n / kMinChunk);
+    chunks = std::max<size_t>(1, std::min(chunks, (4 * n + nkeys) / std::max<size_t>(1, nkeys)));
+
+    offsets.assign(nkeys + 1, 0);
+    order.resize(n);
+    if (chunks == 1) {
+        for (size_t i = 0; i < n; ++i) ++offsets[static_cast<size_t>(key[i]) + 1];
+        for (size_t v = 0; v < nkeys; ++v) offsets[v + 1] += offsets[v];
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < n; ++i) order[fill[static_cast<size_t>(key[i])]++] = static_cast<unsigned>(i);
+        return;
+    }
+
+    const int T = static_cast<int>(chunks);
+    auto first = [&](int t) { return n * static_cast<size_t>(t) / chunks; };
+    std::vector<std::vector<uint32_t>> cnt(chunks, std::vector<uint32_t>(nkeys, 0));
+    parallel_for(0, T, T, [&](int t) {
+        for (size_t i = first(t); i < first(t + 1); ++i) ++cnt[t][static_cast<size_t>(key[i])];
+    });
+
+    // key totals, prefix sums over keys, then each chunk's first slot in every key
+    static const size_t kKeyBlock = 4096;
+    const int key_blocks = static_cast<int>((nkeys + kKeyBlock - 1) / kKeyBlock);
+    auto per_key = [&](auto&& fn) {
+        parallel_for(0, key_blocks, T, [&](int b) {
+            const size_t hi = std::min(nkeys, (static_cast<size_t>(b) + 1) * kKeyBlock);
+            for (size_t v = static_cast<size_t>(b) * kKeyBlock; v < hi; ++v) fn(v);
+        });
+    };
+    per_key([&](size_t v) {
+        uint32_t s = 0;
+        for (size_t t = 0; t < chunks; ++t) s += cnt[t][v];
+        offsets[v + 1] = s;
+    });
+    for (size_t v = 0; v < nkeys; ++v) offsets[v + 1] += offsets[v];
+    per_key([&](size_t v) {
+        uint32_t run = offsets[v];
+        for (size_t t = 0; t < chunks; ++t) { const uint32_t c = cnt[t][v]; cnt[t][v] = run; run += c; }
+    });
+
+    parallel_for(0, T, T, [&](int t) {
+        uint32_t* slot = cnt[t].data();
+        for (size_t i = first(t); i < first(t + 1); ++i) order[slot[static_cast<size_t>(key[i])]++] = static_cast<unsigned>(i);
+    });
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include "dataset_io.hpp"  // Matrix
+#include "binary_io.hpp"
+
+// The random projections of a family of L2 hash functions (LSH, Hypercube):
+//   h_i(p) = floor((v_i * p + t_i) / w),  v_i ~ N(0,1)^d,  t_i ~ U(0,w)
+// All v_i are the rows of one count x d matrix, so the h-values of a point are one
+// matrix-vector product (dist::ip_block) instead of one pass over the point per function,
+// and build time hashes blocks of points against the matrix (every row load shared by
+// several points). Projections are float with a float accumulator; the offset and the
+// division by w are done in double as before.
+class RandomProjections {
+public:
+    RandomProjections() = default;
+    RandomProjections(int count, int dim, double w);
+
+    int count() const { return V_.n; }
+    int dim() const { return V_.d; }
+
+    // filled by the owner, which draws v_i then t_i function by function from its RNG
+    float* row(int i) { return V_.row(i); }
+    double& offset(int i) { return t_[i]; }
+
+    // h[i] = h_i(p) for all i in [0, count); pos[i] (if given) = where p falls inside its
+    // bucket, (v_i * p + t_i) / w - h[i] in [0, 1) (multi-probe picks the nearest boundaries)
+    void hash(const float* p, int* h, double* pos = nullptr) const;
+
+    // H[j * count + i] = h_i(x_j) for the n rows of X (stride floats apart)
+    void hashBatch(const float* X, size_t stride, int n, int* H) const;
+
+    void write(BinWriter& w) const; // serialization (v, t, w)
+    void read(BinReader& r);
+
+private:
+    Matrix V_;               // count x d
+    std::vector<double> t_;  // offsets
+    double w_ = 1.0;         // bucket width
+};
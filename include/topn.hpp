@@ -0,0 +1,79 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Bounded top-N selection shared by every engine: keeps the N smallest
+// (distance, id) pairs seen so far, so memory is O(N) no matter how many
+// candidates are pushed, and the results come out sorted without a pass over
+// all candidates.
+//  - N <= kSortedMax: a small sorted array (insertion shifts a few pairs that
+//    sit in one or two cache lines, no heap bookkeeping)
+//  - larger N: a binary max-heap
+// The admission threshold is cached, so a rejected candidate costs a single
+// compare against worst().
+template <class D = float>
+class TopNHeap {
+public:
+    static constexpr int kSortedMax = 16;
+
+    explicit TopNHeap(int capacity = 0) { reset(capacity); }
+
+    // empties the structure and sets a new capacity (keeps the allocation)
+    void reset(int capacity) {
+        cap_ = std::max(0, capacity);
+        sorted_ = cap_ <= kSortedMax;
+        h_.clear();
+        h_.reserve(cap_);
+        worst_ = std::numeric_limits<D>::max();
+    }
+
+    int size() const { return static_cast<int>(h_.size()); }
+    int capacity() const { return cap_; }
+    bool full() const { return static_cast<int>(h_.size()) >= cap_; }
+
+    // current admission threshold: the largest finite value until full, then the largest kept distance
+    D worst() const { return worst_; }
+
+    void push(D dist, int id) {
+        if (dist > worst_ || cap_ == 0) return;
+        const std::pair<D, int> e(dist, id);
+        if (sorted_) {
+            if (full()) {
+                if (!(e < h_.back())) return; // ties broken by id: deterministic
+                h_.pop_back();
+            }
+            h_.insert(std::upper_bound(h_.begin(), h_.end(), e), e);
+            if (full()) worst_ = h_.back().first;
+        } else {
+            if (!full()) {
+                h_.push_back(e);
+                std::push_heap(h_.begin(), h_.end());
+            } else if (e < h_.front()) {
+                std::pop_heap(h_.begin(), h_.end());
+                h_.back() = e;
+                std::push_heap(h_.begin(), h_.end());
+            } else {
+                return;
+            }
+            if (full()) worst_ = h_.front().first;
+        }
+    }
+
+    // (distance, id) in ascending order; the structure is left empty
+    std::vector<std::pair<D, int>> take_sorted() {
+        if (!sorted_) std::sort_heap(h_.begin(), h_.end());
+        std::vector<std::pair<D, int>> out;
+        out.swap(h_);
+        h_.reserve(cap_);
+        worst_ = std::numeric_limits<D>::max();
+        return out;
+    }
+
+private:
+    int cap_ = 0;
+    bool sorted_ = true;
+    D worst_ = std::numeric_limits<D>::max();
+    std::vector<std::pair<D, int>> h_; // sorted ascending, or max-heap on (distance, id)
+};
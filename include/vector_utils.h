@@ -17,6 +17,9 @@ namespace vutils{
     //compute the euclidean distance between 2 vectors (L2)
     double euclideanDistance(const std::vector<float>& a, const std::vector<float>& b);  //used for actual distance computations
 
+    //same distance between two d-float rows read in place (e.g. a query and a base Matrix row)
+    double euclideanDistance(const float* a, const float* b, int d);
+
     //normalize a vector to unit length
     void normalize(std::vector<float>& a);
 
@@ -3,6 +3,7 @@
 #include <vector>
 #include <cmath>
 #include <stdexcept>
+#include "distance.hpp"
 
 namespace vutils {
 
@@ -35,12 +36,7 @@ inline double dotProduct(const std::vector<float>& a, const std::vector<float>&
 
 inline double euclideanDistance(const std::vector<float>& a, const std::vector<float>& b) {
     if (a.size() != b.size()) throw std::runtime_error("euclideanDistance: size mismatch");
-    double s = 0.0;
-    for (size_t i = 0; i < a.size(); ++i) {
-        double d = static_cast<double>(a[i]) - b[i];
-        s += d * d;
-    }
-    return std::sqrt(s);
+    return std::sqrt(static_cast<double>(dist::l2_sq(a.data(), b.data(), static_cast<int>(a.size()))));
 }
 
 } // namespace vutils
@@ -1,36 +1,33 @@
 #include "bruteForce.h"
+#include "distance.hpp"
+#include "topn.hpp"
+#include "parallel.hpp"
 #include <algorithm> //for std::sort
 #include <fstream> //for file writing
 #include <cstdint> //int32_t
+#include <limits>
 
 namespace brute {
 
     std::vector<std::pair<int, double>>
-    knnSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float> query, int N){
-        std::vector<std::pair<int, double>> distances; //pair of (index, distance)
-        distances.reserve(dataset.size()); //reserve space
-        
-        //computing the distances from query to each one of the vectors of the dataset
+    knnSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float>& query, int N){
+        //bounded heap of the N best (squared distance, index): no n-sized array, no full sort
+        TopNHeap<float> best(N);
         for(size_t i = 0; i < dataset.size(); ++i){
-            double dist = vutils::euclideanDistance(dataset[i], query);
-            distances.emplace_back(static_cast<int>(i), dist); //push back the pair
-        }
-
-        //sorting the distances in ascending order
-        std::sort(distances.begin(), distances.end(),
-                    [](auto& a, auto& b){
-                        return a.second < b.second; }); //comparing based on distance only
-        //keeping only the top N nearest neighbors
-        if((int)distances.size() > N){
-            distances.resize(N);
+            size_t d = std::min(dataset[i].size(), query.size());
+            float d2 = dist::l2_sq(dataset[i].data(), query.data(), static_cast<int>(d));
+            if(d2 <= best.worst()) best.push(d2, static_cast<int>(i));
         }
 
+        std::vector<std::pair<int, double>> distances; //pair of (index, distance)
+        for(const auto& p : best.take_sorted())
+            distances.emplace_back(p.second, std::sqrt(static_cast<double>(p.first)));
         return distances;
 
     }
 
     std::vector<int>
-    rangeSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float> query, double R){
+    rangeSearch(const std::vector<std::vector<float>>& dataset, const std::vector<float>& query, double R){
 
         std::vector<int> inRange;
         inRange.reserve(dataset.size()/10); //reserve some space--heuristic
@@ -44,6 +41,139 @@ namespace brute {
         return inRange;
     }
 
+    //Matrix versions: squared distances with the dispatched kernel into a bounded heap, sqrt only for the kept N
+    template <class T>
+    static std::vector<std::pair<int, double>>
+    knnSearchRows(const DenseMatrix<T>& dataset, const T* query, int N){
+        TopNHeap<float> best(N);
+        for(int i = 0; i < dataset.n; ++i){
+            float d2 = static_cast<float>(dist::l2_sq(query, dataset.row(i), dataset.d));
+            if(d2 <= best.worst()) best.push(d2, i);
+        }
+        std::vector<std::pair<int, double>> distances;
+        for(const auto& p : best.take_sorted())
+            distances.emplace_back(p.second, std::sqrt(static_cast<double>(p.first)));
+        return distances;
+    }
+
+    template <class T>
+    static std::vector<int>
+    rangeSearchRows(const DenseMatrix<T>& dataset, const T* query, double R){
+        std::vector<int> inRange;
+        const double R2 = R * R;
+        for(int i = 0; i < dataset.n; ++i){
+            if(static_cast<double>(dist::l2_sq(query, dataset.row(i), dataset.d)) <= R2)
+                inRange.push_back(i);
+        }
+        return inRange;
+    }
+
+    std::vector<std::pair<int, double>>
+    knnSearch(const Matrix& dataset, const float* query, int N){ return knnSearchRows(dataset, query, N); }
+
+    std::vector<std::pair<int, double>>
+    knnSearch(const MatrixU8& dataset, const uint8_t* query, int N){ return knnSearchRows(dataset, query, N); }
+
+    std::vector<int>
+    rangeSearch(const Matrix& dataset, const float* query, double R){ return rangeSearchRows(dataset, query, R); }
+
+    std::vector<int>
+    rangeSearch(const MatrixU8& dataset, const uint8_t* query, double R){ return rangeSearchRows(dataset, query, R); }
+
+    //tile sizes for knnSearchBatch: a base block of kBaseTile rows (128 KB at d=128) stays in L2
+    //while every query of the tile is scored against it
+    static const int kQueryTile = 64;
+    static const int kBaseTile  = 256;
+    //extra candidates per query carried from the decomposed distances into the exact rerank
+    static const int kRerankMargin = 32;
+
+    std::vector<std::vector<std::pair<int, double>>>
+    knnSearchBatch(const Matrix& dataset, const Matrix& queries, int N, int threads){
+        const int n = dataset.n, Q = queries.n, d = dataset.d;
+        if(threads <= 0) threads = hardware_threads();
+        std::vector<std::vector<std::pair<int, double>>> result(std::max(0, Q));
+        if(n == 0 || Q == 0 || N <= 0) return result;
+        if(queries.d != d) throw std::runtime_error("knnSearchBatch: dimension mismatch");
+
+        //||x||^2 of every base row, computed once for all queries
+        std::vector<float> xnorm(n);
+        parallel_for(0, n, threads, [&](int i){
+            xnorm[i] = dist::inner_product(dataset.row(i), dataset.row(i), d);
+        }, 1024);
+        const double xmax = std::sqrt(static_cast<double>(*std::max_element(xnorm.begin(), xnorm.end())));
+
+        //rounding error of xnorm + qnorm - 2<x,q> in float: every term is a d-long sum, so
+        //|error| <= gamma * (||x|| + ||q||)^2 with gamma = (d+2)*eps (+ one term per extra op)
+        const double gamma = (d + 4) * static_cast<double>(std::numeric_limits<float>::epsilon());
+        const int cand = static_cast<int>(std::min<long long>(static_cast<long long>(N) + kRerankMargin, n));
+
+        const size_t xs = dataset.row_stride(), qs = queries.row_stride();
+
+        const int tiles = (Q + kQueryTile - 1) / kQueryTile;
+        parallel_for(0, tiles, threads, [&](int t){
+            const int q0 = t * kQueryTile, nq = std::min(kQueryTile, Q - q0);
+            std::vector<float> ip(static_cast<size_t>(nq) * kBaseTile);
+            std::vector<float> qnorm(nq);
+            std::vector<TopNHeap<float>> best(nq, TopNHeap<float>(cand));
+            for(int i = 0; i < nq; ++i)
+                qnorm[i] = dist::inner_product(queries.row(q0 + i), queries.row(q0 + i), d);
+
+            for(int x0 = 0; x0 < n; x0 += kBaseTile){
+                const int nx = std::min(kBaseTile, n - x0);
+                dist::ip_block(queries.row(q0), qs, nq, dataset.row(x0), xs, nx, d, ip.data());
+                for(int i = 0; i < nq; ++i){
+                    const float* row = ip.data() + static_cast<size_t>(i) * nx;
+                    TopNHeap<float>& h = best[i];
+                    for(int j = 0; j < nx; ++j){
+                        float d2 = std::max(0.0f, xnorm[x0 + j] + qnorm[i] - 2.0f * row[j]);
+                        if(d2 <= h.worst()) h.push(d2, x0 + j);
+                    }
+                }
+            }
+
+            //exact distances for the N+margin survivors (the decomposition loses precision for
+            //close pairs). A row left out had a decomposed distance >= the worst kept one, so its
+            //exact distance is >= worst - bound; if that does not clear the N-th exact distance the
+            //cut may have dropped a true neighbour and the query is answered by a plain scan.
+            for(int i = 0; i < nq; ++i){
+                const float* q = queries.row(q0 + i);
+                const bool cut = cand < n;
+                const double worst = best[i].worst();
+                std::vector<std::pair<int, float>> exact;
+                exact.reserve(cand);
+                for(const auto& p : best[i].take_sorted())
+                    exact.emplace_back(p.second, dist::l2_sq(q, dataset.row(p.second), d));
+                std::sort(exact.begin(), exact.end(), [](const auto& a, const auto& b){
+                    return a.second < b.second || (a.second == b.second && a.first < b.first); });
+                if(static_cast<int>(exact.size()) > N) exact.resize(N);
+
+                auto& out = result[q0 + i];
+                if(cut){
+                    const double qn = std::sqrt(static_cast<double>(qnorm[i]));
+                    const double bound = gamma * (xmax + qn) * (xmax + qn);
+                    if(worst - bound < static_cast<double>(exact.back().second)){
+                        out = knnSearchRows(dataset, q, N);
+                        continue;
+                    }
+                }
+                for(const auto& p : exact)
+                    out.emplace_back(p.first, std::sqrt(static_cast<double>(p.second)));
+            }
+        });
+        return result;
+    }
+
+    std::vector<std::vector<std::pair<int, double>>>
+    knnSearchBatch(const MatrixU8& dataset, const MatrixU8& queries, int N, int threads){
+        if(threads <= 0) threads = hardware_threads();
+        if(queries.n > 0 && queries.d != dataset.d) throw std::runtime_error("knnSearchBatch: dimension mismatch");
+        std::vector<std::vector<std::pair<int, double>>> result(std::max(0, queries.n));
+        parallel_for(0, queries.n, threads, [&](int qi){
+            result[qi] = knnSearchRows(dataset, queries.row(qi), N);
+        });
+        return result;
+    }
+
     std::vector<int>
     compute_knn_graph_all(const std::vector<std::vector<float>>& dataset, int k){
         const size_t n = dataset.size();
@@ -0,0 +1,562 @@
+#include "../include/distance.hpp"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIST_X86 1
+#endif
+
+namespace dist {
+
+// ---------- scalar reference ----------
+
+static float l2_sq_scalar(const float* a, const float* b, int d) {
+    float s = 0.0f;
+    for (int i = 0; i < d; ++i) {
+        float v = a[i] - b[i];
+        s += v * v;
+    }
+    return s;
+}
+
+static float inner_product_scalar(const float* a, const float* b, int d) {
+    float s = 0.0f;
+    for (int i = 0; i < d; ++i) s += a[i] * b[i];
+    return s;
+}
+
+static uint32_t l2_sq_u8_scalar(const uint8_t* a, const uint8_t* b, int d) {
+    uint32_t s = 0;
+    for (int i = 0; i < d; ++i) {
+        int v = int(a[i]) - int(b[i]);
+        s += uint32_t(v * v);
+    }
+    return s;
+}
+
+static float l2_sq_u8f32_scalar(const uint8_t* a, const float* b, int d) {
+    float s = 0.0f;
+    for (int i = 0; i < d; ++i) {
+        float v = float(a[i]) - b[i];
+        s += v * v;
+    }
+    return s;
+}
+
+static void ip_block_scalar(const float* q, size_t qs, int nq,
+                            const float* x, size_t xs, int nx, int d, float* out) {
+    for (int i = 0; i < nq; ++i)
+        for (int j = 0; j < nx; ++j)
+            out[(size_t)i * nx + j] = inner_product_scalar(q + i * qs, x + j * xs, d);
+}
+
+// one block of 32 4-bit PQ codes: M groups of 16 bytes, byte j = code of vector j (low nibble)
+// and of vector j+16 (high nibble); out[j] = sum over m of lut[m*16 + code_m(j)]
+static void pq4_scan_scalar(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out) {
+    for (int j = 0; j < 32; ++j) out[j] = 0;
+    for (int m = 0; m < M; ++m) {
+        const uint8_t* c = codes + (size_t)m * 16;
+        const uint8_t* t = lut + (size_t)m * 16;
+        for (int j = 0; j < 16; ++j) {
+            out[j] = uint16_t(out[j] + t[c[j] & 15]);
+            out[j + 16] = uint16_t(out[j + 16] + t[c[j] >> 4]);
+        }
+    }
+}
+
+#ifdef DIST_X86
+
+// ---------- SSE (4 lanes) ----------
+
+__attribute__((target("sse2")))
+static inline float hsum128(__m128 v) {
+    __m128 sh = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 s  = _mm_add_ps(v, sh);
+    sh = _mm_movehl_ps(sh, s);
+    s  = _mm_add_ss(s, sh);
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("sse2")))
+static float l2_sq_sse(const float* a, const float* b, int d) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m128 v0 = _mm_sub_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i));
+        __m128 v1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(v0, v0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(v1, v1));
+    }
+    for (; i + 4 <= d; i += 4) {
+        __m128 v = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(v, v));
+    }
+    float s = hsum128(_mm_add_ps(acc0, acc1));
+    for (; i < d; ++i) { float v = a[i] - b[i]; s += v * v; }
+    return s;
+}
+
+__attribute__((target("sse2")))
+static float inner_product_sse(const float* a, const float* b, int d) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= d; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for (; i + 4 <= d; i += 4)
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    float s = hsum128(_mm_add_ps(acc0, acc1));
+    for (; i < d; ++i) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("sse2")))
+static inline uint32_t hsum128_epi32(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return uint32_t(_mm_cvtsi128_si32(v));
+}
+
+// bytes are widened to int16, (a-b)^2 pairs are summed into int32 by madd
+__attribute__((target("sse2")))
+static uint32_t l2_sq_u8_sse(const uint8_t* a, const uint8_t* b, int d) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    uint32_t s = hsum128_epi32(acc);
+    for (; i < d; ++i) { int v = int(a[i]) - int(b[i]); s += uint32_t(v * v); }
+    return s;
+}
+
+__attribute__((target("sse2")))
+static float l2_sq_u8f32_sse(const uint8_t* a, const float* b, int d) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= d; i += 8) {
+        __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + i)), zero);
+        __m128 v0 = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), _mm_loadu_ps(b + i));
+        __m128 v1 = _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), _mm_loadu_ps(b + i + 4));
+        acc = _mm_add_ps(acc, _mm_mul_ps(v0, v0));
+        acc = _mm_add_ps(acc, _mm_mul_ps(v1, v1));
+    }
+    float s = hsum128(acc);
+    for (; i < d; ++i) { float v = float(a[i]) - b[i]; s += v * v; }
+    return s;
+}
+
+__attribute__((target("sse2")))
+static void ip_block_sse(const float* q, size_t qs, int nq,
+                         const float* x, size_t xs, int nx, int d, float* out) {
+    for (int i = 0; i < nq; ++i)
+        for (int j = 0; j < nx; ++j)
+            out[(size_t)i * nx + j] = inner_product_sse(q + i * qs, x + j * xs, d);
+}
+
+// ---------- AVX2 + FMA (8 lanes) ----------
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    return hsum128(_mm_add_ps(lo, hi));
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_sq_avx2(const float* a, const float* b, int d) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m256 v0 = _mm256_sub_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i));
+        __m256 v1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(v0, v0, acc0);
+        acc1 = _mm256_fmadd_ps(v1, v1, acc1);
+    }
+    for (; i + 8 <= d; i += 8) {
+        __m256 v = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(v, v, acc0);
+    }
+    float s = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < d; ++i) { float v = a[i] - b[i]; s += v * v; }
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+static float inner_product_avx2(const float* a, const float* b, int d) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= d; i += 8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    float s = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < d; ++i) s += a[i] * b[i];
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+static uint32_t l2_sq_u8_avx2(const uint8_t* a, const uint8_t* b, int d) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m256i df = _mm256_sub_epi16(va, vb);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(df, df));
+    }
+    uint32_t s = hsum128_epi32(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+    for (; i < d; ++i) { int v = int(a[i]) - int(b[i]); s += uint32_t(v * v); }
+    return s;
+}
+
+__attribute__((target("avx2,fma")))
+static float l2_sq_u8f32_avx2(const uint8_t* a, const float* b, int d) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(w));
+        __m256 x1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(w, 8)));
+        __m256 v0 = _mm256_sub_ps(x0, _mm256_loadu_ps(b + i));
+        __m256 v1 = _mm256_sub_ps(x1, _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(v0, v0, acc0);
+        acc1 = _mm256_fmadd_ps(v1, v1, acc1);
+    }
+    float s = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < d; ++i) { float v = float(a[i]) - b[i]; s += v * v; }
+    return s;
+}
+
+// one pq4 step: looks up the 32 nibbles of c in the LUTs t (pshufb within each 128-bit lane)
+// and adds them as u16 to a0/a1 (vectors 0..7 / 8..15) and a2/a3 (16..23 / 24..31)
+__attribute__((target("avx2,fma")))
+static inline void pq4_step_avx2(__m256i c, __m256i t, __m256i& a0, __m256i& a1, __m256i& a2, __m256i& a3) {
+    const __m256i low4 = _mm256_set1_epi8(0x0F), zero = _mm256_setzero_si256();
+    const __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, low4));                      // vectors 0..15
+    const __m256i hi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), low4)); // vectors 16..31
+    a0 = _mm256_add_epi16(a0, _mm256_unpacklo_epi8(lo, zero));
+    a1 = _mm256_add_epi16(a1, _mm256_unpackhi_epi8(lo, zero));
+    a2 = _mm256_add_epi16(a2, _mm256_unpacklo_epi8(hi, zero));
+    a3 = _mm256_add_epi16(a3, _mm256_unpackhi_epi8(hi, zero));
+}
+
+// the two lanes hold different subspaces of the same vectors: add them
+__attribute__((target("avx2,fma")))
+static inline void pq4_store_avx2(uint16_t* out, __m256i a) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_add_epi16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1)));
+}
+
+// 4-bit PQ block, two subspaces per step: each 128-bit lane holds one subspace's 16-entry LUT
+// and its 16 code bytes
+__attribute__((target("avx2,fma")))
+static void pq4_scan_avx2(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    int m = 0;
+    for (; m + 2 <= M; m += 2)
+        pq4_step_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + (size_t)m * 16)),
+                      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lut + (size_t)m * 16)), a0, a1, a2, a3);
+    if (m < M) // odd M: upper lane zero, so it looks up a zero LUT
+        pq4_step_avx2(_mm256_inserti128_si256(zero, _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + (size_t)m * 16)), 0),
+                      _mm256_inserti128_si256(zero, _mm_loadu_si128(reinterpret_cast<const __m128i*>(lut + (size_t)m * 16)), 0),
+                      a0, a1, a2, a3);
+    pq4_store_avx2(out + 0, a0);  // unpacklo: vectors 0..7
+    pq4_store_avx2(out + 8, a1);  // unpackhi: vectors 8..15
+    pq4_store_avx2(out + 16, a2);
+    pq4_store_avx2(out + 24, a3);
+}
+
+// 4 queries x 1 base row per step: each load of x feeds 4 FMAs
+__attribute__((target("avx2,fma")))
+static void ip_block_avx2(const float* q, size_t qs, int nq,
+                          const float* x, size_t xs, int nx, int d, float* out) {
+    int i = 0;
+    for (; i + 4 <= nq; i += 4) {
+        const float* q0 = q + (size_t)i * qs;
+        const float* q1 = q0 + qs;
+        const float* q2 = q1 + qs;
+        const float* q3 = q2 + qs;
+        for (int j = 0; j < nx; ++j) {
+            const float* xj = x + (size_t)j * xs;
+            __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+            __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+            int t = 0;
+            for (; t + 8 <= d; t += 8) {
+                __m256 xv = _mm256_loadu_ps(xj + t);
+                a0 = _mm256_fmadd_ps(_mm256_loadu_ps(q0 + t), xv, a0);
+                a1 = _mm256_fmadd_ps(_mm256_loadu_ps(q1 + t), xv, a1);
+                a2 = _mm256_fmadd_ps(_mm256_loadu_ps(q2 + t), xv, a2);
+                a3 = _mm256_fmadd_ps(_mm256_loadu_ps(q3 + t), xv, a3);
+            }
+            float s0 = hsum256(a0), s1 = hsum256(a1), s2 = hsum256(a2), s3 = hsum256(a3);
+            for (; t < d; ++t) {
+                s0 += q0[t] * xj[t]; s1 += q1[t] * xj[t];
+                s2 += q2[t] * xj[t]; s3 += q3[t] * xj[t];
+            }
+            out[(size_t)(i + 0) * nx + j] = s0;
+            out[(size_t)(i + 1) * nx + j] = s1;
+            out[(size_t)(i + 2) * nx + j] = s2;
+            out[(size_t)(i + 3) * nx + j] = s3;
+        }
+    }
+    for (; i < nq; ++i)
+        for (int j = 0; j < nx; ++j)
+            out[(size_t)i * nx + j] = inner_product_avx2(q + (size_t)i * qs, x + (size_t)j * xs, d);
+}
+
+// ---------- AVX-512 (16 lanes, masked tail) ----------
+
+// Horizontal sums go through memory: gcc 12's headers build _mm512_reduce_add_ps,
+// the 512->256 casts and the lane shuffles on _mm*_undefined_*(), which trips
+// -Wuninitialized. One store per call is noise next to the main loop.
+__attribute__((target("avx512f")))
+static inline float hsum512(__m512 v) {
+    alignas(64) float t[16];
+    _mm512_store_ps(t, v);
+    __m128 s = _mm_add_ps(_mm_add_ps(_mm_load_ps(t), _mm_load_ps(t + 4)),
+                          _mm_add_ps(_mm_load_ps(t + 8), _mm_load_ps(t + 12)));
+    return hsum128(s);
+}
+
+__attribute__((target("avx512f")))
+static inline uint32_t hsum512_epi32(__m512i v) {
+    alignas(64) uint32_t t[16];
+    _mm512_store_si512(t, v);
+    const __m128i* p = reinterpret_cast<const __m128i*>(t);
+    return hsum128_epi32(_mm_add_epi32(_mm_add_epi32(_mm_load_si128(p), _mm_load_si128(p + 1)),
+                                       _mm_add_epi32(_mm_load_si128(p + 2), _mm_load_si128(p + 3))));
+}
+
+__attribute__((target("avx512f")))
+static float l2_sq_avx512(const float* a, const float* b, int d) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= d; i += 32) {
+        __m512 v0 = _mm512_sub_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i));
+        __m512 v1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(v0, v0, acc0);
+        acc1 = _mm512_fmadd_ps(v1, v1, acc1);
+    }
+    for (; i + 16 <= d; i += 16) {
+        __m512 v = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(v, v, acc0);
+    }
+    if (i < d) {
+        __mmask16 m = (__mmask16)((1u << (d - i)) - 1u);
+        __m512 v = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc1 = _mm512_fmadd_ps(v, v, acc1);
+    }
+    return hsum512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static float inner_product_avx512(const float* a, const float* b, int d) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= d; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= d; i += 16)
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    if (i < d) {
+        __mmask16 m = (__mmask16)((1u << (d - i)) - 1u);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return hsum512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint32_t l2_sq_u8_avx512(const uint8_t* a, const uint8_t* b, int d) {
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 32 <= d; i += 32) {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)));
+        __m512i vb = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+        __m512i df = _mm512_sub_epi16(va, vb);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(df, df));
+    }
+    uint32_t s = hsum512_epi32(acc);
+    for (; i < d; ++i) { int v = int(a[i]) - int(b[i]); s += uint32_t(v * v); }
+    return s;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static float l2_sq_u8f32_avx512(const uint8_t* a, const float* b, int d) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= d; i += 16) {
+        // full-mask maskz forms: the plain ones are built on _mm512_undefined_* (see hsum512)
+        __m512i w = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m512 x = _mm512_maskz_cvtepi32_ps(0xFFFF, w);
+        __m512 v = _mm512_sub_ps(x, _mm512_loadu_ps(b + i));
+        acc = _mm512_fmadd_ps(v, v, acc);
+    }
+    float s = hsum512(acc);
+    for (; i < d; ++i) { float v = float(a[i]) - b[i]; s += v * v; }
+    return s;
+}
+
+// sums the four 128-bit lanes (four subspaces of the same vectors)
+__attribute__((target("avx512f,avx512bw")))
+static inline void pq4_store_avx512(uint16_t* out, __m512i a) {
+    // through memory: the lane extract / shuffle intrinsics trip -Wuninitialized in some GCC headers
+    alignas(64) uint16_t lanes[32];
+    _mm512_store_si512(lanes, a);
+    const __m128i* l = reinterpret_cast<const __m128i*>(lanes);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_add_epi16(_mm_add_epi16(_mm_load_si128(l), _mm_load_si128(l + 1)),
+                                   _mm_add_epi16(_mm_load_si128(l + 2), _mm_load_si128(l + 3))));
+}
+
+// 4-bit PQ block, four subspaces per step (one per 128-bit lane, pshufb within lanes);
+// the M % 4 tail is a masked load, the zeroed lanes look up a zero LUT
+__attribute__((target("avx512f,avx512bw")))
+static void pq4_scan_avx512(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out) {
+    const __m512i low4 = _mm512_set1_epi8(0x0F), zero = _mm512_setzero_si512();
+    __m512i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    for (int m = 0; m < M; m += 4) {
+        const int bytes = 16 * std::min(4, M - m);
+        const __mmask64 k = bytes == 64 ? ~__mmask64(0) : ((__mmask64(1) << bytes) - 1);
+        const __m512i c = _mm512_maskz_loadu_epi8(k, codes + (size_t)m * 16);
+        const __m512i t = _mm512_maskz_loadu_epi8(k, lut + (size_t)m * 16);
+        const __m512i lo = _mm512_shuffle_epi8(t, _mm512_and_si512(c, low4));
+        const __m512i hi = _mm512_shuffle_epi8(t, _mm512_and_si512(_mm512_srli_epi16(c, 4), low4));
+        a0 = _mm512_add_epi16(a0, _mm512_unpacklo_epi8(lo, zero));
+        a1 = _mm512_add_epi16(a1, _mm512_unpackhi_epi8(lo, zero));
+        a2 = _mm512_add_epi16(a2, _mm512_unpacklo_epi8(hi, zero));
+        a3 = _mm512_add_epi16(a3, _mm512_unpackhi_epi8(hi, zero));
+    }
+    pq4_store_avx512(out + 0, a0);
+    pq4_store_avx512(out + 8, a1);
+    pq4_store_avx512(out + 16, a2);
+    pq4_store_avx512(out + 24, a3);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void ip_block_avx512(const float* q, size_t qs, int nq,
+                            const float* x, size_t xs, int nx, int d, float* out) {
+    int i = 0;
+    for (; i + 4 <= nq; i += 4) {
+        const float* q0 = q + (size_t)i * qs;
+        const float* q1 = q0 + qs;
+        const float* q2 = q1 + qs;
+        const float* q3 = q2 + qs;
+        for (int j = 0; j < nx; ++j) {
+            const float* xj = x + (size_t)j * xs;
+            __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps();
+            __m512 a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+            int t = 0;
+            for (; t + 16 <= d; t += 16) {
+                __m512 xv = _mm512_loadu_ps(xj + t);
+                a0 = _mm512_fmadd_ps(_mm512_loadu_ps(q0 + t), xv, a0);
+                a1 = _mm512_fmadd_ps(_mm512_loadu_ps(q1 + t), xv, a1);
+                a2 = _mm512_fmadd_ps(_mm512_loadu_ps(q2 + t), xv, a2);
+                a3 = _mm512_fmadd_ps(_mm512_loadu_ps(q3 + t), xv, a3);
+            }
+            if (t < d) {
+                __mmask16 m = (__mmask16)((1u << (d - t)) - 1u);
+                __m512 xv = _mm512_maskz_loadu_ps(m, xj + t);
+                a0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, q0 + t), xv, a0);
+                a1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, q1 + t), xv, a1);
+                a2 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, q2 + t), xv, a2);
+                a3 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, q3 + t), xv, a3);
+            }
+            out[(size_t)(i + 0) * nx + j] = hsum512(a0);
+            out[(size_t)(i + 1) * nx + j] = hsum512(a1);
+            out[(size_t)(i + 2) * nx + j] = hsum512(a2);
+            out[(size_t)(i + 3) * nx + j] = hsum512(a3);
+        }
+    }
+    for (; i < nq; ++i)
+        for (int j = 0; j < nx; ++j)
+            out[(size_t)i * nx + j] = inner_product_avx512(q + (size_t)i * qs, x + (size_t)j * xs, d);
+}
+
+#endif // DIST_X86
+
+// ---------- dispatch ----------
+
+static const Kernels kScalar = { l2_sq_scalar, inner_product_scalar, l2_sq_u8_scalar, l2_sq_u8f32_scalar, ip_block_scalar, pq4_scan_scalar };
+#ifdef DIST_X86
+// SSE2 has no byte shuffle (pshufb is SSSE3), so the SSE level scans 4-bit codes with the scalar kernel
+static const Kernels kSSE    = { l2_sq_sse,    inner_product_sse,    l2_sq_u8_sse,    l2_sq_u8f32_sse,    ip_block_sse,    pq4_scan_scalar };
+static const Kernels kAVX2   = { l2_sq_avx2,   inner_product_avx2,   l2_sq_u8_avx2,   l2_sq_u8f32_avx2,   ip_block_avx2,   pq4_scan_avx2 };
+static const Kernels kAVX512 = { l2_sq_avx512, inner_product_avx512, l2_sq_u8_avx512, l2_sq_u8f32_avx512, ip_block_avx512, pq4_scan_avx512 };
+#endif
+
+Level detect_level() {
+#ifdef DIST_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return Level::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Level::AVX2;
+    if (__builtin_cpu_supports("sse2")) return Level::SSE;
+#endif
+    return Level::Scalar;
+}
+
+// detect_level() once (CPUID); resolved on first use, so calls made during static
+// initialization are safe too
+static Level cached_level() {
+    static const Level lv = detect_level();
+    return lv;
+}
+
+const Kernels& kernels(Level lv) {
+#ifdef DIST_X86
+    // never hand out a level above what the CPU supports
+    if (lv > cached_level()) lv = cached_level();
+    switch (lv) {
+        case Level::AVX512: return kAVX512;
+        case Level::AVX2:   return kAVX2;
+        case Level::SSE:    return kSSE;
+        default: break;
+    }
+#else
+    (void)lv;
+#endif
+    return kScalar;
+}
+
+const char* level_name(Level lv) {
+    switch (lv) {
+        case Level::AVX512: return "avx512";
+        case Level::AVX2:   return "avx2";
+        case Level::SSE:    return "sse";
+        default:            return "scalar";
+    }
+}
+
+static const Kernels& active() {
+    static const Kernels& k = kernels(cached_level());
+    return k;
+}
+
+Level active_level() { return cached_level(); }
+
+float l2_sq(const float* a, const float* b, int d)         { return active().l2_sq(a, b, d); }
+float inner_product(const float* a, const float* b, int d) { return active().inner_product(a, b, d); }
+uint32_t l2_sq(const uint8_t* a, const uint8_t* b, int d)  { return active().l2_sq_u8(a, b, d); }
+float l2_sq(const uint8_t* a, const float* b, int d)       { return active().l2_sq_u8f32(a, b, d); }
+
+void ip_block(const float* q, size_t q_stride, int nq,
+              const float* x, size_t x_stride, int nx, int d, float* out) {
+    active().ip_block(q, q_stride, nq, x, x_stride, nx, d, out);
+}
+
+void pq4_scan(const uint8_t* codes, const uint8_t* lut, int M, uint16_t* out) {
+    active().pq4_scan(codes, lut, M, out);
+}
+
+} // namespace dist
@@ -2,23 +2,37 @@
 #include <cmath>
 #include <limits>
 #include <iostream>
-#include <queue>
 
 #include "hypercube.h"
+#include "topn.hpp"
 
 namespace cube {
 
-    /*-----HFunction----*/
+    /*------Vertex table------*/
 
-    HFunction::HFunction(int dim, double w) : v(dim), w_bucket(w) {
-        for(int i = 0; i < dim; ++i) //random Gaussian vector N(0,1)^d
-            v[i] = static_cast<float>(vutils::normalRand());
-        t_off = vutils::uniformRand(0.0, w_bucket); //random offset in [0,w)
-    }
+    void VertexTable::build(const std::vector<Vertex>& vertex, int k, int threads) {
+        const size_t n = vertex.size();
+        keys.clear();
+        sparse = k > kDenseMaxBits;
+        if(!sparse){
+            //dense: count per vertex, prefix sums, scatter
+            counting_sort_by_key(vertex.data(), n, size_t(1) << k, threads, offsets, points);
+            return;
+        }
 
-    int HFunction::hash(const std::vector<float>& p) const {
-        const double projection = vutils::dotProduct(v, p); //v*p
-        return static_cast<int>(std::floor((projection + t_off) / w_bucket)); 
+        //sparse: point indices sorted by vertex (stable, so index order inside a vertex)
+        points.resize(n);
+        for(size_t i = 0; i < n; ++i) points[i] = static_cast<unsigned>(i);
+        std::stable_sort(points.begin(), points.end(), [&](unsigned a, unsigned b){ return vertex[a] < vertex[b]; });
+        offsets.clear();
+        for(size_t j = 0; j < n; ++j){
+            const Vertex v = vertex[points[j]];
+            if(keys.empty() || keys.back() != v){
+                keys.push_back(v);
+                offsets.push_back(static_cast<uint32_t>(j));
+            }
+        }
+        offsets.push_back(static_cast<uint32_t>(n));
     }
 
     /*------Hypercube------*/
@@ -26,165 +40,227 @@ namespace cube {
     Hypercube::Hypercube(int dim, int k, double w, int M, int probes, unsigned seed)
         : dimension(dim), k_bits(k), w_size(w), M_points(M), probes_v(probes), seed_(seed)
     {
+        if(k_bits < 1 || k_bits > 64) throw std::runtime_error("Hypercube: k must be in [1, 64]");
         vutils::initRand(seed_);
-        h_F.reserve(k_bits); //reserving space for k HFunctions
-        for(int i = 0; i < k_bits; ++i)
-            h_F.emplace_back(dimension, w_size); //creating HFunction and adding it to the vector
+        h_F = RandomProjections(k_bits, dimension, w_size);
+        for(int i = 0; i < k_bits; ++i){ //per h: random Gaussian vector N(0,1)^d, then offset in [0,w)
+            float* v = h_F.row(i);
+            for(int c = 0; c < dimension; ++c)
+                v[c] = static_cast<float>(vutils::normalRand());
+            h_F.offset(i) = vutils::uniformRand(0.0, w_size);
+        }
         
-        f_tables.resize(k_bits); //resizing f_tables to hold k maps
+        f_salt = makeSalts(k_bits, seed_); //f-functions: a fixed function of the seed, no lazy state
+        probe_masks_ = enumerateProbes(k_bits, std::max(1, probes_v));
     }
 
     void Hypercube::buildIndex(const std::vector<std::vector<float>>& dataset) {
-        stored_dataset = dataset; //storing dataset
-        cube_.clear(); //clearing cube
-        cube_.reserve(std::max(1, static_cast<int>(stored_dataset.size())));
-
-        for(size_t index = 0; index < stored_dataset.size(); ++index){
-            const std::string vertex = hashToVertex(stored_dataset[index]); //computing k-bit vertex for point
-            cube_[vertex].push_back(static_cast<unsigned>(index)); //inserting index into the corresponding vertex bucket
-        }
+        auto rows = std::make_shared<const Matrix>(matrix_from_rows(dataset)); //one contiguous copy the index keeps
+        buildIndex(matrix_view(*rows));
+        own_ = std::move(rows);
     }
 
-    //computing k-bit vertex for point p (g(p))
-    std::string Hypercube::hashToVertex(const std::vector<float>& p) const {
-        std::string bits;
-        bits.resize(k_bits); //resizing to k bits
-
-        for(int i = 0; i < k_bits; ++i){
-            int h_i = h_F[i].hash(p); //computing h_i(p)
-
-            //f_i -> assign 0 or 1 wi probability 0.5 each
-            auto &f_i = f_tables[i]; //reference to f_i table
-            auto it = f_i.find(h_i); //looking for h_i in f_i table
-            int bit;
-            if(it == f_i.end()){
-                bit = vutils::uniformRand(0.0, 1.0) < 0.5 ? 0 : 1; //randomly assign 0 or 1
-                f_i.emplace(h_i, bit); //inserting into f_i table
-            } else {
-                bit = it->second; //retrieve existing bit
-            }
-            bits[i] = static_cast<char>('0' + bit); //setting bit in vertex string
-        }
+    void Hypercube::buildIndex(const Matrix& base) {
+        if(base.n > 0 && base.d != dimension) throw std::runtime_error("Hypercube: base dimension mismatch");
+        own_.reset();
+        base_ = matrix_view(base); //referenced, not copied
+
+        //h-values of blocks of points in one pass over the projections, vertices in point order
+        const int block = 256;
+        std::vector<Vertex> vertex(base_.n);
+        const int threads = build_threads_ > 0 ? build_threads_ : hardware_threads();
+        parallel_for(0, (base_.n + block - 1) / block, threads, [&](int blk){ //blocks of points are independent
+            thread_local std::vector<int> h;
+            h.resize(static_cast<size_t>(block) * k_bits);
+            const int start = blk * block;
+            const int nb = std::min(block, base_.n - start);
+            h_F.hashBatch(base_.row(start), base_.row_stride(), nb, h.data()); //rows read in place
+            for(int b = 0; b < nb; ++b) //computing k-bit vertex for point
+                vertex[start + b] = hashToVertex(h.data() + static_cast<size_t>(b) * k_bits);
+        });
+        cube_.build(vertex, k_bits, threads); //grouping the indices by vertex
+    }
 
-        return bits;
+    void Hypercube::checkDim(const std::vector<float>& query) const {
+        if(static_cast<int>(query.size()) != dimension) throw std::runtime_error("Hypercube: query dimension mismatch");
+    }
 
+    //computing k-bit vertex for point p (g(p))
+    Vertex Hypercube::hashToVertex(const float* p) const {
+        int h[64]; //k_bits <= 64, so the query path stays allocation-free
+        h_F.hash(p, h); //all k h-values in one pass over p
+        return hashToVertex(h);
     }
 
-    std::vector<std::string>
-    Hypercube::enumerateProbes(const std::string& home, int limit) const { //generatin up to a certain threshold
-        std::vector<std::string> order; 
-        order.reserve(std::max(1, limit));
-        order.push_back(home); //adding home vertex first
+    //vertex from the h-values h[0..k) of a point
+    Vertex Hypercube::hashToVertex(const int* h) const {
+        Vertex bits = 0;
 
-        if(limit <= 1) return order; //if limit is 1, return only home
+        for(int i = 0; i < k_bits; ++i) //f_i(h_i(p)) -> bit i of the vertex
+            bits |= static_cast<Vertex>(fBit(f_salt[i], h[i])) << i;
 
-        const int n = static_cast<int>(home.size()); 
+        return bits;
+
+    }
 
-        //distance 1 
-        for(int i = 0; i < n && static_cast<int>(order.size()) < limit; ++i){ //with this loop we enumerate neighbours of the “home” vertex in the Hamming cube
-            std::string str = home;
-            str[i] = (str[i] == '0') ? '1' : '0';
-            order.push_back(std::move(str));
+    std::vector<uint64_t> Hypercube::makeSalts(int k, unsigned seed) {
+        std::vector<uint64_t> salt(k);
+        uint64_t state = 0x9e3779b97f4a7c15ULL * (static_cast<uint64_t>(seed) + 1); //splitmix64 stream from the seed
+        for(int i = 0; i < k; ++i){
+            state += 0x9e3779b97f4a7c15ULL;
+            salt[i] = mix64(state);
         }
-        if(static_cast<int>(order.size()) >= limit) return order; //reached limit case
-
-         //distance 2 -> pair flips
-         for(int i = 0; i < n && static_cast<int>(order.size()) < limit; ++i){
-            for(int j = i+1; j < n && static_cast<int>(order.size()) < limit; ++i){
-                std::string str = home;
-                str[i] = (str[i] == '0') ? '1' : '0';
-                str[j] = (str[j] == '0') ? '1' : '0';
-                order.push_back(std::move(str));
+        return salt;
+    }
+
+    std::vector<Vertex> Hypercube::enumerateProbes(int k, int limit) { //generatin up to a certain threshold
+        std::vector<Vertex> order;
+        order.reserve(std::max(1, limit));
+        order.push_back(0); //home vertex first
+
+        //distance r = 1, 2, ...: every combination of r of the k bits, in lexicographic order
+        std::vector<int> bit;
+        for(int r = 1; r <= k && static_cast<int>(order.size()) < limit; ++r){
+            bit.resize(r);
+            for(int j = 0; j < r; ++j) bit[j] = j; //first combination {0, 1, ..., r-1}
+            while(static_cast<int>(order.size()) < limit){
+                Vertex mask = 0;
+                for(int b : bit) mask |= Vertex(1) << b;
+                order.push_back(mask);
+
+                //next combination: bump the rightmost bit that can still move, reset the rest after it
+                int j = r - 1;
+                while(j >= 0 && bit[j] == k - r + j) --j;
+                if(j < 0) break; //all combinations of this distance done
+                ++bit[j];
+                for(int t = j + 1; t < r; ++t) bit[t] = bit[t - 1] + 1;
             }
-         }
-
-         if(static_cast<int>(order.size()) >= limit) return order; //reached limit case
-
-         //distance 3+ / general case -> BFS-like approach
-         std::unordered_set<std::string>
-         visited(order.begin(), order.end()); //to avoid duplicates
-         std::queue<std::string> q;
-         q.push(home); //starting from home
-         while(!q.empty() && static_cast<int>(order.size()) < limit){
-            std::string current = q.front();//first in queue
-            q.pop(); //removing from queue
-            for(int i = 0; i < n && static_cast<int>(order.size()) < limit; ++i){
-                std::string neighbour = current;
-                neighbour[i] = (neighbour[i] == '0') ? '1' : '0';
-                if(visited.insert(neighbour).second){ //if not visited 
-                    order.push_back(neighbour); //adding neighbour to order
-                    q.push(std::move(neighbour)); //adding to queue for further exploration
-                }
-            }    
         }
-
-        if(static_cast<int>(order.size()) > limit) order.resize(limit); //trimming to limit if exceeded
         return order;
     }    
 
+    void Hypercube::collectCandidates(const float* query, std::vector<unsigned>& candidates) const {
+        const Vertex home = hashToVertex(query); //computing home vertex for query
+        const size_t limit = static_cast<size_t>(std::max(0, std::min(M_points, base_.n)));
+        candidates.clear();
+        candidates.reserve(limit); //reserving space for candidates
+
+        for(Vertex mask : probe_masks_){
+            const auto range = cube_.find(home ^ mask); //looking for vertex in cube
+            for(const unsigned* p = range.first; p != range.second && candidates.size() < limit; ++p)
+                candidates.push_back(*p); //adding index to candidates
+
+            if(candidates.size() >= limit) break; //reached M points limit
+        }
+    }
 
     std::vector<std::pair<int, double>>
     Hypercube::searchKNN(const std::vector<float>& query, int N) const {
-        const std::string query_vertex = hashToVertex(query); //computing home vertex for query
-        const std::vector<std::string> toVisit = enumerateProbes(query_vertex, std::max(1, probes_v)); //getting vertices to visit
-
-        std::unordered_set<unsigned> candidates; //to avoid duplicates
-        candidates.reserve(static_cast<int>(std::min(M_points, static_cast<int>(stored_dataset.size())))); //reserving space for candidates 
-
-        for(const auto& vertex: toVisit){
-            auto it = cube_.find(vertex); //looking for vertex in cube
-            if(it == cube_.end()) continue; //vertex not found, continue
-            for(auto index : it ->second){
-                if(static_cast<int>(candidates.size()) >= M_points) break;
-                candidates.insert(index); //adding index to candidates
-            }
+        checkDim(query);
+        return searchKNN(query.data(), N);
+    }
 
-            if(static_cast<int>(candidates.size()) >= M_points) break; //reached M points limit
-        }
+    std::vector<int>
+    Hypercube::searchRadius(const std::vector<float>& query, double R) const {
+        checkDim(query);
+        return searchRadius(query.data(), R);
+    }
 
-        std::vector<std::pair<int, double>> results; //to store (index, distance) pairs
-        results.reserve(candidates.size()); //reserving space
+    std::vector<std::pair<int, double>>
+    Hypercube::searchKNN(const float* query, int N) const {
+        thread_local std::vector<unsigned> candidates;
+        collectCandidates(query, candidates);
 
+        TopNHeap<double> best(N); //bounded top-N: O(N) memory, results come out sorted
         for(auto index: candidates)
-            results.emplace_back(static_cast<int>(index), vutils::euclideanDistance(query, stored_dataset[index])); //storing index and distance
+            best.push(vutils::euclideanDistance(query, base_.row(static_cast<int>(index)), base_.d), static_cast<int>(index));
 
-        if(static_cast<int>(results.size()) > N)
-            std::nth_element(results.begin(), results.begin() + N, results.end(), [](const auto& a,const auto& b){ return a.second < b.second; });
-        
-        std::sort(results.begin(), results.begin() + std::min(N, static_cast<int>(results.size())), [](const auto& a, const auto& b){ return a.second < b.second; });
+        std::vector<std::pair<int, double>> results; //to store (index, distance) pairs
+        results.reserve(best.size());
+        for(const auto& p : best.take_sorted())
+            results.emplace_back(p.second, p.first);
 
-        if(static_cast<int>(results.size()) > N)
-            results.resize(N);
-        
         return results;
 
     }
 
     std::vector<int>
-    Hypercube::searchRadius(const std::vector<float>& query, double R) const {
-        const std::string query_vertex = hashToVertex(query); // computing home vertex for query
-        const std::vector<std::string> toVisit = enumerateProbes(query_vertex, std::max(1, probes_v)); //getting vertices to visit
-
-        std::unordered_set<unsigned> candidates; //to avoid duplicates
-        candidates.reserve(static_cast<int>(std::min(M_points, static_cast<int>(stored_dataset.size())))); //reserving space for candidates
-
-        for(const auto& vertex: toVisit){
-            auto it = cube_.find(vertex); //looking for vertex in cube
-            if(it == cube_.end()) continue; //vertex not found, we continue
-            for(auto index : it -> second){
-                if(static_cast<int>(candidates.size()) >= M_points) break;
-                candidates.insert(index); //adding index to candidates
-            }
-
-            if(static_cast<int>(candidates.size()) >= M_points) break; //reached M points limit
-        }
+    Hypercube::searchRadius(const float* query, double R) const {
+        thread_local std::vector<unsigned> candidates;
+        collectCandidates(query, candidates);
 
         std::vector<int> inRange; //to store indices within radius R
         for(auto index: candidates){
-            if(vutils::euclideanDistance(query, stored_dataset[index]) <=R)
+            if(vutils::euclideanDistance(query, base_.row(static_cast<int>(index)), base_.d) <= R)
                 inRange.push_back(static_cast<int>(index)); //adding index to inRange
         }
 
         return inRange;
     }
+
+    /*------Save / Load------*/
+
+    static const char kCubeMagic[9] = "CUBEIDX\0";
+    static const uint32_t kCubeVersion = 5; //v2: one projection matrix, v3: bitmask vertices in CSR, v4: stateless f, v5: table layout flag
+
+    void Hypercube::saveIndex(const std::string& path) const {
+        BinWriter w(path);
+        w.header(kCubeMagic, kCubeVersion);
+        w.pod(static_cast<int32_t>(base_.n));
+        w.pod(dimension);
+        w.pod(k_bits);
+        w.pod(w_size);
+        w.pod(seed_);
+        h_F.write(w);
+
+        //vertex table: its layout, then the CSR arrays as they are
+        w.pod<int32_t>(cube_.sparse ? 1 : 0);
+        w.vec(cube_.keys);
+        w.vec(cube_.offsets);
+        w.vec(cube_.points);
+        w.close();
+    }
+
+    void Hypercube::loadIndex(const std::string& path, const std::vector<std::vector<float>>& dataset) {
+        auto rows = std::make_shared<const Matrix>(matrix_from_rows(dataset));
+        loadIndex(path, matrix_view(*rows));
+        own_ = std::move(rows);
+    }
+
+    void Hypercube::loadIndex(const std::string& path, const Matrix& base) {
+        BinReader r(path);
+        r.header(kCubeMagic, kCubeVersion, "Hypercube");
+        const int n = r.pod<int32_t>();
+        dimension = r.pod<int>();
+        if(n != base.n || (base.n > 0 && base.d != dimension))
+            throw std::runtime_error("Hypercube index " + path + " was built for a different dataset");
+        k_bits = r.pod<int>();
+        if(k_bits < 1 || k_bits > 64) throw std::runtime_error(path + ": corrupt Hypercube index (k)");
+        w_size = r.pod<double>();
+        seed_ = r.pod<unsigned>();
+
+        h_F.read(r);
+        if(h_F.count() != k_bits || h_F.dim() != dimension)
+            throw std::runtime_error(path + ": corrupt Hypercube projection matrix");
+
+        f_salt = makeSalts(k_bits, seed_);
+
+        cube_.sparse = r.pod<int32_t>() != 0;
+        cube_.keys = r.vec<Vertex>();
+        cube_.offsets = r.vec<uint32_t>();
+        cube_.points = r.vec<unsigned>();
+        //the layout is stored, not inferred from the keys: a sparse table of an empty base has none
+        const size_t vertices = cube_.sparse ? cube_.keys.size() : size_t(1) << std::min(k_bits, VertexTable::kDenseMaxBits);
+        bool ok = cube_.sparse == (k_bits > VertexTable::kDenseMaxBits) && (cube_.sparse || cube_.keys.empty()) &&
+                  cube_.offsets.size() == vertices + 1 && cube_.offsets.front() == 0 &&
+                  cube_.offsets.back() == cube_.points.size() && cube_.points.size() == static_cast<size_t>(base.n);
+        for(size_t v = 0; ok && v < vertices; ++v) ok = cube_.offsets[v] <= cube_.offsets[v + 1];
+        for(size_t v = 1; ok && v < cube_.keys.size(); ++v) ok = cube_.keys[v - 1] < cube_.keys[v];
+        for(size_t i = 0; ok && i < cube_.points.size(); ++i) ok = cube_.points[i] < static_cast<unsigned>(base.n);
+        if(!ok) throw std::runtime_error(path + ": corrupt Hypercube vertex table");
+
+        probe_masks_ = enumerateProbes(k_bits, std::max(1, probes_v));
+        own_.reset();
+        base_ = matrix_view(base);
+    }
 }
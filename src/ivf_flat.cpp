@@ -1,41 +1,54 @@
 #include "../include/ivf_flat.hpp"
+#include "../include/distance.hpp"
+#include "../include/topn.hpp"
+#include "../include/binary_io.hpp"
 #include <algorithm>
 #include <limits>
 #include <cmath>
+#include <type_traits>
 
-
-static inline float l2_sq(const float* a, const float* b, int d) {
-    float s = 0.0f;
-    for (int i = 0; i < d; ++i) {
-        float v = a[i] - b[i];
-        s += v * v;
-    }
-    return s;
-}
+// Everything below is templated on the element type T of the base (float, or uint8
+// for MNIST). Centroids are float; list scans on uint8 data use the integer kernel.
 
 // Returns the indices of the nprobe closest centroids (in increasing distance)
-static std::vector<int> top_nprobe_centroids(const Matrix& C, const float* q, int nprobe) {
-    const int k = C.n;
-    std::vector<std::pair<float,int>> dv; dv.reserve(k);
-    for (int j = 0; j < k; ++j) {
-        dv.emplace_back(l2_sq(q, C.row(j), C.d), j);
-    }
-    if (nprobe < k) {
-        std::nth_element(dv.begin(), dv.begin() + nprobe, dv.end(),
-                         [](const auto& A, const auto& B){ return A.first < B.first; });
-        dv.resize(nprobe);
-    }
-    std::sort(dv.begin(), dv.end(),
-              [](const auto& A, const auto& B){ return A.first < B.first; });
+template <class T>
+static std::vector<int> top_nprobe_centroids(const Matrix& C, const T* q, int nprobe) {
+    TopNHeap<float> best(std::min(nprobe, C.n));
+    for (int j = 0; j < C.n; ++j)
+        best.push(dist::l2_sq(q, C.row(j), C.d), j);
 
-    std::vector<int> idx; idx.reserve((size_t)std::min(nprobe, k));
-    for (const auto& p : dv) idx.push_back(p.second);
+    std::vector<int> idx; idx.reserve((size_t)best.size());
+    for (const auto& p : best.take_sorted()) idx.push_back(p.second);
     return idx;
 }
 
+// list-ordered copy of the vectors for element type T (const or not, as the index)
+template <class T, class Index>
+static auto& stored_vecs(Index& ivf) {
+    if constexpr (std::is_same<T, uint8_t>::value) return ivf.vecs8;
+    else return ivf.vecs;
+}
+
+// Calls fn(id, row) for every point of list c, reading the rows either from the
+// contiguous copy (one sequential scan) or from the base matrix (one gather per id).
+// A copy of the other element type (u8 index, float base) leaves V empty: gather then.
+template <class T, class Fn>
+static inline void scan_list(const IVFIndexFlat& ivf, const DenseMatrix<T>& base, int c, Fn&& fn) {
+    const auto& lst = ivf.lists[c];
+    const DenseMatrix<T>& V = stored_vecs<T>(ivf);
+    if (ivf.contiguous() && V.n > 0) {
+        const T* row = V.row((int)ivf.list_offset[c]);
+        for (size_t k = 0; k < lst.size(); ++k, row += V.d) fn(lst[k], row);
+    } else {
+        for (int id : lst) fn(id, base.row(id));
+    }
+}
+
 // ================== Index Construction ==================
 
-IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int train_subset) {
+template <class T>
+static IVFIndexFlat build_ivf_flat_impl(const DenseMatrix<T>& base, int kclusters, int seed, int train_subset,
+                                        bool contiguous, const KMeansParams& km_opts) {
     if (kclusters <= 0) throw std::runtime_error("ivf_flat: kclusters must be > 0");
     if (kclusters > base.n) throw std::runtime_error("ivf_flat: kclusters cannot exceed #points");
 
@@ -46,6 +59,11 @@ IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int tra
     kp.seed = seed;
     kp.use_kmeanspp = true;
     kp.train_subset = (train_subset > 0 && train_subset < base.n) ? train_subset : -1;
+    kp.threads = km_opts.threads;
+    kp.algo = km_opts.algo;
+    kp.batch_size = km_opts.batch_size;
+    kp.batch_iters = km_opts.batch_iters;
+    if (kp.batch_size > 0) kp.train_subset = -1; // mini-batch streams over the whole base
 
     KMeansResult km = kmeans_train(base, kp);
 
@@ -60,16 +78,36 @@ IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int tra
             throw std::runtime_error("ivf_flat: invalid cluster id in assignments");
         ivf.lists[c].push_back(i);
     }
+
+    // Optional list-ordered copy: rows of list c packed back to back
+    if (contiguous) {
+        ivf.list_offset.assign(kclusters + 1, 0);
+        for (int c = 0; c < kclusters; ++c)
+            ivf.list_offset[c + 1] = ivf.list_offset[c] + ivf.lists[c].size();
+
+        DenseMatrix<T>& V = stored_vecs<T>(ivf);
+        V.n = base.n;
+        V.d = base.d;
+        V.a.resize((size_t)base.n * base.d);
+        for (int c = 0; c < kclusters; ++c) {
+            T* dst = V.row((int)ivf.list_offset[c]);
+            for (int id : ivf.lists[c]) {
+                std::copy(base.row(id), base.row(id) + base.d, dst);
+                dst += base.d;
+            }
+        }
+    }
     return ivf;
 }
 
 // ================== Queries ==================
 
-TopN ivf_flat_query_topN(const IVFIndexFlat& ivf,
-                         const Matrix& base,
-                         const float* q,
-                         int nprobe,
-                         int N) {
+template <class T>
+static TopN ivf_flat_query_topN_impl(const IVFIndexFlat& ivf,
+                                     const DenseMatrix<T>& base,
+                                     const T* q,
+                                     int nprobe,
+                                     int N) {
     TopN res;
     if (N <= 0) return res;
     if (ivf.centroids.n == 0) return res;
@@ -79,41 +117,30 @@ TopN ivf_flat_query_topN(const IVFIndexFlat& ivf,
     // 1) Select the nprobe closest centroids
     std::vector<int> probes = top_nprobe_centroids(ivf.centroids, q, nprobe);
 
-    // 2) Collect candidates from the corresponding inverted lists and compute distances
-    std::vector<std::pair<float,int>> cand;
+    // 2) Scan the corresponding inverted lists, keeping only the best N (O(N) memory)
+    TopNHeap<float> best(N);
     for (int c : probes) {
-        const auto& lst = ivf.lists[c];
-        cand.reserve(cand.size() + lst.size());
-        for (int id : lst) {
-            float d2 = l2_sq(q, base.row(id), base.d);
-            cand.emplace_back(d2, id);
-        }
-    }
-    if (cand.empty()) return res;
-
-    // 3) Keep the best N candidates
-    if ((int)cand.size() > N) {
-        std::nth_element(cand.begin(), cand.begin() + N, cand.end(),
-                         [](const auto& A, const auto& B){ return A.first < B.first; });
-        cand.resize(N);
+        scan_list(ivf, base, c, [&](int id, const T* x) {
+            best.push((float)dist::l2_sq(q, x, base.d), id);
+        });
     }
-    std::sort(cand.begin(), cand.end(),
-              [](const auto& A, const auto& B){ return A.first < B.first; });
 
-    res.ids.reserve(cand.size());
-    res.dists.reserve(cand.size());
-    for (const auto& p : cand) {
+    // 3) Emit them in increasing distance
+    res.ids.reserve(best.size());
+    res.dists.reserve(best.size());
+    for (const auto& p : best.take_sorted()) {
         res.ids.push_back(p.second);
         res.dists.push_back(std::sqrt(p.first)); // return Euclidean distance (not squared)
     }
     return res;
 }
 
-std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf,
-                                      const Matrix& base,
-                                      const float* q,
-                                      int nprobe,
-                                      float R) {
+template <class T>
+static std::vector<int> ivf_flat_query_range_impl(const IVFIndexFlat& ivf,
+                                                  const DenseMatrix<T>& base,
+                                                  const T* q,
+                                                  int nprobe,
+                                                  float R) {
     std::vector<int> out;
     if (ivf.centroids.n == 0) return out;
 
@@ -125,11 +152,105 @@ std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf,
 
     // 2) Scan only the corresponding lists and apply threshold on radius R
     for (int c : probes) {
-        const auto& lst = ivf.lists[c];
-        for (int id : lst) {
-            float d2 = l2_sq(q, base.row(id), base.d);
+        scan_list(ivf, base, c, [&](int id, const T* x) {
+            float d2 = (float)dist::l2_sq(q, x, base.d);
             if (d2 <= R2) out.push_back(id);
-        }
+        });
     }
     return out;
 }
+
+// ================== Public entry points (float / uint8) ==================
+
+IVFIndexFlat build_ivf_flat(const Matrix& base, int kclusters, int seed, int train_subset, bool contiguous,
+                            const KMeansParams& km) {
+    return build_ivf_flat_impl(base, kclusters, seed, train_subset, contiguous, km);
+}
+IVFIndexFlat build_ivf_flat(const MatrixU8& base, int kclusters, int seed, int train_subset, bool contiguous,
+                            const KMeansParams& km) {
+    return build_ivf_flat_impl(base, kclusters, seed, train_subset, contiguous, km);
+}
+
+size_t ivf_flat_memory_bytes(const IVFIndexFlat& ivf) {
+    auto mat = [](const auto& M, size_t elem) { return (size_t)M.n * M.d * elem; }; // owned or mapped
+    size_t bytes = mat(ivf.centroids, sizeof(float));
+    for (const auto& lst : ivf.lists) bytes += lst.size() * sizeof(int);
+    bytes += ivf.list_offset.size() * sizeof(size_t);
+    bytes += mat(ivf.vecs, sizeof(float)) + mat(ivf.vecs8, sizeof(uint8_t));
+    return bytes;
+}
+
+// ================== Save / Load ==================
+
+static const char kIVFFlatMagic[9] = "IVFFLAT\0";
+static const uint32_t kIVFFlatVersion = 1;
+
+void save_ivf_flat(const std::string& path, const IVFIndexFlat& ivf, int n, int d) {
+    BinWriter w(path);
+    w.header(kIVFFlatMagic, kIVFFlatVersion);
+    w.pod<int32_t>(n);
+    w.pod<int32_t>(d);
+    w.matrix(ivf.centroids);
+    w.pod<uint32_t>((uint32_t)ivf.lists.size());
+    for (const auto& lst : ivf.lists) w.vec(lst);
+    std::vector<uint64_t> offs(ivf.list_offset.begin(), ivf.list_offset.end());
+    w.vec(offs);
+    w.matrix(ivf.vecs);
+    w.matrix(ivf.vecs8);
+    w.close();
+}
+
+IVFIndexFlat load_ivf_flat(const std::string& path, int n, int d) {
+    BinReader r(path);
+    r.header(kIVFFlatMagic, kIVFFlatVersion, "IVFFlat");
+    const int fn = r.pod<int32_t>(), fd = r.pod<int32_t>();
+    if (fn != n || fd != d)
+        throw std::runtime_error("ivf_flat: index " + path + " was built for n=" + std::to_string(fn) +
+                                 " d=" + std::to_string(fd) + ", base has n=" + std::to_string(n) +
+                                 " d=" + std::to_string(d));
+
+    IVFIndexFlat ivf;
+    ivf.centroids = r.matrix<float>();
+    ivf.lists.resize(r.pod<uint32_t>());
+    for (auto& lst : ivf.lists) lst = r.vec<int>();
+    std::vector<uint64_t> offs = r.vec<uint64_t>();
+    ivf.list_offset.assign(offs.begin(), offs.end());
+    ivf.vecs = r.matrix<float>();
+    ivf.vecs8 = r.matrix<uint8_t>();
+
+    auto fail = [&path]() { throw std::runtime_error("ivf_flat: inconsistent index file " + path); };
+    if ((int)ivf.lists.size() != ivf.centroids.n || ivf.centroids.d != d) fail();
+    for (const auto& lst : ivf.lists)
+        for (int id : lst)
+            if ((unsigned)id >= (unsigned)n) fail();
+
+    // contiguous copy: list c must own exactly rows list_offset[c] .. list_offset[c+1]-1
+    // of the copy matching the base type (the other one stays empty)
+    if (ivf.contiguous()) {
+        if (ivf.list_offset.size() != ivf.lists.size() + 1 || ivf.list_offset[0] != 0) fail();
+        for (size_t c = 0; c < ivf.lists.size(); ++c)
+            if (ivf.list_offset[c + 1] < ivf.list_offset[c] ||
+                ivf.list_offset[c + 1] - ivf.list_offset[c] != ivf.lists[c].size()) fail();
+        const size_t rows = ivf.list_offset.back();
+        const bool f32 = ivf.vecs.n > 0 && (size_t)ivf.vecs.n == rows && ivf.vecs.d == d && ivf.vecs8.n == 0;
+        const bool u8 = ivf.vecs8.n > 0 && (size_t)ivf.vecs8.n == rows && ivf.vecs8.d == d && ivf.vecs.n == 0;
+        if (!f32 && !u8) fail();
+    } else if (ivf.vecs.n != 0 || ivf.vecs8.n != 0) {
+        fail();
+    }
+    return ivf;
+}
+
+TopN ivf_flat_query_topN(const IVFIndexFlat& ivf, const Matrix& base, const float* q, int nprobe, int N) {
+    return ivf_flat_query_topN_impl(ivf, base, q, nprobe, N);
+}
+TopN ivf_flat_query_topN(const IVFIndexFlat& ivf, const MatrixU8& base, const uint8_t* q, int nprobe, int N) {
+    return ivf_flat_query_topN_impl(ivf, base, q, nprobe, N);
+}
+
+std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf, const Matrix& base, const float* q, int nprobe, float R) {
+    return ivf_flat_query_range_impl(ivf, base, q, nprobe, R);
+}
+std::vector<int> ivf_flat_query_range(const IVFIndexFlat& ivf, const MatrixU8& base, const uint8_t* q, int nprobe, float R) {
+    return ivf_flat_query_range_impl(ivf, base, q, nprobe, R);
+}
@@ -1,31 +1,21 @@
 #include "../include/ivf_pq.hpp"
+#include "../include/distance.hpp"
+#include "../include/topn.hpp"
+#include "../include/binary_io.hpp"
+#include "../include/parallel.hpp"
 #include <algorithm>
 #include <cmath>
 #include <limits>
 #include <stdexcept>
+#include <string>
 
 // ---------- helpers ----------
 
-static inline float l2_sq(const float* a, const float* b, int d) {
-    float s = 0.0f;
-    for (int i = 0; i < d; ++i) { float v = a[i] - b[i]; s += v * v; }
-    return s;
-}
-
-static std::vector<int> top_nprobe_centroids(const Matrix& C, const float* q, int nprobe) {
-    const int k = C.n;
-    std::vector<std::pair<float,int>> dv; dv.reserve(k);
-    for (int j = 0; j < k; ++j) dv.emplace_back(l2_sq(q, C.row(j), C.d), j);
-    if (nprobe < k) {
-        std::nth_element(dv.begin(), dv.begin()+nprobe, dv.end(),
-                         [](auto& A, auto& B){ return A.first < B.first; });
-        dv.resize(nprobe);
-    }
-    std::sort(dv.begin(), dv.end(),
-              [](auto& A, auto& B){ return A.first < B.first; });
-    std::vector<int> idx; idx.reserve((size_t)std::min(nprobe, k));
-    for (auto& p : dv) idx.push_back(p.second);
-    return idx;
+// (||q - c||^2, c) of the nprobe nearest centroids, nearest first
+static std::vector<std::pair<float, int>> top_nprobe_centroids(const Matrix& C, const float* q, int nprobe) {
+    TopNHeap<float> best(std::min(nprobe, C.n));
+    for (int j = 0; j < C.n; ++j) best.push(dist::l2_sq(q, C.row(j), C.d), j);
+    return best.take_sorted();
 }
 
 // subvector pointer for subspace i: [i*Dsub .. (i+1)*Dsub)
@@ -37,39 +27,462 @@ static inline const float* subvec(const float* x, int i, int dsub) {
 static int nearest_code(const float* r_i, const Matrix& Ci) {
     int best = 0; float bd = std::numeric_limits<float>::infinity();
     for (int h = 0; h < Ci.n; ++h) {
-        float d = l2_sq(r_i, Ci.row(h), Ci.d);
+        float d = dist::l2_sq(r_i, Ci.row(h), Ci.d);
         if (d < bd) { bd = d; best = h; }
     }
     return best;
 }
 
-// build LUT[i][h] = || r_i(q) - C_i[h] ||^2
-static void build_LUT(const PQCodebooks& pq, const float* rq, std::vector<float>& LUT) {
-    LUT.assign((size_t)pq.M * pq.s, 0.0f);
+// T[c*M*s + i*s + h] = ||C_i[h]||^2 + 2 <c_i, C_i[h]> for k centroids (rows `stride` floats apart):
+// one ip_block per subspace (all k centroid subvectors against the s codewords)
+static void coarse_terms_rows(const float* C0, size_t stride, int k, const PQCodebooks& pq, float* T) {
+    const size_t ms = (size_t)pq.M * pq.s;
+    thread_local std::vector<float> ip;
+    ip.resize((size_t)k * pq.s);
     for (int i = 0; i < pq.M; ++i) {
-        const float* r_i = subvec(rq, i, pq.dsub);
-        const Matrix& Ci = pq.C[i]; // s x dsub
-        float* rowLUT = LUT.data() + (size_t)i * pq.s;
+        const Matrix& Ci = pq.C[i];
+        dist::ip_block(C0 + (size_t)i * pq.dsub, stride, k, Ci.row(0), Ci.row_stride(), pq.s, pq.dsub, ip.data());
         for (int h = 0; h < pq.s; ++h) {
-            rowLUT[h] = l2_sq(r_i, Ci.row(h), pq.dsub);
+            const float norm = dist::inner_product(Ci.row(h), Ci.row(h), pq.dsub);
+            for (int c = 0; c < k; ++c) T[(size_t)c * ms + (size_t)i * pq.s + h] = norm + 2.0f * ip[(size_t)c * pq.s + h];
+        }
+    }
+}
+
+// coarse_terms = the terms of every centroid (k x M*s)
+static Matrix precompute_coarse_terms(const Matrix& centroids, const PQCodebooks& pq) {
+    const int k = centroids.n, ms = pq.M * pq.s;
+    Matrix T; T.n = k; T.d = ms; T.a.assign((size_t)k * ms, 0.0f);
+    coarse_terms_rows(centroids.row(0), centroids.row_stride(), k, pq, T.a.data());
+    return T;
+}
+
+// y = P x for the d x d OPQ rotation P (rows = the rotated axes)
+static inline void opq_rotate(const Matrix& P, const float* x, float* y) {
+    dist::ip_block(x, (size_t)P.d, 1, P.row(0), P.row_stride(), P.n, P.d, y);
+}
+
+// every row of X rotated by P (X: n x d)
+static Matrix opq_rotate_rows(const Matrix& P, const Matrix& X) {
+    Matrix Y; Y.n = X.n; Y.d = X.d; Y.a.assign((size_t)X.n * X.d, 0.0f);
+    if (X.n > 0) dist::ip_block(X.row(0), X.row_stride(), X.n, P.row(0), P.row_stride(), P.n, X.d, Y.a.data());
+    return Y;
+}
+
+// query term LUTq[i*s + h] = -2 <q_i, C_i[h]>, built once per query (q rotated first with OPQ)
+static void build_query_terms(const IVFIndexPQ& ivf, const float* q, std::vector<float>& LUTq) {
+    const PQCodebooks& pq = ivf.pq;
+    if (ivf.opq.n > 0) {
+        thread_local std::vector<float> qr;
+        qr.resize((size_t)ivf.opq.d);
+        opq_rotate(ivf.opq, q, qr.data());
+        q = qr.data();
+    }
+    LUTq.resize((size_t)pq.M * pq.s);
+    for (int i = 0; i < pq.M; ++i) {
+        float* row = LUTq.data() + (size_t)i * pq.s;
+        dist::ip_block(subvec(q, i, pq.dsub), (size_t)pq.dsub, 1, pq.C[i].row(0), pq.C[i].row_stride(), pq.s, pq.dsub, row);
+        for (int h = 0; h < pq.s; ++h) row[h] *= -2.0f;
+    }
+}
+
+// LUT of list c: LUT[i*s + h] = coarse_terms[c][i*s + h] + LUTq[i*s + h] (M*s adds, no flops over dsub);
+// ADC distance of a code = ||q - c||^2 + sum_i LUT[i*s + code_i].
+// Without coarse_terms (nbits > 8) the terms of c are computed here (centroid rotated with OPQ).
+static void list_LUT(const IVFIndexPQ& ivf, int c, const std::vector<float>& LUTq, std::vector<float>& LUT) {
+    const float* T;
+    thread_local std::vector<float> Tc, cr;
+    if (ivf.coarse_terms.n > 0) {
+        T = ivf.coarse_terms.row(c);
+    } else {
+        const float* cc = ivf.centroids.row(c);
+        if (ivf.opq.n > 0) {
+            cr.resize((size_t)ivf.opq.d);
+            opq_rotate(ivf.opq, cc, cr.data());
+            cc = cr.data();
         }
+        Tc.resize(LUTq.size());
+        coarse_terms_rows(cc, (size_t)ivf.centroids.d, 1, ivf.pq, Tc.data());
+        T = Tc.data();
+    }
+    LUT.resize(LUTq.size());
+    for (size_t j = 0; j < LUTq.size(); ++j) LUT[j] = T[j] + LUTq[j];
+}
+
+// writes code v of subspace i into a packed vector (inverse of pq_code; the bytes start at 0)
+static inline void put_code(uint8_t* code, int i, int nbits, uint32_t v) {
+    const size_t bit = (size_t)i * nbits;
+    v <<= bit & 7;
+    for (uint8_t* p = code + (bit >> 3); v != 0; v >>= 8) *p++ |= (uint8_t)v;
+}
+
+// ---------- 4-bit fast-scan ----------
+
+static const int kFSBlock = 32; // vectors per fast-scan block (see dist::pq4_scan)
+
+// code of subspace m of vector k in a fast-scan list
+static inline int fs_code(const uint8_t* blocks, int M, size_t k, int m) {
+    const uint8_t byte = blocks[(k / kFSBlock) * 16 * (size_t)M + (size_t)m * 16 + (k & 15)];
+    return (k & 16) ? byte >> 4 : byte & 15;
+}
+
+// uint8 LUT of one list: LUT8[i*16 + h] = round((LUT[i*16 + h] - min_i) * scale), one scale for all
+// subspaces so the uint16 sums of pq4_scan stay comparable; returns sum_i min_i
+static float quantize_LUT(const std::vector<float>& LUT, int M, std::vector<uint8_t>& LUT8, float& scale) {
+    float bias = 0.0f, range = 0.0f;
+    for (int i = 0; i < M; ++i) {
+        const float* row = LUT.data() + (size_t)i * 16;
+        const auto mm = std::minmax_element(row, row + 16);
+        bias += *mm.first;
+        range = std::max(range, *mm.second - *mm.first);
     }
+    scale = range > 0.0f ? 255.0f / range : 1.0f;
+    LUT8.resize((size_t)M * 16);
+    for (int i = 0; i < M; ++i) {
+        const float* row = LUT.data() + (size_t)i * 16;
+        const float mn = *std::min_element(row, row + 16);
+        for (int h = 0; h < 16; ++h)
+            LUT8[(size_t)i * 16 + h] = (uint8_t)std::min(255.0f, std::floor((row[h] - mn) * scale + 0.5f));
+    }
+    return bias;
+}
+
+// Scans fast-scan list c: every code whose quantized distance, less the worst-case rounding error
+// (0.5 per subspace, +1 for float error), is still <= bound() is rescored with the float LUT and
+// passed to emit(distance, id). The rescored distances are the plain ADC ones.
+template <class Bound, class Emit>
+static void fast_scan_list(const IVFIndexPQ& ivf, int c, float coarse_dist, const std::vector<float>& LUT,
+                           std::vector<uint8_t>& LUT8, Bound bound, Emit emit) {
+    const int M = ivf.pq.M;
+    float scale;
+    const float bias = coarse_dist + quantize_LUT(LUT, M, LUT8, scale);
+    const float slack = 0.5f * M + 1.0f;
+
+    const auto& ids_c = ivf.ids[c];
+    const uint8_t* blocks = ivf.codes4[c].data();
+    const size_t n = ids_c.size();
+    uint16_t acc[kFSBlock];
+    for (size_t b0 = 0; b0 < n; b0 += kFSBlock) {
+        const float limit = (bound() - bias) * scale + slack; // in LUT8 units
+        if (limit < 0.0f) continue;
+        dist::pq4_scan(blocks + (b0 / kFSBlock) * 16 * (size_t)M, LUT8.data(), M, acc);
+        const size_t nb = std::min<size_t>(kFSBlock, n - b0);
+        for (size_t j = 0; j < nb; ++j) {
+            if (acc[j] > limit) continue;
+            float d = coarse_dist;
+            for (int si = 0; si < M; ++si) d += LUT[(size_t)si * 16 + fs_code(blocks, M, b0 + j, si)];
+            emit(d, ids_c[b0 + j]);
+        }
+    }
+}
+
+void ivf_pq_pack_fast_scan(IVFIndexPQ& ivf) {
+    if (ivf.fast_scan) return;
+    if (ivf.pq.nbits != 4) throw std::runtime_error("ivf_pq: fast-scan needs nbits = 4");
+    if (ivf.pq.M > 256) throw std::runtime_error("ivf_pq: fast-scan needs M <= 256 (uint16 sums)");
+    const int M = ivf.pq.M;
+    const size_t cs = ivf.pq.code_size();
+    ivf.codes4.assign(ivf.codes.size(), {});
+    for (size_t c = 0; c < ivf.codes.size(); ++c) {
+        const size_t n = ivf.ids[c].size();
+        auto& out = ivf.codes4[c];
+        out.assign((n + kFSBlock - 1) / kFSBlock * 16 * (size_t)M, 0); // padding codes are 0, never reported
+        for (size_t k = 0; k < n; ++k)
+            for (int m = 0; m < M; ++m) {
+                const uint8_t code = (uint8_t)pq_code(ivf.codes[c].data() + k * cs, m, 4);
+                out[(k / kFSBlock) * 16 * (size_t)M + (size_t)m * 16 + (k & 15)] |= (k & 16) ? uint8_t(code << 4) : code;
+            }
+        std::vector<uint8_t>().swap(ivf.codes[c]);
+    }
+    ivf.fast_scan = true;
+}
+
+// ---------- codebooks / OPQ ----------
+
+// k-means codebook of every subspace on the (possibly rotated) training residuals Y (trainN x d)
+static void train_codebooks(const Matrix& Y, PQCodebooks& pq, int seed, int max_iters, const KMeansParams& km_opts) {
+    const int trainN = Y.n, dsub = pq.dsub;
+    for (int si = 0; si < pq.M; ++si) {
+        // Build residual matrix for subspace si: trainN x dsub
+        Matrix RS; RS.n = trainN; RS.d = dsub; RS.a.assign((size_t)trainN * dsub, 0.0f);
+        for (int t = 0; t < trainN; ++t)
+            for (int j = 0; j < dsub; ++j) RS.a[(size_t)t * dsub + j] = Y.row(t)[si * dsub + j];
+
+        KMeansParams psub;
+        psub.k = pq.s;
+        psub.max_iters = max_iters;
+        psub.tol = 1e-4f;
+        psub.seed = seed + 1234 + si; // different seed per subspace
+        psub.use_kmeanspp = true;
+        psub.train_subset = -1; // use RS entirely
+        psub.threads = km_opts.threads;
+        psub.algo = km_opts.algo;
+
+        KMeansResult rsub = kmeans_train(RS, psub);
+        pq.C[si] = std::move(rsub.centroids); // s x dsub
+    }
+}
+
+// SVD A = U S V^T of a d x d matrix by one-sided Jacobi in double. cols holds the columns of A
+// (cols[p*d + i] = A[i][p]) and is overwritten by those of U; V by columns in the same layout.
+// Columns and rows of A that are exactly zero (pixels that are 0 in every training vector) never
+// rotate, so the sweeps run on the compact block of the others. Its columns are cut into blocks of
+// kJacobiBlock and every sweep pairs the blocks round-robin: each round rotates disjoint block pairs
+// on the threads, in an order that does not depend on the thread count (nor does the result).
+// Where S is (numerically) zero the columns of U are completed to an orthonormal basis (complete_u).
+static const int kJacobiBlock = 16;
+
+static void jacobi_svd(std::vector<double>& cols, int d, std::vector<double>& V, std::vector<double>& sigma,
+                       int threads, bool complete_u = true) {
+    std::vector<int> ac, ar; // active columns and rows
+    std::vector<char> row_used(d, 0);
+    for (int p = 0; p < d; ++p) {
+        bool nz = false;
+        for (int i = 0; i < d; ++i)
+            if (cols[(size_t)p * d + i] != 0.0) { nz = true; row_used[i] = 1; }
+        if (nz) ac.push_back(p);
+    }
+    for (int i = 0; i < d; ++i) if (row_used[i]) ar.push_back(i);
+    const int dc = (int)ac.size(), dr = (int)ar.size();
+
+    // compact columns (dc x dr), their rotations W (dc x dc) and squared norms
+    std::vector<double> A((size_t)dc * dr), W((size_t)dc * dc, 0.0), norm2(dc);
+    for (int p = 0; p < dc; ++p) {
+        for (int i = 0; i < dr; ++i) A[(size_t)p * dr + i] = cols[(size_t)ac[p] * d + ar[i]];
+        W[(size_t)p * dc + p] = 1.0;
+    }
+
+    // rotates columns p, q until orthogonal; the norms follow as alpha - t gamma, beta + t gamma
+    auto rotate_pair = [&](int p, int q, double& off) {
+        const double alpha = norm2[p], beta = norm2[q];
+        if (alpha <= 0.0 || beta <= 0.0) return;
+        double* ap = A.data() + (size_t)p * dr;
+        double* aq = A.data() + (size_t)q * dr;
+        double gamma = 0.0;
+        for (int i = 0; i < dr; ++i) gamma += ap[i] * aq[i];
+        if (gamma == 0.0 || std::fabs(gamma) <= 1e-15 * std::sqrt(alpha * beta)) return;
+        off = std::max(off, std::fabs(gamma) / std::sqrt(alpha * beta));
+        const double zeta = (beta - alpha) / (2.0 * gamma);
+        const double t = (zeta >= 0.0 ? 1.0 : -1.0) / (std::fabs(zeta) + std::sqrt(1.0 + zeta * zeta));
+        const double c = 1.0 / std::sqrt(1.0 + t * t), s = c * t;
+        for (int i = 0; i < dr; ++i) {
+            const double x = ap[i], y = aq[i];
+            ap[i] = c * x - s * y;
+            aq[i] = s * x + c * y;
+        }
+        double* wp = W.data() + (size_t)p * dc;
+        double* wq = W.data() + (size_t)q * dc;
+        for (int i = 0; i < dc; ++i) {
+            const double x = wp[i], y = wq[i];
+            wp[i] = c * x - s * y;
+            wq[i] = s * x + c * y;
+        }
+        norm2[p] = alpha - t * gamma;
+        norm2[q] = beta + t * gamma;
+    };
+
+    int nb = (dc + kJacobiBlock - 1) / kJacobiBlock;
+    nb += nb % 2; // even, the last block may be empty
+    auto block = [&](int b, int& lo, int& hi) { lo = std::min(dc, b * kJacobiBlock); hi = std::min(dc, lo + kJacobiBlock); };
+    std::vector<double> off_task(nb / 2);
+    for (int sweep = 0; sweep < 64 && dc > 1; ++sweep) {
+        parallel_for(0, dc, threads, [&](int p) { // exact norms again, so the updates do not drift
+            double n2 = 0.0;
+            for (int i = 0; i < dr; ++i) n2 += A[(size_t)p * dr + i] * A[(size_t)p * dr + i];
+            norm2[p] = n2;
+        }, 16);
+        { // columns by decreasing norm, which cuts the sweeps (A and W move together: A W = U S holds)
+            std::vector<int> perm(dc);
+            for (int p = 0; p < dc; ++p) perm[p] = p;
+            std::stable_sort(perm.begin(), perm.end(), [&](int a, int b) { return norm2[a] > norm2[b]; });
+            std::vector<double> A2(A.size()), W2(W.size()), n2(dc);
+            for (int p = 0; p < dc; ++p) {
+                std::copy(A.begin() + (size_t)perm[p] * dr, A.begin() + (size_t)(perm[p] + 1) * dr, A2.begin() + (size_t)p * dr);
+                std::copy(W.begin() + (size_t)perm[p] * dc, W.begin() + (size_t)(perm[p] + 1) * dc, W2.begin() + (size_t)p * dc);
+                n2[p] = norm2[perm[p]];
+            }
+            A.swap(A2); W.swap(W2); norm2.swap(n2);
+        }
+        std::fill(off_task.begin(), off_task.end(), 0.0);
+        // circle method: block 0 stays, the others shift by one position per round
+        for (int r = 0; r + 1 < nb; ++r)
+            parallel_for(0, nb / 2, threads, [&](int k) {
+                auto at = [&](int pos) { return pos == 0 ? 0 : 1 + (pos - 1 + r) % (nb - 1); };
+                int alo, ahi, blo, bhi;
+                block(at(k), alo, ahi);
+                block(at(nb - 1 - k), blo, bhi);
+                double& off = off_task[k];
+                if (r == 0) { // pairs inside a block, once per sweep
+                    for (int p = alo; p < ahi; ++p) for (int q = p + 1; q < ahi; ++q) rotate_pair(p, q, off);
+                    for (int p = blo; p < bhi; ++p) for (int q = p + 1; q < bhi; ++q) rotate_pair(p, q, off);
+                }
+                for (int p = alo; p < ahi; ++p)
+                    for (int q = blo; q < bhi; ++q) rotate_pair(std::min(p, q), std::max(p, q), off);
+            });
+        if (*std::max_element(off_task.begin(), off_task.end()) < 1e-12) break; // largest |cos| of two columns
+    }
+
+    // back to d x d: zero columns of A stay zero, V is the identity outside the active columns
+    std::fill(cols.begin(), cols.end(), 0.0);
+    V.assign((size_t)d * d, 0.0);
+    for (int i = 0; i < d; ++i) V[(size_t)i * d + i] = 1.0;
+    for (int p = 0; p < dc; ++p) {
+        for (int i = 0; i < dr; ++i) cols[(size_t)ac[p] * d + ar[i]] = A[(size_t)p * dr + i];
+        V[(size_t)ac[p] * d + ac[p]] = 0.0;
+        for (int q = 0; q < dc; ++q) V[(size_t)ac[p] * d + ac[q]] = W[(size_t)p * dc + q];
+    }
+
+    // columns of A V = U S; normalize to U
+    double smax = 0.0;
+    sigma.assign(d, 0.0);
+    for (int p = 0; p < d; ++p) {
+        double n2 = 0.0;
+        for (int i = 0; i < d; ++i) n2 += cols[(size_t)p * d + i] * cols[(size_t)p * d + i];
+        sigma[p] = std::sqrt(n2);
+        smax = std::max(smax, sigma[p]);
+    }
+    if (!complete_u) return;
+    std::vector<char> good(d);
+    for (int p = 0; p < d; ++p) {
+        good[p] = sigma[p] > 1e-10 * smax;
+        if (good[p]) for (int i = 0; i < d; ++i) cols[(size_t)p * d + i] /= sigma[p];
+    }
+    for (int p = 0, e = 0; p < d; ++p) {
+        if (good[p]) continue;
+        for (; e < d; ++e) { // next unit vector that is not in the span of the columns kept so far
+            double* u = cols.data() + (size_t)p * d;
+            std::fill(u, u + d, 0.0);
+            u[e] = 1.0;
+            for (int r = 0; r < d; ++r) {
+                if (!good[r]) continue;
+                const double* v = cols.data() + (size_t)r * d;
+                double dot = 0.0;
+                for (int i = 0; i < d; ++i) dot += u[i] * v[i];
+                for (int i = 0; i < d; ++i) u[i] -= dot * v[i];
+            }
+            double n2 = 0.0;
+            for (int i = 0; i < d; ++i) n2 += u[i] * u[i];
+            if (n2 > 1e-6) {
+                for (int i = 0; i < d; ++i) u[i] /= std::sqrt(n2);
+                good[p] = 1;
+                ++e;
+                break;
+            }
+        }
+    }
+}
+
+// Orthogonal P that maximizes tr(P A), i.e. minimizes sum_t ||P x_t - y_t||^2 for A = sum_t x_t y_t^T
+// (orthogonal Procrustes): A = U S V^T, P = V U^T. rows holds A by rows (rows[i*d + j] = A[i][j]),
+// i.e. the columns of A^T, whose zero ones (pixels never set in x) drop out of jacobi_svd:
+// A^T = U' S V'^T gives U = V', V = U' and P = U' V'^T.
+static Matrix procrustes(std::vector<double> rows, int d, int threads) {
+    std::vector<double> V, sigma;
+    jacobi_svd(rows, d, V, sigma, threads); // rows -> U'
+
+    // P[i][j] = sum_p U'[i][p] V'[j][p]
+    Matrix P; P.n = d; P.d = d; P.a.assign((size_t)d * d, 0.0f);
+    parallel_for(0, d, threads, [&](int i) {
+        std::vector<double> acc(d, 0.0);
+        for (int p = 0; p < d; ++p) {
+            const double u = rows[(size_t)p * d + i];
+            if (u == 0.0) continue;
+            const double* v = V.data() + (size_t)p * d;
+            for (int j = 0; j < d; ++j) acc[j] += u * v[j];
+        }
+        for (int j = 0; j < d; ++j) P.row(i)[j] = (float)acc[j];
+    });
+    return P;
+}
+
+// Initial rotation of the parametric OPQ (Ge et al., "eigenvalue allocation"): the principal axes
+// of X, dealt to the M subspaces so that the products of their variances are balanced (largest
+// eigenvalue first, each into the non-full subspace with the smallest product so far).
+static Matrix opq_eigen_allocation(const Matrix& X, int M, int dsub, int threads) {
+    const int d = X.d;
+    std::vector<double> cov((size_t)d * d, 0.0); // symmetric: rows = columns
+    parallel_for(0, d, threads, [&](int i) {
+        double* row = cov.data() + (size_t)i * d;
+        for (int t = 0; t < X.n; ++t) {
+            const float* x = X.row(t);
+            if (x[i] == 0.0f) continue;
+            for (int j = 0; j < d; ++j) row[j] += (double)x[i] * x[j];
+        }
+    });
+    std::vector<double> V, lambda;
+    jacobi_svd(cov, d, V, lambda, threads, false); // PSD: singular values = eigenvalues, V = eigenvectors
+
+    std::vector<int> order(d);
+    for (int p = 0; p < d; ++p) order[p] = p;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return lambda[a] > lambda[b]; });
+
+    std::vector<double> logprod(M, 0.0);
+    std::vector<int> fill(M, 0);
+    Matrix P; P.n = d; P.d = d; P.a.assign((size_t)d * d, 0.0f);
+    for (int p : order) {
+        int best = -1;
+        for (int si = 0; si < M; ++si)
+            if (fill[si] < dsub && (best < 0 || logprod[si] < logprod[best])) best = si;
+        logprod[best] += std::log(std::max(lambda[p], 1e-12));
+        float* row = P.row(best * dsub + fill[best]++);
+        for (int i = 0; i < d; ++i) row[i] = (float)V[(size_t)p * d + i];
+    }
+    return P;
+}
+
+// Non-parametric OPQ (Ge et al.): starting from the eigenvalue allocation, alternate codebooks for
+// the rotated residuals P x and the rotation that best maps the residuals onto their reconstructions.
+static Matrix train_opq(const Matrix& X, PQCodebooks pq, int iters, int seed, const KMeansParams& km_opts) {
+    const int d = X.d;
+    const int threads = km_opts.threads > 0 ? km_opts.threads : hardware_threads();
+    Matrix P = opq_eigen_allocation(X, pq.M, pq.dsub, threads);
+
+    Matrix Yhat; Yhat.n = X.n; Yhat.d = d; Yhat.a.assign((size_t)X.n * d, 0.0f);
+    for (int it = 0; it < iters; ++it) {
+        const Matrix Y = opq_rotate_rows(P, X);
+        train_codebooks(Y, pq, seed + 7919 * (it + 1), 10, km_opts); // a few Lloyd steps per round
+
+        parallel_for(0, X.n, threads, [&](int t) { // reconstructions yhat_t of the rotated residuals
+            for (int si = 0; si < pq.M; ++si) {
+                const int h = nearest_code(subvec(Y.row(t), si, pq.dsub), pq.C[si]);
+                std::copy(pq.C[si].row(h), pq.C[si].row(h) + pq.dsub, Yhat.row(t) + (size_t)si * pq.dsub);
+            }
+        }, 64);
+
+        // A = sum_t x_t yhat_t^T, stored by rows: rows[i*d + j] = A[i][j]
+        std::vector<double> rows((size_t)d * d, 0.0);
+        parallel_for(0, d, threads, [&](int i) {
+            double* row = rows.data() + (size_t)i * d;
+            for (int t = 0; t < X.n; ++t) {
+                const double xi = X.row(t)[i];
+                if (xi == 0.0) continue;
+                const float* y = Yhat.row(t);
+                for (int j = 0; j < d; ++j) row[j] += xi * y[j];
+            }
+        });
+        P = procrustes(std::move(rows), d, threads);
+    }
+    return P;
 }
 
 // ---------- build ----------
 
 IVFIndexPQ build_ivf_pq(const Matrix& base,
                         int kclusters, int M, int nbits,
-                        int seed, int train_subset)
+                        int seed, int train_subset,
+                        const KMeansParams& km_opts, int opq_iters)
 {
     if (kclusters <= 0) throw std::runtime_error("ivf_pq: kclusters must be > 0");
     if (kclusters > base.n) throw std::runtime_error("ivf_pq: kclusters > n");
     if (M <= 0) throw std::runtime_error("ivf_pq: M must be > 0");
-    if (nbits <= 0 || nbits > 8) throw std::runtime_error("ivf_pq: nbits must be in [1,8] (uint8 codes)");
+    if (nbits <= 0 || nbits > 16) throw std::runtime_error("ivf_pq: nbits must be in [1,16]");
 
     if (base.d % M != 0) throw std::runtime_error("ivf_pq: d must be divisible by M");
     const int dsub = base.d / M;
     const int s = 1 << nbits;
+    if (s > base.n)
+        throw std::runtime_error("ivf_pq: nbits " + std::to_string(nbits) + " needs at least 2^nbits = " +
+                                 std::to_string(s) + " base points, got " + std::to_string(base.n));
 
     // 1) Coarse k-means
     KMeansParams kp;
@@ -79,6 +492,11 @@ IVFIndexPQ build_ivf_pq(const Matrix& base,
     kp.seed = seed;
     kp.use_kmeanspp = true;
     kp.train_subset = (train_subset > 0 && train_subset < base.n) ? train_subset : -1;
+    kp.threads = km_opts.threads;
+    kp.algo = km_opts.algo;
+    kp.batch_size = km_opts.batch_size;
+    kp.batch_iters = km_opts.batch_iters;
+    if (kp.batch_size > 0) kp.train_subset = -1; // mini-batch streams over the whole base
 
     KMeansResult km = kmeans_train(base, kp);
 
@@ -93,163 +511,246 @@ IVFIndexPQ build_ivf_pq(const Matrix& base,
     //    We take a subsample of ~sqrt(n) for training the codebooks
     int trainN = (int)std::sqrt((double)base.n);
     if (trainN < s) trainN = s;
+    // ~sqrt(n) points barely exceed s once nbits > 8 (k-means would copy one residual per codeword),
+    // and OPQ fits the rotation on the reconstructions of these points, which then say little about it
+    if (nbits > 8 || opq_iters > 0) trainN = std::max(trainN, 16 * s);
     if (trainN > base.n) trainN = base.n;
 
     std::vector<int> idx(trainN);
     for (int i = 0; i < trainN; ++i) idx[i] = i; // simple prefix (could also randomize)
 
-    // 3) Train codebooks per subspace
-    for (int si = 0; si < M; ++si) {
-        // Build residual matrix for subspace si: trainN x dsub
-        Matrix RS; RS.n = trainN; RS.d = dsub; RS.a.assign((size_t)trainN * dsub, 0.0f);
-        for (int t = 0; t < trainN; ++t) {
-            int i = idx[t];
-            int c = km.assign[i];
-            const float* x = base.row(i);
-            const float* cc = ivf.centroids.row(c);
-            for (int j = 0; j < dsub; ++j) {
-                RS.a[(size_t)t * dsub + j] = x[si*dsub + j] - cc[si*dsub + j];
-            }
-        }
-        KMeansParams psub;
-        psub.k = s;
-        psub.max_iters = 50;
-        psub.tol = 1e-4f;
-        psub.seed = seed + 1234 + si; // different seed per subspace
-        psub.use_kmeanspp = true;
-        psub.train_subset = -1; // use RS entirely
+    // residuals of the training points: trainN x d
+    Matrix RT; RT.n = trainN; RT.d = base.d; RT.a.assign((size_t)trainN * base.d, 0.0f);
+    for (int t = 0; t < trainN; ++t) {
+        int i = idx[t];
+        const float* x = base.row(i);
+        const float* cc = ivf.centroids.row(km.assign[i]);
+        for (int j = 0; j < base.d; ++j) RT.a[(size_t)t * base.d + j] = x[j] - cc[j];
+    }
 
-        KMeansResult rsub = kmeans_train(RS, psub);
-        ivf.pq.C[si] = std::move(rsub.centroids); // s x dsub
+    // 3) Optional OPQ rotation, then train codebooks per subspace (on the rotated residuals)
+    if (opq_iters > 0) {
+        ivf.opq = train_opq(RT, ivf.pq, opq_iters, seed, km_opts);
+        RT = opq_rotate_rows(ivf.opq, RT);
     }
+    train_codebooks(RT, ivf.pq, seed, 50, km_opts);
 
     // 4) Encoding & inverted lists
-    // For each point: find its coarse centroid c, residual r = x - c,
+    // For each point: find its coarse centroid c, residual r = x - c (rotated with OPQ),
     // then per subspace si find the nearest code h and write it.
+    std::vector<float> r((size_t)base.d), rr((size_t)base.d);
+    const float* y = ivf.opq.n > 0 ? rr.data() : r.data();
+    const size_t cs = ivf.pq.code_size();
     for (int i = 0; i < base.n; ++i) {
         int c = km.assign[i];
         ivf.ids[c].push_back(i);
         auto& codes_c = ivf.codes[c];
-        codes_c.reserve(codes_c.size() + (size_t)M);
-
-        // Residual subspace by subspace (we don't store the full residual in memory)
-        for (int si = 0; si < M; ++si) {
-            // r_i = x_i - c_i (subspace)
-            // find nearest h in codebook C[si]
-            // For efficiency, compute argmin "in-place"
-            int best = 0;
-            float bd = std::numeric_limits<float>::infinity();
-
-            for (int h = 0; h < s; ++h) {
-                float d = 0.0f;
-                const float* x = base.row(i) + si*dsub;
-                const float* cc = ivf.centroids.row(c) + si*dsub;
-                const float* ch = ivf.pq.C[si].row(h);
-                for (int j = 0; j < dsub; ++j) {
-                    float rj = (x[j] - cc[j]) - ch[j];
-                    d += rj * rj;
-                }
-                if (d < bd) { bd = d; best = h; }
-            }
-            codes_c.push_back((uint8_t)best);
-        }
+        codes_c.resize(codes_c.size() + cs, 0);
+        uint8_t* code = codes_c.data() + codes_c.size() - cs;
+
+        // residual r = x - c (one buffer reused for all points)
+        const float* x = base.row(i);
+        const float* cc = ivf.centroids.row(c);
+        for (int j = 0; j < base.d; ++j) r[j] = x[j] - cc[j];
+        if (ivf.opq.n > 0) opq_rotate(ivf.opq, r.data(), rr.data());
+
+        // per subspace: nearest h in codebook C[si], packed into nbits
+        for (int si = 0; si < M; ++si)
+            put_code(code, si, nbits, (uint32_t)nearest_code(subvec(y, si, dsub), ivf.pq.C[si]));
     }
+    for (auto& codes_c : ivf.codes) codes_c.resize(codes_c.size() + kPQCodePad, 0); // pq_code reads 4 bytes
+
+    // 5) ADC terms that depend only on (centroid, codeword); with OPQ the codewords live in the
+    //    rotated space, so the centroids are rotated too (||q - c||^2 itself is rotation invariant)
+    if (nbits <= 8)
+        ivf.coarse_terms = precompute_coarse_terms(ivf.opq.n > 0 ? opq_rotate_rows(ivf.opq, ivf.centroids)
+                                                                 : ivf.centroids, ivf.pq);
 
     return ivf;
 }
 
 // ---------- queries (ADC with LUTs) ----------
 
+// ADC distance of every code of list c, passed to emit(distance, id). The codes are read as
+// code_size() bytes per vector (M fields of nbits); NBITS > 0 fixes the width at compile time
+// (constant shifts and mask, a plain byte load for 8), NBITS = 0 takes it from the index.
+template <int NBITS, class Emit>
+static void scan_list_bits(const IVFIndexPQ& ivf, int c, float coarse_dist, const std::vector<float>& LUT, Emit emit) {
+    const int nbits = NBITS > 0 ? NBITS : ivf.pq.nbits;
+    const auto& ids_c   = ivf.ids[c];
+    const uint8_t* codes_c = ivf.codes[c].data();
+    const size_t stride = ivf.pq.code_size();
+    const int M = ivf.pq.M;
+    const size_t s = (size_t)ivf.pq.s;
+
+    for (size_t k = 0; k < ids_c.size(); ++k) {
+        const uint8_t* code = codes_c + k * stride;
+        float d = coarse_dist; // ||q - c||^2
+        for (int si = 0; si < M; ++si) d += LUT[(size_t)si * s + pq_code(code, si, nbits)];
+        emit(d, ids_c[k]);
+    }
+}
+
+template <class Emit>
+static void scan_list(const IVFIndexPQ& ivf, int c, float coarse_dist, const std::vector<float>& LUT, Emit emit) {
+    switch (ivf.pq.nbits) {
+        case 4:  scan_list_bits<4>(ivf, c, coarse_dist, LUT, emit); break;
+        case 6:  scan_list_bits<6>(ivf, c, coarse_dist, LUT, emit); break;
+        case 8:  scan_list_bits<8>(ivf, c, coarse_dist, LUT, emit); break;
+        default: scan_list_bits<0>(ivf, c, coarse_dist, LUT, emit); break;
+    }
+}
+
 TopNPQ ivf_pq_query_topN(const IVFIndexPQ& ivf,
-                         const Matrix& base,
-                         const float* q, int nprobe, int N)
+                         const Matrix& base, // read only when refine > 0
+                         const float* q, int nprobe, int N, int refine)
 {
     TopNPQ res;
     if (N <= 0 || ivf.centroids.n == 0) return res;
+    if (refine > 0 && base.d != ivf.centroids.d)
+        throw std::runtime_error("ivf_pq: refine needs the base vectors (d=" + std::to_string(ivf.centroids.d) +
+                                 "), got d=" + std::to_string(base.d));
 
     nprobe = std::max(1, std::min(nprobe, ivf.centroids.n));
-    std::vector<int> probes = top_nprobe_centroids(ivf.centroids, q, nprobe);
-
-    // We need a LUT per probed centroid (for the residual of q w.r.t. this centroid)
-    std::vector<float> LUT; LUT.reserve((size_t)ivf.pq.M * ivf.pq.s);
-
-    std::vector<std::pair<float,int>> cand;
-    for (int c : probes) {
-        // residual of q: rq = q - centroid[c]
-        // Build LUT for this residual
-        // (For optimization, you could compute rq once per subspace)
-        std::vector<float> rq((size_t)base.d, 0.0f);
-        const float* cc = ivf.centroids.row(c);
-        for (int j = 0; j < base.d; ++j) rq[j] = q[j] - cc[j];
-
-        build_LUT(ivf.pq, rq.data(), LUT);
-
-        // Read the codes of inverted list c: packed M bytes per vector
-        const auto& ids_c   = ivf.ids[c];
-        const auto& codes_c = ivf.codes[c];
-        const size_t stride = (size_t)ivf.pq.M;
-
-        for (size_t k = 0; k < ids_c.size(); ++k) {
-            const uint8_t* code = codes_c.data() + k * stride;
-            // ADC distance
-            float d = 0.0f;
-            for (int si = 0; si < ivf.pq.M; ++si) {
-                int h = (int)code[si];
-                d += LUT[(size_t)si * ivf.pq.s + h];
-            }
-            cand.emplace_back(d, ids_c[k]);
+    auto probes = top_nprobe_centroids(ivf.centroids, q, nprobe);
+
+    // the query-dependent table once; per list only the precomputed coarse terms are added
+    std::vector<float> LUTq, LUT;
+    build_query_terms(ivf, q, LUTq);
+
+    // only the N best ADC distances are ever kept (refine * N candidates when re-ranking), and never
+    // more than the probed lists hold: the heap reserves its capacity up front
+    long long probed = 0;
+    for (const auto& pc : probes) probed += (long long)ivf.ids[pc.second].size();
+    const long long want = refine > 0 ? (long long)refine * N : N;
+    TopNHeap<float> best((int)std::min(want, probed));
+    std::vector<uint8_t> LUT8;
+    for (const auto& pc : probes) {
+        const int c = pc.second;
+        list_LUT(ivf, c, LUTq, LUT);
+        if (ivf.fast_scan) {
+            fast_scan_list(ivf, c, pc.first, LUT, LUT8, [&] { return best.worst(); },
+                           [&](float d, int id) { best.push(d, id); });
+            continue;
         }
+        scan_list(ivf, c, pc.first, LUT, [&](float d, int id) { best.push(d, id); });
     }
 
-    if (cand.empty()) return res;
-
-    if ((int)cand.size() > N) {
-        std::nth_element(cand.begin(), cand.begin()+N, cand.end(),
-                         [](auto& A, auto& B){ return A.first < B.first; });
-        cand.resize(N);
+    if (refine > 0) {
+        // exact L2 on the original vectors of the ADC candidates; only these rows of base are read
+        TopNHeap<float> exact(N);
+        for (const auto& p : best.take_sorted()) exact.push(dist::l2_sq(q, base.row(p.second), base.d), p.second);
+        best = std::move(exact);
     }
-    std::sort(cand.begin(), cand.end(),
-              [](auto& A, auto& B){ return A.first < B.first; });
 
-    res.ids.reserve(cand.size());
-    res.dists.reserve(cand.size());
-    for (auto& p : cand) { res.ids.push_back(p.second); res.dists.push_back(std::sqrt(p.first)); }
+    res.ids.reserve(best.size());
+    res.dists.reserve(best.size());
+    for (auto& p : best.take_sorted()) { res.ids.push_back(p.second); res.dists.push_back(std::sqrt(p.first)); }
     return res;
 }
 
-std::vector<int> ivf_pq_query_range(const IVFIndexPQ& ivf,
-                                    const Matrix& base,
-                                    const float* q, int nprobe, float R)
+std::vector<int> ivf_pq_query_range(const IVFIndexPQ& ivf, const float* q, int nprobe, float R)
 {
     std::vector<int> out;
     if (ivf.centroids.n == 0) return out;
 
     nprobe = std::max(1, std::min(nprobe, ivf.centroids.n));
-    std::vector<int> probes = top_nprobe_centroids(ivf.centroids, q, nprobe);
+    auto probes = top_nprobe_centroids(ivf.centroids, q, nprobe);
 
-    std::vector<float> LUT; LUT.reserve((size_t)ivf.pq.M * ivf.pq.s);
+    std::vector<float> LUTq, LUT;
+    build_query_terms(ivf, q, LUTq);
     const float R2 = R * R;
 
-    for (int c : probes) {
-        std::vector<float> rq((size_t)base.d, 0.0f);
-        const float* cc = ivf.centroids.row(c);
-        for (int j = 0; j < base.d; ++j) rq[j] = q[j] - cc[j];
+    std::vector<uint8_t> LUT8;
+    for (const auto& pc : probes) {
+        const int c = pc.second;
+        list_LUT(ivf, c, LUTq, LUT);
+        if (ivf.fast_scan) {
+            fast_scan_list(ivf, c, pc.first, LUT, LUT8, [&] { return R2; },
+                           [&](float d, int id) { if (d <= R2) out.push_back(id); });
+            continue;
+        }
+        scan_list(ivf, c, pc.first, LUT, [&](float d, int id) { if (d <= R2) out.push_back(id); });
+    }
+    return out;
+}
 
-        build_LUT(ivf.pq, rq.data(), LUT);
+// ---------- save / load ----------
+
+static const char kIVFPQMagic[9] = "IVFPQ\0\0\0";
+static const uint32_t kIVFPQVersion = 5; // v2: precomputed coarse_terms, v3: fast-scan layout, v4: OPQ rotation,
+                                         // v5: bit-packed codes
+
+void save_ivf_pq(const std::string& path, const IVFIndexPQ& ivf, int n, int d) {
+    BinWriter w(path);
+    w.header(kIVFPQMagic, kIVFPQVersion);
+    w.pod<int32_t>(n);
+    w.pod<int32_t>(d);
+    w.matrix(ivf.centroids);
+    w.pod<int32_t>(ivf.pq.M);
+    w.pod<int32_t>(ivf.pq.nbits);
+    w.pod<int32_t>(ivf.pq.s);
+    w.pod<int32_t>(ivf.pq.dsub);
+    for (const Matrix& Ci : ivf.pq.C) w.matrix(Ci);
+    w.matrix(ivf.coarse_terms);
+    w.matrix(ivf.opq); // 0 x 0 without OPQ
+    w.pod<int32_t>(ivf.fast_scan ? 1 : 0);
+    w.pod<uint32_t>((uint32_t)ivf.ids.size());
+    for (size_t c = 0; c < ivf.ids.size(); ++c) {
+        w.vec(ivf.ids[c]);
+        w.vec(ivf.fast_scan ? ivf.codes4[c] : ivf.codes[c]);
+    }
+    w.close();
+}
 
-        const auto& ids_c   = ivf.ids[c];
-        const auto& codes_c = ivf.codes[c];
-        const size_t stride = (size_t)ivf.pq.M;
+IVFIndexPQ load_ivf_pq(const std::string& path, int n, int d) {
+    BinReader r(path);
+    r.header(kIVFPQMagic, kIVFPQVersion, "IVFPQ");
+    const int fn = r.pod<int32_t>(), fd = r.pod<int32_t>();
+    if (fn != n || fd != d)
+        throw std::runtime_error("ivf_pq: index " + path + " was built for n=" + std::to_string(fn) +
+                                 " d=" + std::to_string(fd) + ", base has n=" + std::to_string(n) +
+                                 " d=" + std::to_string(d));
 
-        for (size_t k = 0; k < ids_c.size(); ++k) {
-            const uint8_t* code = codes_c.data() + k * stride;
-            float d = 0.0f;
-            for (int si = 0; si < ivf.pq.M; ++si) {
-                int h = (int)code[si];
-                d += LUT[(size_t)si * ivf.pq.s + h];
-            }
-            if (d <= R2) out.push_back(ids_c[k]);
-        }
+    IVFIndexPQ ivf;
+    ivf.centroids = r.matrix<float>();
+    ivf.pq.M = r.pod<int32_t>();
+    ivf.pq.nbits = r.pod<int32_t>();
+    ivf.pq.s = r.pod<int32_t>();
+    ivf.pq.dsub = r.pod<int32_t>();
+    if (ivf.pq.M <= 0 || ivf.pq.M * ivf.pq.dsub != d || ivf.pq.nbits <= 0 || ivf.pq.nbits > 16 ||
+        ivf.pq.s != (1 << ivf.pq.nbits))
+        throw std::runtime_error("ivf_pq: inconsistent PQ parameters in " + path);
+    ivf.pq.C.resize(ivf.pq.M);
+    for (Matrix& Ci : ivf.pq.C) {
+        Ci = r.matrix<float>();
+        if (Ci.n != ivf.pq.s || Ci.d != ivf.pq.dsub) throw std::runtime_error("ivf_pq: inconsistent codebook in " + path);
     }
-    return out;
+    ivf.coarse_terms = r.matrix<float>();
+    const bool has_terms = ivf.pq.nbits <= 8; // see IVFIndexPQ::coarse_terms
+    if (ivf.coarse_terms.n != (has_terms ? ivf.centroids.n : 0) || ivf.coarse_terms.d != (has_terms ? ivf.pq.M * ivf.pq.s : 0))
+        throw std::runtime_error("ivf_pq: inconsistent precomputed tables in " + path);
+    ivf.opq = r.matrix<float>();
+    if (ivf.opq.n != 0 && (ivf.opq.n != d || ivf.opq.d != d))
+        throw std::runtime_error("ivf_pq: inconsistent OPQ rotation in " + path);
+
+    ivf.fast_scan = r.pod<int32_t>() != 0;
+    if (ivf.fast_scan && ivf.pq.nbits != 4) throw std::runtime_error("ivf_pq: inconsistent index file " + path);
+    const uint32_t k = r.pod<uint32_t>();
+    if ((int)k != ivf.centroids.n) throw std::runtime_error("ivf_pq: inconsistent index file " + path);
+    ivf.ids.resize(k);
+    ivf.codes.resize(k);
+    if (ivf.fast_scan) ivf.codes4.resize(k);
+    for (uint32_t c = 0; c < k; ++c) {
+        ivf.ids[c] = r.vec<int>();
+        for (int id : ivf.ids[c])
+            if ((unsigned)id >= (unsigned)fn) throw std::runtime_error("ivf_pq: inconsistent index file " + path);
+        const size_t n = ivf.ids[c].size();
+        auto& codes = ivf.fast_scan ? ivf.codes4[c] : ivf.codes[c];
+        codes = r.vec<uint8_t>();
+        const size_t expect = ivf.fast_scan ? (n + kFSBlock - 1) / kFSBlock * 16 * (size_t)ivf.pq.M
+                                            : n * ivf.pq.code_size() + kPQCodePad;
+        if (codes.size() != expect) throw std::runtime_error("ivf_pq: inconsistent index file " + path);
+    }
+    return ivf;
 }
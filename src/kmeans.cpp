@@ -1,29 +1,46 @@
 #include "../include/kmeans.hpp"
+#include "../include/distance.hpp"
+#include "../include/parallel.hpp"
 #include <algorithm>
 #include <numeric>
 #include <cmath>
 
 // ---------- small helpers ----------
 
-static inline float l2_sq(const float* a, const float* b, int d) {
-    float s = 0.0f;
-    for (int i = 0; i < d; ++i) {
-        float v = a[i] - b[i];
-        s += v * v;
-    }
-    return s;
-}
+// The helpers are templates over the element type of X (float, or uint8 for MNIST);
+// centroids are always float and dist::l2_sq picks the matching kernel.
+//
+// Parallel phases only ever split work that is independent per point (distances,
+// assignments) or per centroid (sums); every reduction runs in a fixed order, so the
+// result is bit-identical for any thread count.
 
-static inline int argmin_dist2(const Matrix& C, const float* x) {
+static const int kPointGrain = 256; // points per parallel_for chunk
+
+template <class T>
+static inline int argmin_dist2(const Matrix& C, const T* x, float* best_d2 = nullptr) {
     int best = 0;
     float bd = std::numeric_limits<float>::infinity();
     for (int j = 0; j < C.n; ++j) {
-        float dj = l2_sq(C.row(j), x, C.d);
+        float dj = dist::l2_sq(x, C.row(j), C.d);
         if (dj < bd) { bd = dj; best = j; }
     }
+    if (best_d2) *best_d2 = bd;
     return best;
 }
 
+// Nearest and second-nearest centroid of x (squared distances); ties go to the lower index,
+// exactly as in argmin_dist2 / the Lloyd loop.
+template <class T>
+static inline void two_nearest(const Matrix& C, const T* x, int& best, float& d1, float& d2) {
+    best = 0;
+    d1 = d2 = std::numeric_limits<float>::infinity();
+    for (int j = 0; j < C.n; ++j) {
+        float dj = dist::l2_sq(x, C.row(j), C.d);
+        if (dj < d1) { d2 = d1; d1 = dj; best = j; }
+        else if (dj < d2) d2 = dj;
+    }
+}
+
 // Choose m distinct indices from [0..n-1] (without replacement).
 static std::vector<int> choose_subset(int n, int m, std::mt19937& rng) {
     if (m >= n) {
@@ -38,7 +55,9 @@ static std::vector<int> choose_subset(int n, int m, std::mt19937& rng) {
 
 // k-means++ on a *training subset* X_sub (specified by indices train_idx into X).
 // Returns centroids matrix (k x d).
-static Matrix init_kmeanspp(const Matrix& X, const std::vector<int>& train_idx, int k, int seed) {
+template <class T>
+static Matrix init_kmeanspp(const DenseMatrix<T>& X, const std::vector<int>& train_idx, int k, int seed,
+                            int threads) {
     const int d = X.d;
     if (k <= 0) throw std::runtime_error("kmeans: k must be > 0");
     if ((int)train_idx.size() < k) throw std::runtime_error("kmeans++: subset smaller than k");
@@ -58,13 +77,13 @@ static Matrix init_kmeanspp(const Matrix& X, const std::vector<int>& train_idx,
     // 2..k) iterative sampling proportional to squared distance to nearest chosen center
     std::uniform_real_distribution<float> ur;
     for (int c = 1; c < k; ++c) {
-        // update D2
-        for (size_t i = 0; i < train_idx.size(); ++i) {
-            const float* xi = X.row(train_idx[i]);
-            float dist2 = l2_sq(xi, C.row(c - 1), d);
+        // update D2 (independent per point)
+        parallel_for(0, (int)train_idx.size(), threads, [&](int i) {
+            const T* xi = X.row(train_idx[i]);
+            float dist2 = dist::l2_sq(xi, C.row(c - 1), d);
             if (dist2 < D2[i]) D2[i] = dist2;
-        }
-        // prefix sums
+        }, kPointGrain);
+        // prefix sums (serial: fixed summation order)
         double total = 0.0;
         for (float v : D2) total += (double)v;
         if (total <= 0.0) {
@@ -88,7 +107,8 @@ static Matrix init_kmeanspp(const Matrix& X, const std::vector<int>& train_idx,
 }
 
 // Random uniform initialization (fallback)
-static Matrix init_random(const Matrix& X, const std::vector<int>& train_idx, int k, int seed) {
+template <class T>
+static Matrix init_random(const DenseMatrix<T>& X, const std::vector<int>& train_idx, int k, int seed) {
     const int d = X.d;
     if ((int)train_idx.size() < k) throw std::runtime_error("kmeans: subset smaller than k");
     std::mt19937 rng(seed);
@@ -102,18 +122,19 @@ static Matrix init_random(const Matrix& X, const std::vector<int>& train_idx, in
 }
 
 // Handle empty clusters by re-seeding to the point with largest current error (farthest from its centroid).
-static void reseed_empties(Matrix& C, const Matrix& X, const std::vector<int>& train_idx,
+template <class T>
+static void reseed_empties(Matrix& C, const DenseMatrix<T>& X, const std::vector<int>& train_idx,
                            const std::vector<int>& assign_train,
-                           std::vector<int>& counts) {
+                           std::vector<int>& counts, int threads) {
     const int k = C.n, d = C.d;
     // compute per-point distance to assigned centroid
+    std::vector<float> err(train_idx.size());
+    parallel_for(0, (int)train_idx.size(), threads, [&](int t) {
+        err[t] = dist::l2_sq(X.row(train_idx[t]), C.row(assign_train[t]), d);
+    }, kPointGrain);
     int worst_i = -1; float worst_d2 = -1.0f;
-    for (size_t t = 0; t < train_idx.size(); ++t) {
-        int idx = train_idx[t];
-        int c = assign_train[(int)t];
-        float dist2 = l2_sq(X.row(idx), C.row(c), d);
-        if (dist2 > worst_d2) { worst_d2 = dist2; worst_i = idx; }
-    }
+    for (size_t t = 0; t < train_idx.size(); ++t)
+        if (err[t] > worst_d2) { worst_d2 = err[t]; worst_i = train_idx[t]; }
     for (int c = 0; c < k; ++c) {
         if (counts[c] == 0) {
             // re-seed to worst point
@@ -123,14 +144,101 @@ static void reseed_empties(Matrix& C, const Matrix& X, const std::vector<int>& t
     }
 }
 
+// ---------- mini-batch ----------
+
+static const int kSseBlock = 1 << 16; // points per block of the final pass (bounds the distance buffer)
+
+template <class T>
+static KMeansResult kmeans_minibatch_impl(const DenseMatrix<T>& X, const KMeansParams& p, int threads) {
+    const int d = X.d, k = p.k;
+    std::mt19937 rng(p.seed);
+
+    // Pool the batches are drawn from: a subset if asked, otherwise all of X (no index array)
+    std::vector<int> pool;
+    if (p.train_subset > 0 && p.train_subset < X.n) pool = choose_subset(X.n, p.train_subset, rng);
+    const int npool = pool.empty() ? X.n : (int)pool.size();
+    if (npool < k) throw std::runtime_error("kmeans: subset smaller than k");
+    std::uniform_int_distribution<int> pick(0, npool - 1);
+    auto draw = [&]() { const int r = pick(rng); return pool.empty() ? r : pool[r]; };
+
+    // Initialize on a sample (with replacement) of a few points per centroid
+    std::vector<int> init_idx((size_t)std::min(npool, std::max(p.batch_size, 16 * k)));
+    for (int& i : init_idx) i = draw();
+    Matrix C = p.use_kmeanspp ? init_kmeanspp(X, init_idx, k, p.seed, threads)
+                              : init_random(X, init_idx, k, p.seed);
+
+    const int b = p.batch_size;
+    std::vector<int>    batch(b), assign_b(b), members(b), first(k + 1), counts(k);
+    std::vector<double> seen(k, 0.0);      // points absorbed by each centroid (learning rate 1/seen)
+    std::vector<float>  shift(k);
+
+    int step = 0;
+    for (; step < p.batch_iters; ++step) {
+        for (int& i : batch) i = draw();
+
+        parallel_for(0, b, threads, [&](int t) {
+            assign_b[t] = argmin_dist2(C, X.row(batch[t]));
+        }, kPointGrain);
+
+        // Group the batch by centroid (counting sort, keeps batch order inside a centroid)
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int t = 0; t < b; ++t) counts[assign_b[t]] += 1;
+        first[0] = 0;
+        for (int c = 0; c < k; ++c) first[c + 1] = first[c] + counts[c];
+        {
+            std::vector<int> fill(first.begin(), first.end() - 1);
+            for (int t = 0; t < b; ++t) members[fill[assign_b[t]]++] = t;
+        }
+
+        // Gradient steps: each centroid is owned by one task and takes its points in batch
+        // order, so the result does not depend on the thread count
+        parallel_for(0, k, threads, [&](int c) {
+            if (first[c] == first[c + 1]) { shift[c] = 0.0f; return; }
+            float* crow = C.row(c);
+            thread_local std::vector<float> old;
+            old.assign(crow, crow + d);
+            for (int m = first[c]; m < first[c + 1]; ++m) {
+                const T* xi = X.row(batch[members[m]]);
+                seen[c] += 1.0;
+                const float eta = (float)(1.0 / seen[c]);
+                for (int j = 0; j < d; ++j) crow[j] += eta * ((float)xi[j] - crow[j]);
+            }
+            shift[c] = dist::l2_sq(old.data(), crow, d);
+        });
+
+        const float max_shift = *std::max_element(shift.begin(), shift.end());
+        if (std::sqrt(max_shift) < p.tol) break;
+    }
+
+    // Final assignment for the FULL dataset; SSE summed block by block in point order
+    KMeansResult R;
+    R.assign.resize(X.n);
+    std::vector<float> d2((size_t)std::min(X.n, kSseBlock));
+    double sse = 0.0;
+    for (int lo = 0; lo < X.n; lo += kSseBlock) {
+        const int hi = std::min(X.n, lo + kSseBlock);
+        parallel_for(lo, hi, threads, [&](int i) {
+            R.assign[i] = argmin_dist2(C, X.row(i), &d2[i - lo]);
+        }, kPointGrain);
+        for (int i = 0; i < hi - lo; ++i) sse += d2[i];
+    }
+    R.centroids = std::move(C);
+    R.final_sse = (float)sse;
+    R.iters     = std::min(step + 1, p.batch_iters);
+    return R;
+}
+
 // ---------- main API ----------
 
-KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p) {
+template <class T>
+static KMeansResult kmeans_train_impl(const DenseMatrix<T>& X, const KMeansParams& p) {
     if (X.n <= 0 || X.d <= 0) throw std::runtime_error("kmeans: empty dataset");
     if (p.k <= 0) throw std::runtime_error("kmeans: k must be > 0");
     if (p.k > X.n) throw std::runtime_error("kmeans: k cannot exceed number of points");
 
     const int d = X.d;
+    const int threads = p.threads > 0 ? p.threads : hardware_threads();
+    if (p.batch_size > 0) return kmeans_minibatch_impl(X, p, threads);
     std::mt19937 rng(p.seed);
 
     // Build training subset indices
@@ -143,44 +251,121 @@ KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p) {
     }
 
     // Initialize centroids
-    Matrix C = p.use_kmeanspp ? init_kmeanspp(X, train_idx, p.k, p.seed)
+    Matrix C = p.use_kmeanspp ? init_kmeanspp(X, train_idx, p.k, p.seed, threads)
                               : init_random(X, train_idx, p.k, p.seed);
 
     // Buffers for training loop (on subset)
-    std::vector<int>    assign_train(train_idx.size(), -1);
+    const int ntrain = (int)train_idx.size();
+    std::vector<int>    assign_train(ntrain, -1);
+    std::vector<float>  best_d2(ntrain);            // distance of each point to its centroid
     std::vector<float>  sums((size_t)p.k * d, 0.0f);
     std::vector<int>    counts(p.k, 0);
+    std::vector<int>    first(p.k + 1), members(ntrain); // training points grouped by cluster
+
+    // Hamerly state (Euclidean, not squared): upper bound to the own centroid, lower bound to
+    // the second closest, last movement of every centroid, half distance to its nearest other one.
+    // A bound only prunes when it wins by a relative margin of kSlack, so float rounding can never
+    // hide a change that Lloyd's exact comparison would make.
+    const bool hamerly = p.algo == KMeansAlgo::Hamerly;
+    const double kSlack = 1.0 + 1e-4;
+    std::vector<double> upper, lower, move, half_sep;
+    double move1 = 0.0, move2 = 0.0; // largest and second largest movement
+    int move_arg = -1;               // centroid that moved the most
+    Matrix C_prev;                   // centroids of the last assignment step
+    if (hamerly) {
+        upper.resize(ntrain); lower.resize(ntrain);
+        move.assign(p.k, 0.0); half_sep.resize(p.k);
+    }
+
+    // One Hamerly assignment step against C, given the movements since the previous one
+    auto hamerly_step = [&]() {
+        parallel_for(0, p.k, threads, [&](int c) {
+            double m = std::numeric_limits<double>::infinity();
+            for (int o = 0; o < p.k; ++o)
+                if (o != c) m = std::min(m, (double)dist::l2_sq(C.row(c), C.row(o), d));
+            half_sep[c] = 0.5 * std::sqrt(m);
+        });
+        parallel_for(0, ntrain, threads, [&](int t) {
+            const T* xi = X.row(train_idx[t]);
+            const int a = assign_train[t];
+            double u = upper[t] + move[a];
+            const double l = lower[t] - (a == move_arg ? move2 : move1);
+            const double m = std::max(half_sep[a], l);
+            lower[t] = l;
+            if (u * kSlack < m) { upper[t] = u; return; }
+
+            u = std::sqrt((double)dist::l2_sq(xi, C.row(a), d)); // tighten the upper bound
+            upper[t] = u;
+            if (u * kSlack < m) return;
+
+            float d1, d2;
+            two_nearest(C, xi, assign_train[t], d1, d2);
+            upper[t] = std::sqrt((double)d1);
+            lower[t] = std::sqrt((double)d2);
+        }, kPointGrain);
+    };
 
     float prev_shift = std::numeric_limits<float>::infinity();
     int it = 0;
     float final_sse = 0.0f;
 
     for (; it < p.max_iters; ++it) {
-        std::fill(sums.begin(), sums.end(), 0.0f);
-        std::fill(counts.begin(), counts.end(), 0);
+        // Assignment (on subset): independent per point
+        if (!hamerly) {
+            parallel_for(0, ntrain, threads, [&](int t) {
+                const T* xi = X.row(train_idx[t]);
+
+                // nearest centroid
+                int best = 0;
+                float bd = std::numeric_limits<float>::infinity();
+                for (int c = 0; c < C.n; ++c) {
+                    float dc = dist::l2_sq(xi, C.row(c), d);
+                    if (dc < bd) { bd = dc; best = c; }
+                }
+                assign_train[t] = best;
+                best_d2[t] = bd;
+            }, kPointGrain);
+        } else if (it == 0) {
+            // first pass: full scan, which also seeds the bounds
+            parallel_for(0, ntrain, threads, [&](int t) {
+                float d1, d2;
+                two_nearest(C, X.row(train_idx[t]), assign_train[t], d1, d2);
+                upper[t] = std::sqrt((double)d1);
+                lower[t] = std::sqrt((double)d2);
+            }, kPointGrain);
+        } else {
+            hamerly_step();
+        }
 
-        // Assignment (on subset)
+        if (hamerly) {
+            // pruned points have no exact distance; the SSE is computed once after the loop
+            C_prev = C;
+        }
         final_sse = 0.0f;
-        for (size_t t = 0; t < train_idx.size(); ++t) {
-            int idx = train_idx[t];
-            const float* xi = X.row(idx);
-
-            // nearest centroid
-            int best = 0;
-            float bd = std::numeric_limits<float>::infinity();
-            for (int c = 0; c < C.n; ++c) {
-                float dc = l2_sq(xi, C.row(c), d);
-                if (dc < bd) { bd = dc; best = c; }
-            }
-            assign_train[(int)t] = best;
-            final_sse += bd;
+        if (!hamerly)
+            for (int t = 0; t < ntrain; ++t) final_sse += best_d2[t];
 
-            // accumulate
-            float* srow = sums.data() + (size_t)best * d;
-            for (int j = 0; j < d; ++j) srow[j] += xi[j];
-            counts[best] += 1;
+        // Group the points by cluster (counting sort, keeps training order inside a cluster)
+        std::fill(counts.begin(), counts.end(), 0);
+        for (int t = 0; t < ntrain; ++t) counts[assign_train[t]] += 1;
+        first[0] = 0;
+        for (int c = 0; c < p.k; ++c) first[c + 1] = first[c] + counts[c];
+        {
+            std::vector<int> fill(first.begin(), first.end() - 1);
+            for (int t = 0; t < ntrain; ++t) members[fill[assign_train[t]]++] = t;
         }
 
+        // Accumulate: each cluster's sum is owned by one task and added in training
+        // order: no thread-local copies, and the sums are identical to a serial pass
+        parallel_for(0, p.k, threads, [&](int c) {
+            float* srow = sums.data() + (size_t)c * d;
+            std::fill(srow, srow + d, 0.0f);
+            for (int m = first[c]; m < first[c + 1]; ++m) {
+                const T* xi = X.row(train_idx[members[m]]);
+                for (int j = 0; j < d; ++j) srow[j] += xi[j];
+            }
+        });
+
         // Update centroids, measure shift
         float max_shift = 0.0f;
         for (int c = 0; c < C.n; ++c) {
@@ -202,8 +387,20 @@ KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p) {
         // Re-seed empty clusters (if any)
         bool has_empty = false;
         for (int c = 0; c < C.n; ++c) if (counts[c] == 0) { has_empty = true; break; }
+        if (has_empty) reseed_empties(C, X, train_idx, assign_train, counts, threads);
+
+        if (hamerly) {
+            // how far each centroid moved (including re-seeded ones), to loosen the bounds
+            move1 = move2 = 0.0;
+            move_arg = -1;
+            for (int c = 0; c < p.k; ++c) {
+                move[c] = std::sqrt((double)dist::l2_sq(C_prev.row(c), C.row(c), d));
+                if (move[c] > move1) { move2 = move1; move1 = move[c]; move_arg = c; }
+                else if (move[c] > move2) move2 = move[c];
+            }
+        }
+
         if (has_empty) {
-            reseed_empties(C, X, train_idx, assign_train, counts);
             // No early stop this round; continue to refine
             prev_shift = max_shift;
             continue;
@@ -214,14 +411,40 @@ KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p) {
         prev_shift = max_shift;
     }
 
+    // Hamerly: SSE of the last assignment step, as Lloyd reports it
+    if (hamerly && C_prev.n > 0) {
+        parallel_for(0, ntrain, threads, [&](int t) {
+            best_d2[t] = dist::l2_sq(X.row(train_idx[t]), C_prev.row(assign_train[t]), d);
+        }, kPointGrain);
+        final_sse = 0.0f;
+        for (int t = 0; t < ntrain; ++t) final_sse += best_d2[t];
+    }
+
     // Final assignment for the FULL dataset
     KMeansResult R;
-    R.centroids = std::move(C);
     R.assign.resize(X.n);
-    for (int i = 0; i < X.n; ++i) {
-        R.assign[i] = argmin_dist2(R.centroids, X.row(i));
+    if (hamerly && C_prev.n > 0) {
+        // training points: one more bounded step against the final centroids;
+        // the rest (when training used a subset) by a full scan
+        hamerly_step();
+        std::vector<char> trained(X.n, 0);
+        for (int t = 0; t < ntrain; ++t) {
+            R.assign[train_idx[t]] = assign_train[t];
+            trained[train_idx[t]] = 1;
+        }
+        parallel_for(0, X.n, threads, [&](int i) {
+            if (!trained[i]) R.assign[i] = argmin_dist2(C, X.row(i));
+        }, kPointGrain);
+    } else {
+        parallel_for(0, X.n, threads, [&](int i) {
+            R.assign[i] = argmin_dist2(C, X.row(i));
+        }, kPointGrain);
     }
+    R.centroids = std::move(C);
     R.final_sse = final_sse;
     R.iters     = it + 1;
     return R;
 }
+
+KMeansResult kmeans_train(const Matrix& X, const KMeansParams& p)   { return kmeans_train_impl(X, p); }
+KMeansResult kmeans_train(const MatrixU8& X, const KMeansParams& p) { return kmeans_train_impl(X, p); }
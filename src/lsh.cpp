@@ -5,27 +5,12 @@
 #include <unordered_set>
 
 #include "../include/lsh.h"
+#include "../include/topn.hpp"
 
 namespace lsh {
 
-    /*----------H Function--------*/
-    HFunction::HFunction(int dim, double w) : v(dim), w_bucket(w) {
-        for(int i = 0; i < dim; ++i)
-            v[i] = static_cast<float>(vutils::normalRand()); //Gaussian N(0,1) --maybe cahnge <float> to <double> ??
-        t_off = vutils::uniformRand(0.0, w_bucket); //uniform in [0,w)
-    }
-
-    int HFunction::hash(const std::vector<float>& p) const {
-        double projection = vutils::dotProduct(v, p); //v*p
-        return static_cast<int>(std::floor((projection + t_off) / w_bucket));
-    }
-
     /*----------G Function--------*/
-    GFunction::GFunction(int dim, double w, int k, int tableSize) : hFunctions{}, rand_coeffs(k), table_size(tableSize), M(4294967291ULL) { //ULL sufix for unsigned long long
-        hFunctions.reserve(k); //reserve space for k HFunctions
-        for(int i = 0; i < k; ++i)
-            hFunctions.emplace_back(dim, w); //creating HFunction and addin it to the vector
-        
+    GFunction::GFunction(int k, int tableSize) : rand_coeffs(k), table_size(tableSize), M(4294967291ULL) { //ULL sufix for unsigned long long
         std::mt19937 rng(42);
         std::uniform_int_distribution<int> dist(1, 1000000000);
 
@@ -33,18 +18,65 @@ namespace lsh {
             rand_coeffs[i] = dist(rng); //random coeffefficients for combining h's into g
     }
 
-    int GFunction::computeHashValue(const std::vector<float>& p, unsigned int& id) const {
+    int GFunction::computeHashValue(const int* h, unsigned int& id) const {
         long long sum = 0;
-        for(size_t i = 0; i < hFunctions.size(); ++i){
-            int hi = hFunctions[i].hash(p); //compute h_i(p)
-            sum += (static_cast<long long>(rand_coeffs[i]) * hi) % M; 
-        }
+        for(size_t i = 0; i < rand_coeffs.size(); ++i)
+            sum += (static_cast<long long>(rand_coeffs[i]) * h[i]) % M; //h[i] = h_i(p)
 
         sum = ((sum % M) + M) % M; //ensure non-negative
         id = static_cast<unsigned int>(sum);
         return static_cast<int>(id % static_cast<unsigned int>(table_size)); 
     }
 
+    void GFunction::write(BinWriter& w) const {
+        w.vec(rand_coeffs);
+        w.pod(table_size);
+        w.pod(M);
+    }
+
+    void GFunction::read(BinReader& r) {
+        rand_coeffs = r.vec<int>();
+        table_size = r.pod<int>();
+        M = r.pod<uint64_t>();
+    }
+
+    //table_size may be -1 (g created before the automatic table size, see LSH::bucketOf), never 0
+    bool GFunction::consistent(int k) const {
+        return static_cast<int>(rand_coeffs.size()) == k && table_size != 0 && M != 0;
+    }
+
+    /*----------Bucket table-------*/
+
+    void BucketTable::build(const std::vector<int>& bucket, const std::vector<unsigned>& id, int table_size, int threads) {
+        const size_t n = bucket.size();
+        keys.clear();
+        if(static_cast<size_t>(table_size) <= 4 * n + 1024){
+            //dense: count per bucket, prefix sums, scatter
+            std::vector<unsigned> order;
+            counting_sort_by_key(bucket.data(), n, static_cast<size_t>(table_size), threads, offsets, order);
+            entries.resize(n);
+            parallel_for(0, static_cast<int>(n), threads <= 0 ? hardware_threads() : threads,
+                         [&](int j){ entries[j] = Entry{order[j], id[order[j]]}; }, 1 << 14);
+            return;
+        }
+
+        //sparse: sort the point indices by bucket (stable, so index order inside a bucket)
+        std::vector<unsigned> order(n);
+        for(size_t i = 0; i < n; ++i) order[i] = static_cast<unsigned>(i);
+        std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b){ return bucket[a] < bucket[b]; });
+        offsets.clear();
+        entries.resize(n);
+        for(size_t j = 0; j < n; ++j){
+            const unsigned i = order[j];
+            if(keys.empty() || keys.back() != bucket[i]){
+                keys.push_back(bucket[i]);
+                offsets.push_back(static_cast<uint32_t>(j));
+            }
+            entries[j] = Entry{i, id[i]};
+        }
+        offsets.push_back(static_cast<uint32_t>(n));
+    }
+
     /*----------LSH-------*/
 
     LSH::LSH(int dim, int k, int L, double w, int tableSize, unsigned seed)
@@ -54,110 +86,339 @@ namespace lsh {
         tables_.reserve(L_Tables); //reserve space for L hash tables
         vutils::initRand(seed_); //initializing global random engine with seed
 
+        //h functions of all tables, drawn in table order: v ~ N(0,1)^d, then t ~ U(0,w)
+        proj_ = RandomProjections(L_Tables * k_H, dimension, w_size);
+        for(int r = 0; r < L_Tables * k_H; ++r){
+            float* v = proj_.row(r);
+            for(int c = 0; c < dimension; ++c)
+                v[c] = static_cast<float>(vutils::normalRand());
+            proj_.offset(r) = vutils::uniformRand(0.0, w_size);
+        }
+
         for(int i = 0; i < L_Tables; ++i)
-            g_F.emplace_back(dimension, w_size, k_H, table_size); //creating GFunction and adding it to the vector
+            g_F.emplace_back(k_H, table_size); //creating GFunction and adding it to the vector
+    }
+
+    //the g functions are created before buildIndex picks the automatic table size, so with
+    //tableSize = -1 they return the full ID; the bucket is taken here as ID mod table_size.
+    //every probe keeps only entries whose ID equals the query's, so the candidates are the same
+    //for any table size - it only decides how the IDs are spread over buckets.
+    int LSH::bucketOf(int j, const int* hj, unsigned& id) const {
+        g_F[j].computeHashValue(hj, id);
+        return static_cast<int>(id % static_cast<unsigned>(table_size));
     }
 
     void LSH::buildIndex(const std::vector<std::vector<float>>& dataset) {
-        this->dataset = dataset; //storing dataset
-        int n = static_cast<int>(dataset.size()); 
+        auto rows = std::make_shared<const Matrix>(matrix_from_rows(dataset)); //one contiguous copy the index keeps
+        buildIndex(matrix_view(*rows));
+        own_ = std::move(rows);
+    }
+
+    void LSH::buildIndex(const Matrix& base) {
+        if(base.n > 0 && base.d != dimension) throw std::runtime_error("LSH: base dimension mismatch");
+        own_.reset();
+        base_ = matrix_view(base); //referenced, not copied
+        int n = base_.n;
+        resetFallbackStats();
 
         //if table_size not set, use heuristic n/8 (>= 1)
         if(table_size <= 0)
             table_size = std::max(1, n / 8); //heuristic
 
-        //initializing hash tables
-        tables_.clear(); //clear any existing tables
-        tables_.reserve(L_Tables);
-        for(int i = 0; i < L_Tables; ++i){
-            tables_.emplace_back(); //creating empty hash table
-            tables_[i].reserve(table_size); 
+        //hashing blocks of vectors against all L*k projections at once, then laying each table out as CSR
+        const int kh = L_Tables * k_H;
+        const int block = 256;
+        std::vector<std::vector<int>> bucket(L_Tables, std::vector<int>(n));
+        std::vector<std::vector<unsigned>> id(L_Tables, std::vector<unsigned>(n));
+        const int threads = build_threads_ > 0 ? build_threads_ : hardware_threads();
+        parallel_for(0, (n + block - 1) / block, threads, [&](int blk){ //blocks of points are independent
+            thread_local std::vector<int> h;
+            h.resize(static_cast<size_t>(block) * kh);
+            const int start = blk * block;
+            const int nb = std::min(block, n - start);
+            proj_.hashBatch(base_.row(start), base_.row_stride(), nb, h.data()); //rows read in place
+            for(int b = 0; b < nb; ++b)
+                for(int j = 0; j < L_Tables; ++j) //compute g_j(p) to get bucket
+                    bucket[j][start + b] = bucketOf(j, h.data() + static_cast<size_t>(b) * kh + static_cast<size_t>(j) * k_H, id[j][start + b]);
+        });
+        tables_.assign(L_Tables, BucketTable());
+        for(int j = 0; j < L_Tables; ++j)
+            tables_[j].build(bucket[j], id[j], table_size, threads);
+
+        std::cout << "LSH Index Built: " << n << " Vectors, " << L_Tables << "Tables, Table Size = " << table_size
+                  << ", tables: " << tableMemoryBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+
+    }
+
+    //query-directed probing sequence (multi-probe LSH, Lv et al. 2007): the T perturbations
+    //delta in {-1,0,+1}^k of a table's h-values with the smallest score sum x_i(delta_i)^2, where
+    //x_i(-1) = pos_i and x_i(+1) = 1 - pos_i are the query's distances (in bucket widths) to the two
+    //boundaries of bucket h_i. Sets of boundaries are generated in score order with the
+    //shift / expand heap over the 2k distances sorted ascending; sets that move one h both ways
+    //are skipped. Each perturbation is returned as a list of (i, delta_i).
+    static void probeSequence(const double* pos, int k, int T, std::vector<std::vector<std::pair<int, int>>>& out) {
+        out.clear();
+        struct Boundary { double x; int i; int delta; };
+        std::vector<Boundary> z;
+        z.reserve(2 * k);
+        for(int i = 0; i < k; ++i){
+            z.push_back({pos[i], i, -1});
+            z.push_back({1.0 - pos[i], i, +1});
         }
+        std::sort(z.begin(), z.end(), [](const Boundary& a, const Boundary& b){
+            return a.x < b.x || (a.x == b.x && (a.i < b.i || (a.i == b.i && a.delta < b.delta)));
+        });
+        const int nz = static_cast<int>(z.size());
+
+        using Set = std::pair<double, std::vector<int>>; //(score, ascending positions in z)
+        auto worse = [](const Set& a, const Set& b){ return a.first > b.first || (a.first == b.first && a.second > b.second); };
+        std::vector<Set> heap;
+        if(nz > 0) heap.push_back({z[0].x * z[0].x, {0}});
+        std::vector<char> used(k);
+        while(static_cast<int>(out.size()) < T && !heap.empty()){
+            std::pop_heap(heap.begin(), heap.end(), worse);
+            Set a = std::move(heap.back());
+            heap.pop_back();
+            const int m = a.second.back();
+            if(m + 1 < nz){
+                const double zm = z[m].x * z[m].x, zn = z[m + 1].x * z[m + 1].x;
+                Set shifted = a; //replace the largest boundary by the next one
+                shifted.second.back() = m + 1;
+                shifted.first += zn - zm;
+                heap.push_back(std::move(shifted));
+                std::push_heap(heap.begin(), heap.end(), worse);
+                Set expanded = a; //add the next boundary
+                expanded.second.push_back(m + 1);
+                expanded.first += zn;
+                heap.push_back(std::move(expanded));
+                std::push_heap(heap.begin(), heap.end(), worse);
+            }
 
-        //inserting each vector into all L tables
-        for(size_t index = 0; index < dataset.size(); ++index){
-            for(int j = 0; j < L_Tables; ++j){
-                unsigned int id;
-                int bucket = g_F[j].computeHashValue(dataset[index], id); //compute g_j(p) to get bucket
-                tables_[j][bucket].emplace_back(index, id); //insert (index, ID) pair into the bucket
+            std::fill(used.begin(), used.end(), 0);
+            bool valid = true;
+            for(int p : a.second){
+                if(used[z[p].i]){ valid = false; break; }
+                used[z[p].i] = 1;
             }
+            if(!valid) continue;
+            std::vector<std::pair<int, int>> delta;
+            for(int p : a.second) delta.emplace_back(z[p].i, z[p].delta);
+            out.push_back(std::move(delta));
         }
+    }
 
-        std::cout << "LSH Index Built: " << n << " Vectors, " << L_Tables << "Tables, Table Size = " << table_size << std::endl;
+    void LSH::checkDim(const std::vector<float>& query) const {
+        if(static_cast<int>(query.size()) != dimension) throw std::runtime_error("LSH: query dimension mismatch");
+    }
 
+    void LSH::hashQuery(const float* query, std::vector<int>& h, std::vector<double>* pos) const {
+        h.resize(static_cast<size_t>(L_Tables) * k_H);
+        if(pos) pos->resize(h.size());
+        proj_.hash(query, h.data(), pos ? pos->data() : nullptr); //all L*k h-values in one pass over the query
+    }
+
+    void LSH::collectCandidates(const int* h, const double* pos, std::unordered_set<unsigned>& candidates,
+                                int probes, bool match_id, size_t budget) const {
+        //queuerying trick - only consider points with same ID (unless relaxed)
+        auto probe = [&](int i, const int* hi){
+            unsigned int query_id;
+            int bucket = bucketOf(i, hi, query_id); //geting bucket
+            const auto range = tables_[i].find(bucket); //lloking up the bucket in the current table
+            for(const auto* entry = range.first; entry != range.second && candidates.size() < budget; ++entry){
+                if(!match_id || entry->id == query_id)
+                    candidates.insert(entry->index); //adding index to candidates
+            }
+        };
+
+        std::vector<std::vector<std::pair<int, int>>> perturbations;
+        std::vector<int> hp(k_H);
+        for(int i = 0; i <L_Tables && candidates.size() < budget; ++i){
+            const int* hi = h + static_cast<size_t>(i) * k_H;
+            probe(i, hi);
+            if(probes == 0) continue;
+
+            //multi-probe: the buckets across the nearest boundaries, most likely first
+            probeSequence(pos + static_cast<size_t>(i) * k_H, k_H, probes, perturbations);
+            for(const auto& delta : perturbations){
+                std::copy(hi, hi + k_H, hp.begin());
+                for(const auto& d : delta) hp[d.first] += d.second;
+                probe(i, hp.data());
+            }
+        }
     }
 
     std::vector<std::pair<int, double>>
     LSH::searchKNN(const std::vector<float>& query, int N) const {
-        std::unordered_set<unsigned> candidates; //to avoid duplicates
+        checkDim(query);
+        return searchKNN(query.data(), N);
+    }
 
-        for(int i = 0; i <L_Tables; ++i){
-            unsigned int query_id;
-            int bucket = g_F[i].computeHashValue(query, query_id); //geting bucket
+    std::vector<int> LSH::searchRadius(const std::vector<float>& query, double R) const {
+        checkDim(query);
+        return searchRadius(query.data(), R);
+    }
 
-            auto bucket_it = tables_[i].find(bucket); //lloking up the bucket in the current table
-            if(bucket_it == tables_[i].end()) continue; //bucket not found, continue
+    std::vector<std::pair<int, double>>
+    LSH::searchKNN(const float* query, int N) const {
+        //the query is hashed once; the fallback stages reuse its h-values and boundary positions
+        std::vector<int> h;
+        std::vector<double> pos;
+        hashQuery(query, h, &pos);
 
-            //queuerying trick - only consider points with same ID
-            for(auto& entry: bucket_it -> second){
-                if(entry.second == query_id)
-                    candidates.insert(entry.first); //adding index to candidates
-            }
+        std::unordered_set<unsigned> candidates; //to avoid duplicates
+        const size_t none = std::numeric_limits<size_t>::max();
+        collectCandidates(h.data(), pos.data(), candidates, probes_, true, none);
+        n_queries_.fetch_add(1, std::memory_order_relaxed);
+
+        //too few candidates: bounded fallback stages instead of a scan of the whole dataset
+        const size_t want = static_cast<size_t>(std::max(N, 0));
+        const size_t budget = std::max(want, static_cast<size_t>(fallback_budget_));
+        const int wide = std::max(probes_, fallback_probes_);
+        if(candidates.size() < want){
+            n_widened_.fetch_add(1, std::memory_order_relaxed);
+            collectCandidates(h.data(), pos.data(), candidates, wide, true, budget);
         }
-
-        if(candidates.empty()){
-            for(size_t i = 0; i < dataset.size(); ++i)
-                candidates.insert(i); //if no candidates found, consider all dataset points
+        if(candidates.size() < want){ //bucket-mates with other IDs carry no locality: only fill up to N
+            n_relaxed_.fetch_add(1, std::memory_order_relaxed);
+            collectCandidates(h.data(), pos.data(), candidates, wide, false, want);
         }
+        if(candidates.size() < want)
+            n_short_.fetch_add(1, std::memory_order_relaxed);
+        n_scored_.fetch_add(candidates.size(), std::memory_order_relaxed);
+
+        //bounded top-N: O(N) memory, results come out sorted
+        TopNHeap<double> best(N);
+        for(auto index : candidates)
+            best.push(vutils::euclideanDistance(query, base_.row(static_cast<int>(index)), base_.d), static_cast<int>(index));
 
         std::vector<std::pair<int, double>> results; //to store (index, distance) pairs
-        results.reserve(candidates.size()); //reserve space
+        results.reserve(best.size());
+        for(const auto& p : best.take_sorted())
+            results.emplace_back(p.second, p.first);
 
-        for(auto index : candidates){
-            double dist = vutils::euclideanDistance(query, dataset[index]);
-            results.emplace_back(static_cast<int>(index), dist); //storing index and distance
-        }
+        return results;
+    }
 
-        if (static_cast<int>(results.size()) > N)
-        std::nth_element(results.begin(), results.begin() + N, results.end(),
-                         [](auto& a, auto& b){ return a.second < b.second; });
+    std::vector<int> LSH::searchRadius(const float* query, double R) const {
+        std::vector<int> h;
+        std::vector<double> pos;
+        hashQuery(query, h, probes_ > 0 ? &pos : nullptr);
 
-        std::sort(results.begin(), results.begin() + std::min(N, (int)results.size()),
-                [](auto& a, auto& b){ return a.second < b.second; });
+        std::unordered_set<unsigned> candidates; //to avoid duplicates
+        collectCandidates(h.data(), pos.data(), candidates, probes_, true, std::numeric_limits<size_t>::max());
 
-        if((int)results.size() > N)
-            results.resize(N);
+        std::vector<int> neighbours;
+        neighbours.reserve(candidates.size());
 
-        return results;
+        for(auto index : candidates){
+            double dist = vutils::euclideanDistance(query, base_.row(static_cast<int>(index)), base_.d);
+            if(dist <= R)
+                neighbours.push_back(static_cast<int>(index));  //storing index of neighbour within radius R
+        }
+
+        return neighbours;
     }
 
-    std::vector<int> LSH::searchRadius(const std::vector<float>& query, double R) const {
-        std::unordered_set<unsigned> candidates; //to avoid duplicates
+    /*----------Save / Load-------*/
+
+    static const char kLSHMagic[9] = "LSHIDX\0\0";
+    static const uint32_t kLSHVersion = 3; //v2: CSR tables, v3: one projection matrix
+
+    void LSH::saveIndex(const std::string& path) const {
+        BinWriter w(path);
+        w.header(kLSHMagic, kLSHVersion);
+        w.pod(static_cast<int32_t>(base_.n));
+        w.pod(dimension);
+        w.pod(k_H);
+        w.pod(L_Tables);
+        w.pod(w_size);
+        w.pod(table_size);
+        w.pod(seed_);
+        proj_.write(w);
+        for(const auto& g : g_F) g.write(w);
+
+        //each table: the CSR arrays as they are
+        for(const auto& table : tables_){
+            w.vec(table.keys);
+            w.vec(table.offsets);
+            w.vec(table.entries);
+        }
+        w.close();
+    }
 
-        for(int i = 0; i <L_Tables; ++i){
-            unsigned int query_id;
-            int bucket = g_F[i].computeHashValue(query, query_id); //geting bucket
+    void LSH::loadIndex(const std::string& path, const std::vector<std::vector<float>>& dataset) {
+        auto rows = std::make_shared<const Matrix>(matrix_from_rows(dataset));
+        loadIndex(path, matrix_view(*rows));
+        own_ = std::move(rows);
+    }
 
-            auto bucket_it = tables_[i].find(bucket); //lloking up the bucket in the current table
-            if(bucket_it == tables_[i].end()) continue; //bucket not found, continue
+    void LSH::loadIndex(const std::string& path, const Matrix& base) {
+        BinReader r(path);
+        r.header(kLSHMagic, kLSHVersion, "LSH");
+        const int n = r.pod<int32_t>();
+        dimension = r.pod<int>();
+        if(n != base.n || (base.n > 0 && base.d != dimension))
+            throw std::runtime_error("LSH index " + path + " was built for a different dataset");
+        k_H = r.pod<int>();
+        L_Tables = r.pod<int>();
+        w_size = r.pod<double>();
+        table_size = r.pod<int>();
+        seed_ = r.pod<unsigned>();
+
+        proj_.read(r);
+        if(proj_.count() != L_Tables * k_H || proj_.dim() != dimension)
+            throw std::runtime_error(path + ": corrupt LSH projection matrix");
+        g_F.assign(L_Tables, GFunction());
+        for(auto& g : g_F){
+            g.read(r);
+            //computeHashValue reads exactly k_H h-values per table and takes % M, % table_size
+            if(!g.consistent(k_H)) throw std::runtime_error(path + ": corrupt LSH g-function");
+        }
 
-            //queuerying trick - only consider points with same ID
-            for(auto& entry: bucket_it -> second){
-                if(entry.second == query_id)
-                    candidates.insert(entry.first); //adding index to candidates
+        tables_.assign(L_Tables, BucketTable());
+        for(auto& table : tables_){
+            table.keys = r.vec<int>();
+            table.offsets = r.vec<uint32_t>();
+            table.entries = r.vec<BucketTable::Entry>();
+            //no keys: dense offsets, or a sparse table with no points at all (offsets = {0})
+            const bool empty_sparse = table.keys.empty() && table.offsets.size() == 1;
+            const size_t buckets = empty_sparse ? 0 : table.keys.empty() ? static_cast<size_t>(table_size) : table.keys.size();
+            bool ok = table_size > 0 && table.offsets.size() == buckets + 1 && table.offsets.front() == 0 &&
+                      table.offsets.back() == table.entries.size();
+            for(size_t b = 0; ok && b < buckets; ++b) ok = table.offsets[b] <= table.offsets[b + 1];
+            //sparse keys: strictly increasing bucket numbers (find() binary-searches them)
+            for(size_t b = 0; ok && b < table.keys.size(); ++b)
+                ok = table.keys[b] >= 0 && table.keys[b] < table_size && (b == 0 || table.keys[b - 1] < table.keys[b]);
+            for(size_t e = 0; ok && e < table.entries.size(); ++e) ok = table.entries[e].index < static_cast<unsigned>(n);
+            if(!ok) throw std::runtime_error(path + ": corrupt LSH hash table");
         }
+        own_.reset();
+        base_ = matrix_view(base);
+        resetFallbackStats();
     }
 
-    std::vector<int> neighbours;
-    neighbours.reserve(candidates.size());
+    LSH::FallbackStats LSH::fallbackStats() const {
+        FallbackStats st;
+        st.queries = n_queries_.load(std::memory_order_relaxed);
+        st.widened = n_widened_.load(std::memory_order_relaxed);
+        st.relaxed = n_relaxed_.load(std::memory_order_relaxed);
+        st.short_results = n_short_.load(std::memory_order_relaxed);
+        st.scored = n_scored_.load(std::memory_order_relaxed);
+        return st;
+    }
 
-    for(auto index : candidates){
-        double dist = vutils::euclideanDistance(query, dataset[index]);
-        if(dist <= R)
-            neighbours.push_back(static_cast<int>(index));  //storing index of neighbour within radius R
+    void LSH::resetFallbackStats() {
+        n_queries_ = 0;
+        n_widened_ = 0;
+        n_relaxed_ = 0;
+        n_short_ = 0;
+        n_scored_ = 0;
     }
 
-    return neighbours;
+    size_t LSH::tableMemoryBytes() const {
+        size_t bytes = 0;
+        for(const auto& table : tables_) bytes += table.memoryBytes();
+        return bytes;
     }
 
-}
\ No newline at end of file
+}
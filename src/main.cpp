@@ -7,6 +7,9 @@
 #include <algorithm>
 #include <chrono>
 #include <cctype>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
 #include <algorithm>
 #include "../include/bruteForce.h"
 #include "../include/dataset_io.hpp"
@@ -16,6 +19,8 @@
 #include "../include/ivf_flat.hpp"
 #include "../include/lsh.h"
 #include "../include/ivf_pq.hpp"
+#include "../include/distance.hpp"
+#include "../include/batch_search.hpp"
 
 
 struct Config {
@@ -30,11 +35,27 @@ struct Config {
     bool do_range = false;    // -range true|false
     int seed = 1;             // -seed
 
+    // batch mode: every query, spread over a thread pool (QPS, latency percentiles)
+    bool batch = false;       // -batch
+    int threads = 0;          // -threads (0 = all hardware threads)
+
+    // ground truth cache: exact neighbours computed once, reused by every run
+    std::string gt_path;      // -gt <ivecs|fvecs> (neighbour ids per query)
+    bool build_gt = false;    // -build_gt: compute the truth for all queries and save it to -gt
+    int gt_k = 100;           // -gt_k (neighbours stored per query by -build_gt)
+    MatrixI32 gt;             // loaded from gt_path in main (empty: brute force per query)
+
+    // index files (all four engines)
+    std::string save_index_path; // -save_index <file>: write the index after building it
+    std::string load_index_path; // -load_index <file>: read the index instead of building it
+
     // LSH
     bool use_lsh = false;
     int k = 4;                // -k
     int L = 5;                // -L
     double w = 4.0;           // -w
+    int lsh_probes = 0;       // -probes (multi-probe: extra buckets per table)
+    int lsh_budget = 2000;    // -lsh_budget (max candidates of the fallback when a query finds < N)
 
     // Hypercube
     bool use_hypercube = false;
@@ -46,11 +67,18 @@ struct Config {
     bool use_ivfflat = false;
     int kclusters = 50;       // -kclusters
     int nprobe = 5;           // -nprobe
+    bool ivf_contiguous = false; // -contiguous true|false (list-ordered copy of the vectors)
+    KMeansAlgo kmeans_algo = KMeansAlgo::Lloyd; // -kmeans lloyd|hamerly (IVFFlat / IVFPQ training)
+    int kmeans_batch = 0;     // -kmeans_batch (>0: mini-batch k-means on the whole base)
+    int kmeans_steps = 200;   // -kmeans_steps (mini-batch steps)
 
     // IVFPQ
     bool use_ivfpq = false;
     int M_pq = 16;            // -M (number of sub-vectors for PQ)
-    int nbits = 8;            // -nbits (2^nbits centroids per subspace)
+    int nbits = 8;            // -nbits (2^nbits centroids per subspace, 1..16, codes bit-packed)
+    bool pq_fast_scan = false; // -fast_scan (nbits=4 only: pshufb scan of uint8 LUTs, exact re-rank)
+    int pq_refine = 0;        // -refine R (>0: re-rank the R*N best ADC candidates with exact L2)
+    int opq_iters = 0;        // -opq (OPQ rotation training rounds, 0 = plain PQ)
 
     //NEW ADDITION-BUILD KNN GRAPH MODE FOR PROJECT 2
     bool build_knn = false;// if true, we dont run a-nn algorithms, we build knn graph only
@@ -80,6 +108,22 @@ static bool to_bool(const std::string& s) {
     throw std::runtime_error("Invalid boolean value: " + s + " (expected true|false|1|0)");
 }
 
+KMeansAlgo to_kmeans_algo(const std::string& s) {
+    if (s == "lloyd") return KMeansAlgo::Lloyd;
+    if (s == "hamerly") return KMeansAlgo::Hamerly;
+    throw std::runtime_error("Invalid -kmeans value: " + s + " (expected lloyd|hamerly)");
+}
+
+// k-means options the IVF builders take from the command line
+KMeansParams kmeans_options(const Config& cfg) {
+    KMeansParams kp;
+    kp.algo = cfg.kmeans_algo;
+    kp.threads = cfg.threads;
+    kp.batch_size = cfg.kmeans_batch;
+    kp.batch_iters = cfg.kmeans_steps;
+    return kp;
+}
+
 Config parse_args(int argc, char** argv) {
     Config cfg;
     if (argc < 2) throw std::runtime_error("Insufficient arguments. Use -d, -q, -type and a method flag (-lsh|-hypercube|-ivfflat|-ivfpq).");
@@ -99,12 +143,20 @@ Config parse_args(int argc, char** argv) {
         else if (k == "-R") { need(1); cfg.R = std::stod(argv[++i]); }
         else if (k == "-range") { need(1); cfg.do_range = to_bool(argv[++i]); }
         else if (k == "-seed") { need(1); cfg.seed = std::stoi(argv[++i]); }
+        else if (k == "-batch") { cfg.batch = true; }
+        else if (k == "-threads") { need(1); cfg.threads = std::stoi(argv[++i]); }
+        else if (k == "-gt") { need(1); cfg.gt_path = argv[++i]; }
+        else if (k == "-build_gt") { cfg.build_gt = true; }
+        else if (k == "-gt_k") { need(1); cfg.gt_k = std::stoi(argv[++i]); }
+        else if (k == "-save_index") { need(1); cfg.save_index_path = argv[++i]; }
+        else if (k == "-load_index") { need(1); cfg.load_index_path = argv[++i]; }
 
         // LSH
         else if (k == "-lsh") { cfg.use_lsh = true; }
         else if (k == "-k") { need(1); cfg.k = std::stoi(argv[++i]); }
         else if (k == "-L") { need(1); cfg.L = std::stoi(argv[++i]); }
         else if (k == "-w") { need(1); cfg.w = std::stod(argv[++i]); }
+        else if (k == "-lsh_budget") { need(1); cfg.lsh_budget = std::stoi(argv[++i]); }
 
         // Hypercube
         else if (k == "-hypercube") { cfg.use_hypercube = true; }
@@ -117,16 +169,29 @@ Config parse_args(int argc, char** argv) {
             cfg.M = val;
             cfg.M_pq = val;
         }
-        else if (k == "-probes") { need(1); cfg.probes = std::stoi(argv[++i]); }
+        else if (k == "-probes") {
+            need(1);
+            // probes is used by both hypercube (vertices to visit) and LSH (extra buckets per table)
+            int val = std::stoi(argv[++i]);
+            cfg.probes = val;
+            cfg.lsh_probes = val;
+        }
 
         // IVFFlat
         else if (k == "-ivfflat") { cfg.use_ivfflat = true; }
         else if (k == "-kclusters") { need(1); cfg.kclusters = std::stoi(argv[++i]); }
         else if (k == "-nprobe") { need(1); cfg.nprobe = std::stoi(argv[++i]); }
+        else if (k == "-contiguous") { need(1); cfg.ivf_contiguous = to_bool(argv[++i]); }
+        else if (k == "-kmeans") { need(1); cfg.kmeans_algo = to_kmeans_algo(argv[++i]); }
+        else if (k == "-kmeans_batch") { need(1); cfg.kmeans_batch = std::stoi(argv[++i]); }
+        else if (k == "-kmeans_steps") { need(1); cfg.kmeans_steps = std::stoi(argv[++i]); }
 
         // IVFPQ
         else if (k == "-ivfpq") { cfg.use_ivfpq = true; }
         else if (k == "-nbits") { need(1); cfg.nbits = std::stoi(argv[++i]); }
+        else if (k == "-fast_scan") { need(1); cfg.pq_fast_scan = to_bool(argv[++i]); }
+        else if (k == "-refine") { need(1); cfg.pq_refine = std::stoi(argv[++i]); }
+        else if (k == "-opq") { need(1); cfg.opq_iters = std::stoi(argv[++i]); }
 
         //NEW - KNN GRAPH BUILDING MODE
         else if (k == "-build_knn") { cfg.build_knn = true; }
@@ -143,8 +208,8 @@ Config parse_args(int argc, char** argv) {
     }
 
     // method selection sanity
-    int methods = (cfg.use_lsh?1:0) + (cfg.use_hypercube?1:0) + (cfg.use_ivfflat?1:0) + (cfg.use_ivfpq?1:0) + (cfg.build_knn?1:0);
-    if (methods != 1) throw std::runtime_error("Select exactly one method: -lsh | -hypercube | -ivfflat | -ivfpq | -build_knn");
+    int methods = (cfg.use_lsh?1:0) + (cfg.use_hypercube?1:0) + (cfg.use_ivfflat?1:0) + (cfg.use_ivfpq?1:0) + (cfg.build_knn?1:0) + (cfg.build_gt?1:0);
+    if (methods != 1) throw std::runtime_error("Select exactly one method: -lsh | -hypercube | -ivfflat | -ivfpq | -build_knn | -build_gt");
 
     //if (cfg.input_path.empty() || cfg.query_path.empty() || cfg.type.empty())
       //  throw std::runtime_error("Missing required arguments: -d <input> -q <query> -type <mnist|sift>");
@@ -154,6 +219,13 @@ Config parse_args(int argc, char** argv) {
     if (!cfg.build_knn && cfg.query_path.empty())
         throw std::runtime_error("Query path (-q) required unless using -build_knn");
 
+    if (cfg.build_gt && cfg.gt_path.empty())
+        throw std::runtime_error("-build_gt needs the output file: -gt <file.ivecs>");
+    if (cfg.build_gt && cfg.gt_k < 1)
+        throw std::runtime_error("-gt_k must be positive");
+    if (cfg.pq_refine < 0)
+        throw std::runtime_error("-refine must be >= 0 (0 = no re-ranking)");
+
     // finalize dataset-dependent defaults (R)
     cfg.finalize_defaults();
 
@@ -166,9 +238,13 @@ Config parse_args(int argc, char** argv) {
 // --- placeholders for algorithm entry points ---
 void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg);
 void run_hypercube(const Matrix& base, const Matrix& queries, const Config& cfg);
-void run_ivfflat(const Matrix& base, const Matrix& queries, const Config& cfg);
+template <class T>
+void run_ivfflat(const DenseMatrix<T>& base, const DenseMatrix<T>& queries, const Config& cfg);
 void run_ivfpq(const Matrix& base, const Matrix& queries, const Config& cfg);
 void run_build_knn(const Matrix& base, const Config& cfg);
+template <class T>
+void run_build_gt(const DenseMatrix<T>& base, const DenseMatrix<T>& queries, const Config& cfg);
+MatrixI32 load_ground_truth(const std::string& path, int query_n, int N);
 
 int main(int argc, char** argv) {
     try {
@@ -185,13 +261,20 @@ int main(int argc, char** argv) {
         //}
 
       //  if (base.d != queries.d) throw std::runtime_error("Dimension mismatch between base and query sets"); 
-        Matrix base, queries;
-
-        if (iequals(cfg.type, "mnist")) {
-            base = load_mnist_images(cfg.input_path, false);
-
-        if (!cfg.build_knn)
-            queries = load_mnist_images(cfg.query_path, false); 
+        Matrix base, queries;        // float vectors (SIFT, or MNIST expanded for the float-only engines)
+        MatrixU8 base8, queries8;    // raw MNIST pixels, zero-copy views of the idx files
+        const bool mnist = iequals(cfg.type, "mnist");
+        // IVFFlat (and brute force) run on the bytes directly: 4x less memory traffic
+        const bool native_u8 = mnist && (cfg.use_ivfflat || cfg.build_gt);
+
+        if (mnist) {
+            base8 = map_mnist_images(cfg.input_path);
+            if (!cfg.build_knn)
+                queries8 = map_mnist_images(cfg.query_path);
+            if (!native_u8) {
+                base = to_float(base8);
+                queries = to_float(queries8);
+            }
         }
         else {
             base = load_fvecs(cfg.input_path);
@@ -200,16 +283,27 @@ int main(int argc, char** argv) {
             queries = load_fvecs(cfg.query_path);
         }
 
-        if (!cfg.build_knn && base.d != queries.d)
+        const int base_n = mnist ? base8.n : base.n, base_d = mnist ? base8.d : base.d;
+        const int query_n = mnist ? queries8.n : queries.n, query_d = mnist ? queries8.d : queries.d;
+        if (!cfg.build_knn && base_d != query_d)
             throw std::runtime_error("Dimension mismatch between base and query sets");
   
 
-        std::cerr << "Loaded base n=" << base.n << " d=" << base.d
-                  << " | queries n=" << queries.n << "\n";
+        std::cerr << "Loaded base n=" << base_n << " d=" << base_d
+                  << " | queries n=" << query_n << (native_u8 ? " (uint8)" : "") << "\n";
+        std::cerr << "Distance kernels: " << dist::level_name(dist::active_level()) << "\n";
+
+        if (!cfg.gt_path.empty() && !cfg.build_gt) {
+            cfg.gt = load_ground_truth(cfg.gt_path, query_n, cfg.N);
+            std::cerr << "Ground truth: " << cfg.gt_path << " (" << cfg.gt.d << " neighbours per query)\n";
+        }
 
         // dispatch
-        if (cfg.use_lsh)            run_lsh(base, queries, cfg);
+        if (cfg.build_gt && native_u8) run_build_gt(base8, queries8, cfg);
+        else if (cfg.build_gt)      run_build_gt(base, queries, cfg);
+        else if (cfg.use_lsh)            run_lsh(base, queries, cfg);
         else if (cfg.use_hypercube) run_hypercube(base, queries, cfg);
+        else if (native_u8)         run_ivfflat(base8, queries8, cfg);
         else if (cfg.use_ivfflat)   run_ivfflat(base, queries, cfg);
         else if (cfg.use_ivfpq)     run_ivfpq(base, queries, cfg);
         else if(cfg.build_knn)      run_build_knn(base, cfg); //new add
@@ -269,6 +363,161 @@ static double af_top1(const std::vector<std::pair<int,double>>& approx,
     return approx[0].second / truth[0].second;
 }
 
+// --- ground truth ----------------------------------------------------------
+
+//reads a cached ground truth: ivecs of neighbour ids per query (the standard SIFT/GIST
+//groundtruth files), or fvecs holding the ids as floats. Row qi must belong to query qi.
+MatrixI32 load_ground_truth(const std::string& path, int query_n, int N) {
+    MatrixI32 gt;
+    const std::string ext = ".fvecs";
+    if (path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0) {
+        Matrix f = load_fvecs(path);
+        gt.n = f.n;
+        gt.d = f.d;
+        gt.a.resize((size_t)f.n * f.d);
+        for (int i = 0; i < f.n; ++i)
+            for (int j = 0; j < f.d; ++j) gt.row(i)[j] = (int32_t)std::lround(f.row(i)[j]);
+    } else {
+        gt = load_ivecs(path);
+    }
+    if (gt.n < query_n)
+        throw std::runtime_error("Ground truth " + path + " has " + std::to_string(gt.n) +
+                                 " rows but there are " + std::to_string(query_n) + " queries");
+    if (gt.d < N)
+        throw std::runtime_error("Ground truth " + path + " holds " + std::to_string(gt.d) +
+                                 " neighbours per query, fewer than -N " + std::to_string(N));
+    return gt;
+}
+
+//exact top-N of query qi: taken from the cached ground truth (-gt) when there is one, so only
+//the N true distances are recomputed; otherwise brute force over the whole base
+template <class T>
+static Neighbors true_topN(const DenseMatrix<T>& base, const DenseMatrix<T>& queries, int qi, const Config& cfg) {
+    if (cfg.gt.n == 0) return brute::knnSearch(base, queries.row(qi), cfg.N);
+
+    const int32_t* ids = cfg.gt.row(qi);
+    Neighbors truth;
+    truth.reserve(cfg.N);
+    for (int i = 0; i < cfg.N; ++i) {
+        const int id = ids[i];
+        if (id < 0 || id >= base.n)
+            throw std::runtime_error("Ground truth id " + std::to_string(id) + " is out of range for this base set");
+        truth.emplace_back(id, std::sqrt((double)dist::l2_sq(queries.row(qi), base.row(id), base.d)));
+    }
+    return truth;
+}
+
+//-build_gt: exact kNN of every query (blocked batch search on all threads), saved as ivecs
+//so that later runs pass it back with -gt instead of recomputing it
+template <class T>
+void run_build_gt(const DenseMatrix<T>& base, const DenseMatrix<T>& queries, const Config& cfg) {
+    const int K = std::min(cfg.gt_k, base.n);
+    std::cout << "[build_gt] Exact " << K << "-NN of " << queries.n << " queries over " << base.n << " points\n";
+
+    const auto t0 = std::chrono::steady_clock::now();
+    auto truth = brute::knnSearchBatch(base, queries, K, cfg.threads);
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::vector<int32_t> ids((size_t)queries.n * K);
+    for (int qi = 0; qi < queries.n; ++qi)
+        for (int i = 0; i < K; ++i) ids[(size_t)qi * K + i] = truth[qi][i].first;
+    save_ivecs(cfg.gt_path, ids, queries.n, K);
+
+    std::cout << "[build_gt] Saved ground truth to " << cfg.gt_path << " (" << secs << " s)\n";
+}
+
+// --- index files (-save_index / -load_index) -------------------------------
+
+//gets the index ready: load() from -load_index if given, build() otherwise, then save() to
+//-save_index if given. Reports how long it took (build vs load is what restarts pay).
+template <class Build, class Load, class Save>
+static void build_or_load(const std::string& name, const Config& cfg, Build build, Load load, Save save) {
+    const bool from_file = !cfg.load_index_path.empty();
+    const auto t0 = std::chrono::steady_clock::now();
+    if (from_file) load(); else build();
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "[" << name << "] Index " << (from_file ? "loaded from " + cfg.load_index_path : std::string("built"))
+              << " in " << secs << " s\n";
+
+    if (!cfg.save_index_path.empty()) {
+        save();
+        std::cerr << "[" << name << "] Index saved to " << cfg.save_index_path << "\n";
+    }
+}
+
+// --- batch mode (-batch) ---------------------------------------------------
+
+template <class R>
+static Neighbors to_neighbors(const R& ans) { // TopN / TopNPQ -> (id, dist) pairs
+    Neighbors nb;
+    nb.reserve(ans.ids.size());
+    for (size_t i = 0; i < ans.ids.size(); ++i) nb.emplace_back(ans.ids[i], ans.dists[i]);
+    return nb;
+}
+
+//runs `search` over ALL queries on the thread pool, then the truth for the whole query set
+//(cached -gt file, or the blocked brute force), writes per-query answers to `out` and reports recall / AF over all queries,
+//aggregate QPS (queries / wall time) and latency percentiles
+template <class T, class SearchFn, class RangeFn>
+static void evaluate_batch(const std::string& name, std::ostream& out,
+                           const DenseMatrix<T>& base, const DenseMatrix<T>& queries,
+                           int threads, const Config& cfg, SearchFn search, RangeFn range) {
+    const int Q = queries.n;
+    if (threads <= 0) threads = hardware_threads();
+    std::cerr << "[" << name << "] Batch: " << Q << " queries on " << threads << " threads\n";
+
+    auto approx = run_query_batch(Q, threads, search);
+
+    BatchRun<Neighbors> exact;
+    const auto t0 = std::chrono::steady_clock::now();
+    if (cfg.gt.n > 0) {
+        exact.answers.resize(Q);
+        parallel_for(0, Q, threads, [&](int qi) { exact.answers[qi] = true_topN(base, queries, qi, cfg); });
+    } else {
+        exact.answers = brute::knnSearchBatch(base, queries, cfg.N, cfg.threads);
+    }
+    exact.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    const double tTrueAvg = Q ? exact.wall_s * 1000.0 / Q : 0.0; // amortized per query
+
+    double sumAF = 0.0, sumRecall = 0.0;
+    int nAF = 0;
+    for (int qi = 0; qi < Q; ++qi) {
+        const Neighbors& a = approx.answers[qi];
+        const Neighbors& t = exact.answers[qi];
+        sumRecall += recall_at_N(a, t);
+        if (!a.empty() && !t.empty() && t[0].second > 0.0) { sumAF += af_top1(a, t); ++nAF; }
+
+        out << "Query: " << qi << "\n";
+        for (int i = 0; i < (int)a.size(); ++i) {
+            out << "Nearest neighbor-" << (i+1) << ": " << a[i].first << "\n";
+            out << "distanceApproximate: " << a[i].second << "\n";
+            out << "distanceTrue: " << (i < (int)t.size() ? t[i].second : -1.0) << "\n";
+        }
+    }
+
+    if (cfg.do_range) {
+        auto inR = run_query_batch(Q, threads, range);
+        for (int qi = 0; qi < Q; ++qi) {
+            out << "R-near neighbors (query " << qi << "):\n";
+            for (int id : inR.answers[qi]) out << id << "\n";
+        }
+    }
+
+    std::ostringstream sum;
+    sum << "Queries: " << Q << "\n"
+        << "Threads: " << threads << "\n"
+        << "Average AF: " << (nAF ? sumAF / nAF : 0.0) << "\n"
+        << "Recall@N: " << (Q ? sumRecall / Q : 0.0) << "\n"
+        << "QPS: " << approx.qps() << "\n"
+        << "tApproximateAverage: " << approx.mean_ms() << "\n"
+        << "tApproximateP50: " << approx.percentile_ms(50) << "\n"
+        << "tApproximateP95: " << approx.percentile_ms(95) << "\n"
+        << "tApproximateP99: " << approx.percentile_ms(99) << "\n"
+        << "tTrueAverage: " << tTrueAvg << "\n";
+    out << sum.str();
+    std::cout << "[" << name << " batch]\n" << sum.str();
+}
+
 // --- dummy implementations just to compile now; replace with real ones -----
 void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg){
     using namespace std::chrono;
@@ -277,20 +526,39 @@ void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg){
    
     out << "LSH\n";
 
-  //convertix Matrix to std::vector<std::vector<float>> only once
-    std::vector<std::vector<float>> base_vecs(base.n);
-    for(int i = 0; i < base.n; ++i)
-        base_vecs[i] = std::vector<float>(base.row(i), base.row(i) + base.d);
-
   //building the lsh index
     lsh::LSH index(base.d, cfg.k, cfg.L, cfg.w, -1, cfg.seed);
-    index.buildIndex(base_vecs);
+    index.setProbes(cfg.lsh_probes);
+    index.setFallback(32, cfg.lsh_budget);
+    index.setBuildThreads(cfg.threads);
+    build_or_load("LSH", cfg,
+        [&] { index.buildIndex(base); },
+        [&] { index.loadIndex(cfg.load_index_path, base); },
+        [&] { index.saveIndex(cfg.save_index_path); });
+
+    //how many queries needed the fallback stages (fewer than N candidates with the query's IDs)
+    auto report_fallback = [&] {
+        const auto st = index.fallbackStats();
+        std::ostringstream line;
+        line << "Fallback: widened " << st.widened << ", relaxed " << st.relaxed
+             << ", short " << st.short_results << " of " << st.queries << " queries\n";
+        out << line.str();
+        std::cout << "[LSH] " << line.str();
+    };
+
+    if (cfg.batch) {
+        evaluate_batch("LSH", out, base, queries, cfg.threads, cfg,
+            [&](int qi) { return index.searchKNN(queries.row(qi), cfg.N); },
+            [&](int qi) { return index.searchRadius(queries.row(qi), cfg.R); });
+        report_fallback();
+        return;
+    }
 
     double sumAF = 0.0, sumRecall = 0.0, sumApprox = 0.0, sumTrue = 0.0;
     int Q = std::min(queries.n, 5); 
 
     for(int qi = 0; qi < Q; ++qi){
-        std::vector<float> q(queries.row(qi), queries.row(qi) + queries.d);
+        const float* q = queries.row(qi); //searched in place, no copy
 
 
         //aproximate search
@@ -301,7 +569,7 @@ void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg){
 
         //true - brute force search
         auto t2 = high_resolution_clock::now();
-        auto truth = brute :: knnSearch(base_vecs, q, cfg.N);
+        auto truth = true_topN(base, queries, qi, cfg);
         auto t3 = high_resolution_clock::now();
         double tTrue = duration_cast<microseconds>(t3 - t2).count() / 1000.0;
 
@@ -323,7 +591,7 @@ void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg){
         }
 
         if (cfg.do_range) {
-            auto idsR = brute::rangeSearch(base_vecs, q, cfg.R);
+            auto idsR = brute::rangeSearch(base, queries.row(qi), cfg.R);
             out << "R-near neighbors:\n";
             for (int id : idsR) out << id << "\n";
         }
@@ -341,6 +609,7 @@ void run_lsh(const Matrix& base, const Matrix& queries, const Config& cfg){
     out << "QPS: " << QPS << "\n";
     out << "tApproximateAverage: " << avgApprox << "\n";
     out << "tTrueAverage: " << avgTrue << "\n";
+    report_fallback();
 
     std::cout << "[LSH] Results saved to " << cfg.output_path << "\n";
 
@@ -353,19 +622,25 @@ void run_hypercube(const Matrix& base, const Matrix& queries, const Config& cfg)
    
     out << "Hypercube\n";
 
-    //converting the dataset to vector of vectors
-    std::vector<std::vector<float>> base_vecs(base.n);
-    for(int i = 0; i < base.n; ++i)
-        base_vecs[i] = std::vector<float>(base.row(i), base.row(i) + base.d);
-
     cube::Hypercube hc(base.d, cfg.kproj, cfg.w, cfg.M, cfg.probes, cfg.seed);
-    hc.buildIndex(base_vecs);
+    hc.setBuildThreads(cfg.threads);
+    build_or_load("Hypercube", cfg,
+        [&] { hc.buildIndex(base); },
+        [&] { hc.loadIndex(cfg.load_index_path, base); },
+        [&] { hc.saveIndex(cfg.save_index_path); });
+
+    if (cfg.batch) {
+        evaluate_batch("Hypercube", out, base, queries, cfg.threads, cfg,
+            [&](int qi) { return hc.searchKNN(queries.row(qi), cfg.N); },
+            [&](int qi) { return hc.searchRadius(queries.row(qi), cfg.R); });
+        return;
+    }
 
     double sumAF = 0.0, sumRecall = 0.0, sumTrue = 0.0, sumApprox = 0.0;
     int Q = std::min(queries.n, 5);
 
     for(int qi = 0; qi < Q; ++qi){
-        std::vector<float> q(queries.row(qi), queries.row(qi) + queries.d);
+        const float* q = queries.row(qi); //searched in place, no copy
 
         //approximate
         auto t0 = high_resolution_clock::now();
@@ -375,7 +650,7 @@ void run_hypercube(const Matrix& base, const Matrix& queries, const Config& cfg)
 
          //true
         auto t2 = high_resolution_clock::now();
-        auto truth = brute::knnSearch(base_vecs, q, cfg.N);
+        auto truth = true_topN(base, queries, qi, cfg);
         auto t3 = high_resolution_clock::now();
         auto tTrue = duration_cast<microseconds>(t3 - t2).count() / 1000.0;
 
@@ -396,7 +671,7 @@ void run_hypercube(const Matrix& base, const Matrix& queries, const Config& cfg)
         }
 
         if (cfg.do_range) {
-            auto idsR = brute::rangeSearch(base_vecs, q, cfg.R);
+            auto idsR = brute::rangeSearch(base, queries.row(qi), cfg.R);
             out << "R-near neighbors:\n";
             for (int id : idsR) out << id << "\n";
         }
@@ -443,38 +718,51 @@ void run_hypercube(const Matrix& base, const Matrix& queries, const Config& cfg)
     }
 }*/
 
-void run_ivfflat(const Matrix& base, const Matrix& queries, const Config& cfg) {
+template <class T>
+void run_ivfflat(const DenseMatrix<T>& base, const DenseMatrix<T>& queries, const Config& cfg) {
     using namespace std::chrono;
     std::cout << "[IVFFlat] Building index...\n";
 
     int train_subset = (int)std::sqrt((double)base.n);
-    auto ivf = build_ivf_flat(base, cfg.kclusters, cfg.seed, train_subset);
-
-    std::cout << "IVF built: k=" << cfg.kclusters
+    IVFIndexFlat ivf;
+    build_or_load("IVFFlat", cfg,
+        [&] { ivf = build_ivf_flat(base, cfg.kclusters, cfg.seed, train_subset, cfg.ivf_contiguous,
+                                   kmeans_options(cfg)); },
+        [&] { ivf = load_ivf_flat(cfg.load_index_path, base.n, base.d); },
+        [&] { save_ivf_flat(cfg.save_index_path, ivf, base.n, base.d); });
+
+    std::cout << "IVF built: k=" << ivf.centroids.n
               << ", avg list size ≈ " << (double)base.n / std::max(1, ivf.centroids.n) << "\n";
-
-    // Convert base Matrix to std::vector<std::vector<float>> for brute-force search
-    std::vector<std::vector<float>> base_vecs(base.n);
-    for (int i = 0; i < base.n; ++i)
-        base_vecs[i] = std::vector<float>(base.row(i), base.row(i) + base.d);
+    std::cout << "IVF layout: " << (ivf.contiguous() ? "contiguous" : "ids")
+              << ", index memory: " << ivf_flat_memory_bytes(ivf) / (1024.0 * 1024.0) << " MB\n";
+
+    if (cfg.batch) {
+        std::ofstream out(cfg.output_path);
+        if (!out) throw std::runtime_error("Could not open output file: " + cfg.output_path);
+        out << "IVFFlat\n";
+        evaluate_batch("IVFFlat", out, base, queries, cfg.threads, cfg,
+            [&](int qi) { return to_neighbors(ivf_flat_query_topN(ivf, base, queries.row(qi), cfg.nprobe, cfg.N)); },
+            [&](int qi) { return ivf_flat_query_range(ivf, base, queries.row(qi), cfg.nprobe, (float)cfg.R); });
+        return;
+    }
 
     double total_recall = 0.0, total_af = 0.0;
     double total_tApprox = 0.0, total_tTrue = 0.0;
 
     const int Q = std::min(queries.n, 5); // test on 5 queries for speed
     for (int qi = 0; qi < Q; ++qi) {
-        std::vector<float> q(queries.row(qi), queries.row(qi) + queries.d);
+        const T* q = queries.row(qi);
 
         // --- Approximate search ---
         auto t0 = high_resolution_clock::now();
-        auto ans = ivf_flat_query_topN(ivf, base, q.data(), cfg.nprobe, cfg.N);
+        auto ans = ivf_flat_query_topN(ivf, base, q, cfg.nprobe, cfg.N);
         auto t1 = high_resolution_clock::now();
         double tApprox = duration_cast<microseconds>(t1 - t0).count() / 1000.0;
         total_tApprox += tApprox;
 
         // --- True NN via brute force ---
         auto t2 = high_resolution_clock::now();
-        auto truth = brute::knnSearch(base_vecs, q, cfg.N);
+        auto truth = true_topN(base, queries, qi, cfg);
         auto t3 = high_resolution_clock::now();
         double tTrue = duration_cast<microseconds>(t3 - t2).count() / 1000.0;
         total_tTrue += tTrue;
@@ -520,25 +808,45 @@ void run_ivfpq(const Matrix& base, const Matrix& queries, const Config& cfg) {
     int train_subset = (int)std::sqrt((double)base.n);
     if (train_subset < 1000) train_subset = std::min(1000, base.n);
 
-    auto ivf = build_ivf_pq(base, cfg.kclusters, cfg.M_pq, cfg.nbits, cfg.seed, train_subset);
-
-    std::cout << "IVFPQ built: k=" << cfg.kclusters
-         << ", M=" << cfg.M_pq
-         << ", nbits=" << cfg.nbits
-         << ", dsub=" << (base.d / cfg.M_pq)
+    IVFIndexPQ ivf;
+    build_or_load("IVFPQ", cfg,
+        [&] { ivf = build_ivf_pq(base, cfg.kclusters, cfg.M_pq, cfg.nbits, cfg.seed, train_subset,
+                                 kmeans_options(cfg), cfg.opq_iters);
+              if (cfg.pq_fast_scan) ivf_pq_pack_fast_scan(ivf); },
+        [&] { ivf = load_ivf_pq(cfg.load_index_path, base.n, base.d); },
+        [&] { save_ivf_pq(cfg.save_index_path, ivf, base.n, base.d); });
+
+    std::cout << "IVFPQ built: k=" << ivf.centroids.n
+         << ", M=" << ivf.pq.M
+         << ", nbits=" << ivf.pq.nbits
+         << ", dsub=" << ivf.pq.dsub
+         << ", code=" << ivf.pq.code_size() << " B/vector"
+         << (ivf.opq.n > 0 ? ", OPQ" : "")
+         << (ivf.fast_scan ? ", fast-scan" : "")
+         << (cfg.pq_refine > 0 ? ", refine=" + std::to_string(cfg.pq_refine) : std::string())
          << ", avg list size ≈ " << (double)base.n / std::max(1, ivf.centroids.n)
          << "\n";
 
+    if (cfg.batch) {
+        std::ofstream out(cfg.output_path);
+        if (!out) throw std::runtime_error("Could not open output file: " + cfg.output_path);
+        out << "IVFPQ\n";
+        evaluate_batch("IVFPQ", out, base, queries, cfg.threads, cfg,
+            [&](int qi) { return to_neighbors(ivf_pq_query_topN(ivf, base, queries.row(qi), cfg.nprobe, cfg.N, cfg.pq_refine)); },
+            [&](int qi) { return ivf_pq_query_range(ivf, queries.row(qi), cfg.nprobe, (float)cfg.R); });
+        return;
+    }
+
     // 2) Quick smoke test — first few queries
     const int show = std::min(3, queries.n);
     for (int i = 0; i < show; ++i) {
         if (!cfg.do_range) {
-            auto ans = ivf_pq_query_topN(ivf, base, queries.row(i), cfg.nprobe, cfg.N);
+            auto ans = ivf_pq_query_topN(ivf, base, queries.row(i), cfg.nprobe, cfg.N, cfg.pq_refine);
             std::cout << "q" << i << " → got " << ans.ids.size()
                  << " | nn id=" << (ans.ids.empty() ? -1 : ans.ids[0])
                  << " dist=" << (ans.dists.empty() ? -1.0f : ans.dists[0]) << "\n";
         } else {
-            auto ids = ivf_pq_query_range(ivf, base, queries.row(i), cfg.nprobe, (float)cfg.R);
+            auto ids = ivf_pq_query_range(ivf, queries.row(i), cfg.nprobe, (float)cfg.R);
             std::cout << "q" << i << " → " << ids.size() << " ids within R\n";
         }
     }
@@ -546,11 +854,6 @@ void run_ivfpq(const Matrix& base, const Matrix& queries, const Config& cfg) {
     std::cout << "Use -N <int> or -R <float> and -range true|false to change search mode.\n";
 
     // 3) === Evaluation for scripts (prints the lines your grep expects) ===
-    // Convert base to vector<vector<float>> for brute force
-    std::vector<std::vector<float>> base_vecs(base.n);
-    for (int i = 0; i < base.n; ++i)
-        base_vecs[i] = std::vector<float>(base.row(i), base.row(i) + base.d);
-
     double total_recall = 0.0, total_af = 0.0;
     double total_tApprox = 0.0, total_tTrue = 0.0;
 
@@ -560,14 +863,14 @@ void run_ivfpq(const Matrix& base, const Matrix& queries, const Config& cfg) {
 
         // Approximate
         auto t0 = high_resolution_clock::now();
-        auto ans = ivf_pq_query_topN(ivf, base, q.data(), cfg.nprobe, cfg.N);
+        auto ans = ivf_pq_query_topN(ivf, base, q.data(), cfg.nprobe, cfg.N, cfg.pq_refine);
         auto t1 = high_resolution_clock::now();
         double tApprox = duration_cast<microseconds>(t1 - t0).count() / 1000.0;
         total_tApprox += tApprox;
 
         // True (brute)
         auto t2 = high_resolution_clock::now();
-        auto truth = brute::knnSearch(base_vecs, q, cfg.N);
+        auto truth = true_topN(base, queries, qi, cfg);
         auto t3 = high_resolution_clock::now();
         double tTrue = duration_cast<microseconds>(t3 - t2).count() / 1000.0;
         total_tTrue += tTrue;
@@ -592,9 +895,7 @@ void run_ivfpq(const Matrix& base, const Matrix& queries, const Config& cfg) {
     cout << "QPS: " << qps << "\n";
     cout << "tApproximateAverage: " << avg_tApprox << "\n";
 }
-/*Κάνει convert το Matrix σε vector<vector<float>>
-
-Διαβάζει cfg.knn_method
+/*Διαβάζει cfg.knn_method
 
 Επιλέγει LSH / Hypercube / IVFFlat / IVFPQ
 
@@ -625,11 +926,6 @@ void run_build_knn(const Matrix& base, const Config& cfg) {
     cout << "[build_knn] Building kNN using method = " << method << endl;
     cout << "  n = " << n << ", d = " << d << ", K = " << K << endl;
 
-    // Convert Matrix to vector<vector<float>>
-    vector<vector<float>> base_vecs(n);
-    for (int i = 0; i < n; i++)
-        base_vecs[i] = vector<float>(base.row(i), base.row(i) + d);
-
     vector<int> knn_idx(n * K, -1);
 
     // =============================
@@ -639,10 +935,12 @@ void run_build_knn(const Matrix& base, const Config& cfg) {
         cout << "  -> Using LSH\n";
 
         lsh::LSH index(d, cfg.k, cfg.L, cfg.w, -1, cfg.seed);
-        index.buildIndex(base_vecs);
+        index.setProbes(cfg.lsh_probes);
+        index.setBuildThreads(cfg.threads);
+        index.buildIndex(base);
 
         for (int i = 0; i < n; i++) {
-            auto neigh = index.searchKNN(base_vecs[i], K+1);
+            auto neigh = index.searchKNN(base.row(i), K+1);
 
             vector<int> row;
             for (auto& p : neigh) {
@@ -664,10 +962,11 @@ void run_build_knn(const Matrix& base, const Config& cfg) {
         cout << "  -> Using Hypercube\n";
 
         cube::Hypercube hc(d, cfg.kproj, cfg.w, cfg.M, cfg.probes, cfg.seed);
-        hc.buildIndex(base_vecs);
+        hc.setBuildThreads(cfg.threads);
+        hc.buildIndex(base);
 
         for (int i = 0; i < n; i++) {
-            auto neigh = hc.searchKNN(base_vecs[i], K+1);
+            auto neigh = hc.searchKNN(base.row(i), K+1);
 
             vector<int> row;
             for (auto& p : neigh) {
@@ -689,7 +988,8 @@ void run_build_knn(const Matrix& base, const Config& cfg) {
         cout << "  -> Using IVFFlat\n";
 
         int train_subset = (int)std::sqrt((double)n);
-        auto ivf = build_ivf_flat(base, cfg.kclusters, cfg.seed, train_subset);
+        auto ivf = build_ivf_flat(base, cfg.kclusters, cfg.seed, train_subset, cfg.ivf_contiguous,
+                                  kmeans_options(cfg));
 
         for (int i = 0; i < n; i++) {
             auto ans = ivf_flat_query_topN(ivf, base, base.row(i), cfg.nprobe, K+1);
@@ -714,10 +1014,12 @@ void run_build_knn(const Matrix& base, const Config& cfg) {
         cout << "  -> Using IVFPQ\n";
 
         int train_subset = (int)std::sqrt((double)n);
-        auto ivf = build_ivf_pq(base, cfg.kclusters, cfg.M_pq, cfg.nbits, cfg.seed, train_subset);
+        auto ivf = build_ivf_pq(base, cfg.kclusters, cfg.M_pq, cfg.nbits, cfg.seed, train_subset,
+                                kmeans_options(cfg), cfg.opq_iters);
+        if (cfg.pq_fast_scan) ivf_pq_pack_fast_scan(ivf);
 
         for (int i = 0; i < n; i++) {
-            auto ans = ivf_pq_query_topN(ivf, base, base.row(i), cfg.nprobe, K+1);
+            auto ans = ivf_pq_query_topN(ivf, base, base.row(i), cfg.nprobe, K+1, cfg.pq_refine);
 
             vector<int> row;
             for (int id : ans.ids) {
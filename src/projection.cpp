@@ -0,0 +1,55 @@
+#include <cmath>
+#include <vector>
+
+#include "../include/projection.hpp"
+#include "../include/distance.hpp"
+
+RandomProjections::RandomProjections(int count, int dim, double w) : t_(count, 0.0), w_(w) {
+    V_.n = count;
+    V_.d = dim;
+    V_.a.assign(static_cast<size_t>(count) * dim, 0.0f);
+}
+
+void RandomProjections::hash(const float* p, int* h, double* pos) const {
+    const int k = V_.n;
+    thread_local std::vector<float> proj;
+    proj.resize(k);
+    dist::ip_block(V_.row(0), V_.row_stride(), k, p, static_cast<size_t>(V_.d), 1, V_.d, proj.data());
+    for (int i = 0; i < k; ++i) {
+        const double f = (proj[i] + t_[i]) / w_;
+        h[i] = static_cast<int>(std::floor(f));
+        if (pos) pos[i] = f - h[i];
+    }
+}
+
+void RandomProjections::hashBatch(const float* X, size_t stride, int n, int* H) const {
+    const int k = V_.n;
+    if (k == 0 || n <= 0) return;
+    // the projection rows are the "queries" of the tile and the points its "base" rows: a row's
+    // products then come out of the same kernel path whether one point or a block is hashed,
+    // so build and query agree on every h-value
+    static const int kTile = 64;
+    thread_local std::vector<float> proj;
+    proj.resize(static_cast<size_t>(kTile) * k);
+    for (int j0 = 0; j0 < n; j0 += kTile) {
+        const int nb = std::min(kTile, n - j0);
+        dist::ip_block(V_.row(0), V_.row_stride(), k, X + static_cast<size_t>(j0) * stride, stride, nb, V_.d, proj.data());
+        for (int j = 0; j < nb; ++j)
+            for (int i = 0; i < k; ++i)
+                H[static_cast<size_t>(j0 + j) * k + i] =
+                    static_cast<int>(std::floor((proj[static_cast<size_t>(i) * nb + j] + t_[i]) / w_));
+    }
+}
+
+void RandomProjections::write(BinWriter& w) const {
+    w.matrix(V_);
+    w.vec(t_);
+    w.pod(w_);
+}
+
+void RandomProjections::read(BinReader& r) {
+    V_ = r.matrix<float>();
+    t_ = r.vec<double>();
+    w_ = r.pod<double>();
+    if (static_cast<int>(t_.size()) != V_.n) throw std::runtime_error("corrupt projection matrix in index file");
+}
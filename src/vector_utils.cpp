@@ -1,4 +1,5 @@
 #include "vector_utils.h"
+#include "distance.hpp"
 
 namespace vutils{
     //Global random engine.We are using a Mersenne Twister engine and we'll use it 
@@ -37,14 +38,14 @@ namespace vutils{
         return std::inner_product(a.begin(), a.begin() + n, b.begin(), 0.0);
      }
 
+     //single-precision SIMD kernel (see distance.hpp), only the sqrt is done in double
      double euclideanDistance(const std::vector<float>& a, const std::vector<float>& b){
         size_t n = std::min(a.size(), b.size());
-        double sum = 0.0;
-        for(size_t i = 0; i < n; ++i){
-            double diff = static_cast<double>(a[i]) - static_cast<double>(b[i]);
-            sum += diff * diff;
-        }
-        return std::sqrt(sum);
+        return euclideanDistance(a.data(), b.data(), static_cast<int>(n));
+     }
+
+     double euclideanDistance(const float* a, const float* b, int d){
+        return std::sqrt(static_cast<double>(dist::l2_sq(a, b, d)));
      }
     
     // v = v/||v||
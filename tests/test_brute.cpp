@@ -0,0 +1,40 @@
+#include "bruteForce.h"
+#include <iostream>
+#include <random>
+
+//batched exact kNN must return exactly what the per-query scan returns, also when
+//the points sit far from the origin and differ by far less than the rounding error
+//of ||x||^2 + ||q||^2 - 2<x,q> (near ties the decomposed distances cannot order)
+
+static Matrix cloud(int n, int d, float offset, float spread, std::mt19937& rng) {
+    std::normal_distribution<float> g(0.0f, spread);
+    Matrix X;
+    X.n = n; X.d = d;
+    X.a.resize((size_t)n * d);
+    for (float& v : X.a) v = offset + g(rng);
+    return X;
+}
+
+int main() {
+    std::mt19937 rng(11);
+    const int d = 32, N = 10;
+
+    int failures = 0;
+    for (float offset : {0.0f, 1000.0f}) {
+        Matrix base = cloud(3000, d, offset, 0.05f, rng);
+        Matrix queries = cloud(70, d, offset, 0.05f, rng);
+
+        auto batch = brute::knnSearchBatch(base, queries, N, 2);
+        for (int qi = 0; qi < queries.n; ++qi) {
+            auto ref = brute::knnSearch(base, queries.row(qi), N);
+            if (batch[qi] != ref) {
+                std::cerr << "batch kNN differs: offset=" << offset << " query=" << qi << "\n";
+                ++failures;
+            }
+        }
+    }
+
+    if (failures) { std::cerr << failures << " failures\n"; return 1; }
+    std::cout << "Brute force OK" << std::endl;
+    return 0;
+}
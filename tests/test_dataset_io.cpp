@@ -0,0 +1,84 @@
+#include "dataset_io.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+//fvecs loading: rows are read in place past each header, and a file whose
+//records do not all share the first dimension is rejected even when its size
+//and its first/last headers look consistent.
+//MNIST idx3: the view is n x (rows*cols) raw bytes past the 16-byte header, and a file
+//with a wrong magic or fewer pixels than its header promises is rejected
+
+static void write_fvecs(const char* path, const std::vector<int32_t>& dims, int width) {
+    std::ofstream out(path, std::ios::binary);
+    float v = 0.0f;
+    for (int32_t dim : dims) {
+        out.write(reinterpret_cast<const char*>(&dim), 4);
+        for (int j = 0; j < width; ++j, v += 1.0f) out.write(reinterpret_cast<const char*>(&v), 4);
+    }
+}
+
+//big-endian header (magic, n, rows, cols), then `pixels` bytes i % 251
+static void write_idx3(const char* path, uint32_t magic, uint32_t n, uint32_t rows, uint32_t cols, size_t pixels) {
+    std::ofstream out(path, std::ios::binary);
+    for (uint32_t v : {magic, n, rows, cols}) {
+        const unsigned char b[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v};
+        out.write(reinterpret_cast<const char*>(b), 4);
+    }
+    for (size_t i = 0; i < pixels; ++i) out.put(static_cast<char>(i % 251));
+}
+
+int main() {
+    const char* path = "test_dataset_io.fvecs";
+    int failures = 0;
+
+    write_fvecs(path, {3, 3, 3, 3}, 3);
+    {
+        Matrix M = load_fvecs(path);
+        if (M.n != 4 || M.d != 3 || M.row(2)[1] != 7.0f) {
+            std::cerr << "fvecs view: wrong shape or contents\n";
+            ++failures;
+        }
+    }
+
+    // same size and same first/last headers, a different dimension in between
+    write_fvecs(path, {3, 3, 2, 3}, 3);
+    try {
+        load_fvecs(path);
+        std::cerr << "fvecs with mixed dimensions was accepted\n";
+        ++failures;
+    } catch (const std::runtime_error&) {}
+    std::remove(path);
+
+    const char* idx = "test_dataset_io.idx3-ubyte";
+    write_idx3(idx, 0x00000803u, 5, 3, 4, 5 * 12);
+    {
+        MatrixU8 M = map_mnist_images(idx);
+        bool ok = M.n == 5 && M.d == 12 && M.is_view();
+        for (int i = 0; ok && i < M.n; ++i)
+            for (int j = 0; ok && j < M.d; ++j) ok = M.row(i)[j] == (uint8_t)((i * 12 + j) % 251);
+        if (!ok) {
+            std::cerr << "idx3 view: wrong shape or pixels\n";
+            ++failures;
+        }
+    }
+
+    // one pixel short of what the header promises, and a wrong magic (idx1 labels)
+    for (int broken = 0; broken < 2; ++broken) {
+        if (broken == 0) write_idx3(idx, 0x00000803u, 5, 3, 4, 5 * 12 - 1);
+        else write_idx3(idx, 0x00000801u, 5, 3, 4, 5 * 12);
+        try {
+            map_mnist_images(idx);
+            std::cerr << (broken == 0 ? "truncated" : "bad-magic") << " idx3 file was accepted\n";
+            ++failures;
+        } catch (const std::runtime_error&) {}
+    }
+    std::remove(idx);
+
+    if (failures) { std::cerr << failures << " failures\n"; return 1; }
+    std::cout << "Dataset IO OK" << std::endl;
+    return 0;
+}
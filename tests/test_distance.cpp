@@ -0,0 +1,105 @@
+#include "distance.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+//checking every SIMD level supported by this CPU against the scalar kernels
+//dimensions cover all tail lengths of the 4/8/16-lane loops
+
+static bool close(float got, float ref) {
+    return std::fabs(got - ref) <= 1e-4f * std::max(1.0f, std::fabs(ref));
+}
+
+int main() {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uni(-10.0f, 10.0f);
+
+    const dist::Kernels& ref = dist::kernels(dist::Level::Scalar);
+    const dist::Level best = dist::detect_level();
+    std::cout << "Detected SIMD level: " << dist::level_name(best) << std::endl;
+
+    int failures = 0;
+    for (int lv = static_cast<int>(dist::Level::SSE); lv <= static_cast<int>(best); ++lv) {
+        const dist::Kernels& k = dist::kernels(static_cast<dist::Level>(lv));
+        for (int d = 0; d <= 300; ++d) {
+            std::vector<float> a(d), b(d);
+            for (int i = 0; i < d; ++i) { a[i] = uni(rng); b[i] = uni(rng); }
+
+            float l2 = k.l2_sq(a.data(), b.data(), d), l2_ref = ref.l2_sq(a.data(), b.data(), d);
+            float ip = k.inner_product(a.data(), b.data(), d), ip_ref = ref.inner_product(a.data(), b.data(), d);
+            //inner products can cancel out, so compare against the magnitude of the terms
+            float ip_scale = ref.inner_product(a.data(), a.data(), d) + ref.inner_product(b.data(), b.data(), d);
+
+            if (!close(l2, l2_ref) || std::fabs(ip - ip_ref) > 1e-5f * std::max(1.0f, ip_scale)) {
+                std::cout << "Mismatch at " << dist::level_name(static_cast<dist::Level>(lv)) << " d=" << d
+                          << ": l2 " << l2 << " vs " << l2_ref << ", ip " << ip << " vs " << ip_ref << std::endl;
+                ++failures;
+            }
+
+            //uint8 kernels: the integer one must be exact
+            std::vector<uint8_t> ua(d), ub(d);
+            for (int i = 0; i < d; ++i) { ua[i] = static_cast<uint8_t>(rng()); ub[i] = static_cast<uint8_t>(rng()); }
+            uint32_t u8 = k.l2_sq_u8(ua.data(), ub.data(), d), u8_ref = ref.l2_sq_u8(ua.data(), ub.data(), d);
+            float mix = k.l2_sq_u8f32(ua.data(), b.data(), d), mix_ref = ref.l2_sq_u8f32(ua.data(), b.data(), d);
+
+            if (u8 != u8_ref || !close(mix, mix_ref)) {
+                std::cout << "Mismatch at " << dist::level_name(static_cast<dist::Level>(lv)) << " d=" << d
+                          << ": u8 " << u8 << " vs " << u8_ref << ", u8f32 " << mix << " vs " << mix_ref << std::endl;
+                ++failures;
+            }
+        }
+    }
+
+    //tile kernel: 7 queries x 5 rows with padded strides (covers the 4-query blocks and the remainder)
+    for (int lv = static_cast<int>(dist::Level::Scalar); lv <= static_cast<int>(best); ++lv) {
+        const dist::Kernels& k = dist::kernels(static_cast<dist::Level>(lv));
+        for (int d : {1, 7, 16, 33, 128}) {
+            const int nq = 7, nx = 5;
+            const size_t qs = d + 3, xs = d + 1;
+            std::vector<float> Q(nq * qs), X(nx * xs), out(nq * nx);
+            for (auto& v : Q) v = uni(rng);
+            for (auto& v : X) v = uni(rng);
+            k.ip_block(Q.data(), qs, nq, X.data(), xs, nx, d, out.data());
+            for (int i = 0; i < nq; ++i)
+                for (int j = 0; j < nx; ++j) {
+                    float r = ref.inner_product(Q.data() + i * qs, X.data() + j * xs, d);
+                    if (std::fabs(out[i * nx + j] - r) > 1e-3f * std::max(1.0f, std::fabs(r)) + 1e-2f) {
+                        std::cout << "ip_block mismatch at " << dist::level_name(static_cast<dist::Level>(lv))
+                                  << " d=" << d << ": " << out[i * nx + j] << " vs " << r << std::endl;
+                        ++failures;
+                    }
+                }
+        }
+    }
+
+    //4-bit PQ block scan: integer sums, must be exact (M covers the 2- and 4-subspace steps and their tails)
+    for (int lv = static_cast<int>(dist::Level::SSE); lv <= static_cast<int>(best); ++lv) {
+        const dist::Kernels& k = dist::kernels(static_cast<dist::Level>(lv));
+        for (int M : {1, 2, 3, 4, 5, 7, 8, 9, 16, 33, 64}) {
+            std::vector<uint8_t> codes(16 * M), lut(16 * M);
+            for (auto& c : codes) c = static_cast<uint8_t>(rng());
+            for (auto& t : lut) t = static_cast<uint8_t>(rng());
+            uint16_t out[32], out_ref[32];
+            k.pq4_scan(codes.data(), lut.data(), M, out);
+            ref.pq4_scan(codes.data(), lut.data(), M, out_ref);
+            if (!std::equal(out, out + 32, out_ref)) {
+                std::cout << "pq4_scan mismatch at " << dist::level_name(static_cast<dist::Level>(lv)) << " M=" << M << std::endl;
+                ++failures;
+            }
+        }
+    }
+
+    //the dispatched entry points must agree as well
+    std::vector<float> a(128, 1.0f), b(128, 3.0f);
+    if (!close(dist::l2_sq(a.data(), b.data(), 128), 512.0f)) ++failures;
+    if (!close(dist::inner_product(a.data(), b.data(), 128), 384.0f)) ++failures;
+    std::vector<uint8_t> ua(784, 255), ub(784, 0);
+    if (dist::l2_sq(ua.data(), ub.data(), 784) != 784u * 255u * 255u) ++failures;
+    if (!close(dist::l2_sq(ua.data(), b.data(), 128), 128.0f * 252.0f * 252.0f)) ++failures;
+
+    std::cout << (failures == 0 ? "Distance kernels OK" : "Distance kernels FAILED") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "dataset_io.hpp"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+//fixtures shared by the engine tests (header only, each test is its own program)
+
+//n 2-d points on a 211 x 97 lattice (rows repeat past 20467): large enough for the
+//multi-threaded table builds, with crowded buckets
+inline Matrix lattice_points(int n) {
+    Matrix M;
+    M.n = n;
+    M.d = 2;
+    for (int i = 0; i < n; ++i) { M.a.push_back(float(i % 211) * 0.37f); M.a.push_back(float(i % 97) * 0.53f); }
+    return M;
+}
+
+//bytes of the index file written by make() after buildIndex(base) on `threads` threads
+template <class Make>
+std::string built_index_bytes(Make make, const Matrix& base, int threads, const char* path) {
+    auto idx = make();
+    idx.setBuildThreads(threads);
+    idx.buildIndex(base);
+    idx.saveIndex(path);
+    std::ifstream in(path, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::remove(path);
+    return bytes;
+}
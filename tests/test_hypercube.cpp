@@ -1,5 +1,8 @@
 #include "hypercube.h"
+#include "test_helpers.hpp"
+#include <cstdio>
 #include <iostream>
+#include <thread>
 
 int main() {
     vutils::initRand(42);
@@ -21,4 +24,64 @@ int main() {
     std::cout << "Neighbors in radius 3: ";
     for (int i : range) std::cout << i << " ";
     std::cout << std::endl;
+
+    //index file round trip: a loaded index answers like the built one
+    index.saveIndex("test_hypercube_index.bin");
+    cube::Hypercube loaded(2, 4, 4.0, 10, 2);
+    loaded.loadIndex("test_hypercube_index.bin", data);
+    std::remove("test_hypercube_index.bin");
+    auto again = loaded.searchKNN(query, 1);
+    std::cout << "Loaded index NN: " << again[0].first << std::endl;
+    if (again != approx) { std::cerr << "loaded index gives different answers\n"; return 1; }
+
+    //probing all 2^4 vertices (distances 0..4) must reach every point exactly once
+    cube::Hypercube whole(2, 4, 4.0, 10, 16);
+    whole.buildIndex(data);
+    auto all = whole.searchKNN(query, 10);
+    std::cout << "Full-cube probe results: " << all.size() << std::endl;
+    if (all.size() != data.size()) { std::cerr << "full-cube probe missed points\n"; return 1; }
+
+    //k above the dense limit: sparse vertex table, same round trip
+    cube::Hypercube wide(2, 40, 4.0, 10, 41);
+    wide.buildIndex(data);
+    wide.saveIndex("test_hypercube_index.bin");
+    cube::Hypercube wide_loaded(2, 40, 4.0, 10, 41);
+    wide_loaded.loadIndex("test_hypercube_index.bin", data);
+    std::remove("test_hypercube_index.bin");
+    if (wide_loaded.searchKNN(query, 4) != wide.searchKNN(query, 4)) { std::cerr << "sparse vertex table round trip differs\n"; return 1; }
+
+    //a sparse table over an empty base has no keys at all and must still load as sparse
+    cube::Hypercube empty(2, 40, 4.0, 10, 41);
+    empty.buildIndex(Matrix());
+    empty.saveIndex("test_hypercube_index.bin");
+    cube::Hypercube empty_loaded(2, 40, 4.0, 10, 41);
+    empty_loaded.loadIndex("test_hypercube_index.bin", Matrix());
+    std::remove("test_hypercube_index.bin");
+    if (!empty_loaded.searchKNN(query.data(), 4).empty()) { std::cerr << "empty sparse index returned results\n"; return 1; }
+
+    //queries are pure functions of the index: the same answers from concurrent threads,
+    //whatever order they run in
+    std::vector<std::vector<float>> qs = {{1.5f, 2.0f}, {8.5f, 8.5f}, {5.0f, 5.0f}, {0.0f, 0.0f}};
+    std::vector<std::vector<std::pair<int, double>>> serial, parallel(qs.size());
+    for (const auto& q : qs) serial.push_back(index.searchKNN(q, 2));
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < qs.size(); ++t)
+        pool.emplace_back([&, t] { parallel[qs.size() - 1 - t] = index.searchKNN(qs[qs.size() - 1 - t], 2); });
+    for (auto& th : pool) th.join();
+    if (parallel != serial) { std::cerr << "concurrent queries differ from serial ones\n"; return 1; }
+
+    //an index loaded against a Matrix base references it in place: same radius answers
+    Matrix base = matrix_from_rows(data);
+    index.saveIndex("test_hypercube_index.bin");
+    cube::Hypercube viewed(2, 4, 4.0, 10, 2);
+    viewed.loadIndex("test_hypercube_index.bin", base);
+    std::remove("test_hypercube_index.bin");
+    if (viewed.searchRadius(query.data(), 3.0) != range) { std::cerr << "Matrix base gives different answers\n"; return 1; }
+
+    //a parallel build writes the same index file as a serial one
+    const Matrix big = lattice_points(40000);
+    auto build_bytes = [&](int threads) {
+        return built_index_bytes([] { return cube::Hypercube(2, 4, 4.0, 10, 2); }, big, threads, "test_hypercube_build.bin");
+    };
+    if (build_bytes(1) != build_bytes(4)) { std::cerr << "parallel build differs from serial build\n"; return 1; }
 }
@@ -0,0 +1,308 @@
+#include "ivf_flat.hpp"
+#include "ivf_pq.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <random>
+
+//IVFPQ: the ADC distances from the precomputed tables must match the distance to the
+//reconstruction c + sum_i C_i[code_i], and a saved / loaded index must answer the same,
+//for bit-packed codes of 1..10 bits too (nbits > 8: terms computed per list), and 2^nbits > n
+//is rejected.
+//The 4-bit fast-scan layout must give exactly the answers of the plain ADC scan.
+//Refine: exact distances, and with refine*N >= n (all lists probed) the true top-N.
+//OPQ: ADC = distance to the reconstruction in the rotated space, and on data whose variance sits
+//in one subspace the rotation lowers the quantization error; with dims that are always 0 the
+//rotation is still orthogonal and does not depend on the thread count.
+//IVFFlat: a saved / loaded index (ids only, or with the contiguous copy) answers the same,
+//and a file whose lists point outside the base or do not match the copy is rejected.
+
+int main() {
+    std::mt19937 rng(5);
+    std::normal_distribution<float> g(0.0f, 1.0f);
+
+    Matrix X;
+    X.n = 2000; X.d = 16;
+    X.a.resize((size_t)X.n * X.d);
+    for (int i = 0; i < X.n; ++i)
+        for (int j = 0; j < X.d; ++j) X.row(i)[j] = g(rng) + 4.0f * (i % 5); // 5 blobs
+
+    KMeansParams km;
+    km.threads = 1;
+    IVFIndexPQ ivf = build_ivf_pq(X, 8, 4, 4, 1, -1, km);
+
+    std::vector<float> q(X.d);
+    for (int j = 0; j < X.d; ++j) q[j] = g(rng) + 8.0f;
+    TopNPQ res = ivf_pq_query_topN(ivf, X, q.data(), ivf.centroids.n, 20);
+
+    //every result: find the point's list and code, rebuild it, compare distances
+    auto check_adc = [&](const IVFIndexPQ& idx, const std::vector<float>& qv, const TopNPQ& got) {
+        int bad = 0;
+        for (size_t r = 0; r < got.ids.size(); ++r)
+            for (int c = 0; c < idx.centroids.n; ++c)
+                for (size_t k = 0; k < idx.ids[c].size(); ++k) {
+                    if (idx.ids[c][k] != got.ids[r]) continue;
+                    const uint8_t* code = idx.codes[c].data() + k * idx.pq.code_size();
+                    double d2 = 0.0;
+                    for (int j = 0; j < X.d; ++j) {
+                        const int si = j / idx.pq.dsub;
+                        const float x = idx.centroids.row(c)[j] + idx.pq.C[si].row(pq_code(code, si, idx.pq.nbits))[j % idx.pq.dsub];
+                        d2 += double(qv[j] - x) * (qv[j] - x);
+                    }
+                    if (std::fabs(std::sqrt(d2) - got.dists[r]) > 1e-3 * (1.0 + std::sqrt(d2))) {
+                        std::cerr << "ADC distance " << got.dists[r] << " != reconstruction distance " << std::sqrt(d2)
+                                  << " (nbits " << idx.pq.nbits << ")\n";
+                        ++bad;
+                    }
+                }
+        return bad;
+    };
+    int failures = check_adc(ivf, q, res);
+
+    save_ivf_pq("test_ivf_index.bin", ivf, X.n, X.d);
+    IVFIndexPQ loaded = load_ivf_pq("test_ivf_index.bin", X.n, X.d);
+    std::remove("test_ivf_index.bin");
+    TopNPQ again = ivf_pq_query_topN(loaded, X, q.data(), loaded.centroids.n, 20);
+    if (again.ids != res.ids || again.dists != res.dists) {
+        std::cerr << "loaded IVFPQ index gives different answers\n";
+        ++failures;
+    }
+
+    //bit-packed codes: ceil(M*nbits/8) bytes per vector, same ADC, same answers after save / load
+    for (int nbits : {1, 3, 6, 10}) {
+        IVFIndexPQ p = build_ivf_pq(X, 8, 4, nbits, 1, -1, km);
+        const size_t cs = (4 * (size_t)nbits + 7) / 8;
+        for (int c = 0; c < p.centroids.n; ++c)
+            if (p.codes[c].size() != p.ids[c].size() * cs + kPQCodePad) {
+                std::cerr << "list " << c << " has " << p.codes[c].size() << " code bytes (nbits " << nbits << ")\n";
+                ++failures;
+            }
+        const TopNPQ rp = ivf_pq_query_topN(p, X, q.data(), p.centroids.n, 20);
+        failures += check_adc(p, q, rp);
+        save_ivf_pq("test_ivf_index.bin", p, X.n, X.d);
+        IVFIndexPQ pl = load_ivf_pq("test_ivf_index.bin", X.n, X.d);
+        std::remove("test_ivf_index.bin");
+        const TopNPQ rl = ivf_pq_query_topN(pl, X, q.data(), pl.centroids.n, 20);
+        if (rl.ids != rp.ids || rl.dists != rp.dists) {
+            std::cerr << "loaded IVFPQ index (nbits " << nbits << ") gives different answers\n";
+            ++failures;
+        }
+    }
+
+    //more codewords per subspace than base points: rejected up front
+    try {
+        build_ivf_pq(X, 8, 4, 12, 1, -1, km);
+        std::cerr << "nbits 12 on " << X.n << " points was accepted\n";
+        ++failures;
+    } catch (const std::runtime_error&) {}
+
+    //4-bit codes: fast-scan vs plain ADC, top-N and range, also after save / load
+    IVFIndexPQ plain4 = build_ivf_pq(X, 8, 4, 4, 4, -1, km);
+    IVFIndexPQ fs4 = plain4;
+    ivf_pq_pack_fast_scan(fs4);
+    save_ivf_pq("test_ivf_index.bin", fs4, X.n, X.d);
+    IVFIndexPQ fs4_loaded = load_ivf_pq("test_ivf_index.bin", X.n, X.d);
+    std::remove("test_ivf_index.bin");
+    for (int t = 0; t < 20; ++t) {
+        std::vector<float> qq(X.d);
+        for (int j = 0; j < X.d; ++j) qq[j] = g(rng) + 4.0f * (t % 5);
+        for (int nprobe : {1, 3, 8}) {
+            const TopNPQ a = ivf_pq_query_topN(plain4, X, qq.data(), nprobe, 10);
+            const float R = a.dists.back();
+            const std::vector<int> ra = ivf_pq_query_range(plain4, qq.data(), nprobe, R);
+            for (const IVFIndexPQ* fs : {&fs4, &fs4_loaded}) {
+                const TopNPQ b = ivf_pq_query_topN(*fs, X, qq.data(), nprobe, 10);
+                if (b.ids != a.ids || b.dists != a.dists) {
+                    std::cerr << "fast-scan top-N differs (query " << t << ", nprobe " << nprobe << ")\n";
+                    ++failures;
+                }
+                if (ivf_pq_query_range(*fs, qq.data(), nprobe, R) != ra) {
+                    std::cerr << "fast-scan range differs (query " << t << ", nprobe " << nprobe << ")\n";
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    //refine over the whole base = brute force
+    {
+        const TopNPQ r = ivf_pq_query_topN(ivf, X, q.data(), ivf.centroids.n, 10, X.n);
+        std::vector<std::pair<float, int>> all;
+        for (int i = 0; i < X.n; ++i) {
+            double d2 = 0.0;
+            for (int j = 0; j < X.d; ++j) d2 += double(q[j] - X.row(i)[j]) * (q[j] - X.row(i)[j]);
+            all.push_back({(float)std::sqrt(d2), i});
+        }
+        std::sort(all.begin(), all.end());
+        for (size_t t = 0; t < r.ids.size(); ++t)
+            if (std::fabs(r.dists[t] - all[t].first) > 1e-3f * (1.0f + all[t].first)) {
+                std::cerr << "refined dist " << r.dists[t] << " != true dist " << all[t].first << "\n";
+                ++failures;
+            }
+        if (r.ids.size() != 10) { std::cerr << "refine returned " << r.ids.size() << " results\n"; ++failures; }
+
+        //a huge refine keeps at most the probed lists (no refine*N-sized allocation): same answers
+        const TopNPQ huge = ivf_pq_query_topN(ivf, X, q.data(), ivf.centroids.n, 10, std::numeric_limits<int>::max());
+        if (huge.ids != r.ids) { std::cerr << "refine = INT_MAX gives different answers\n"; ++failures; }
+    }
+
+    //OPQ on data with nearly all variance in dims 0..3 (= subspace 0 for M=4)
+    {
+        Matrix A;
+        A.n = 3000; A.d = 16;
+        A.a.resize((size_t)A.n * A.d);
+        for (int i = 0; i < A.n; ++i)
+            for (int j = 0; j < A.d; ++j) A.row(i)[j] = g(rng) * (j < 4 ? 8.0f : 0.5f);
+
+        //sum over all points of ||P(x - c) - yhat||^2 (P = I without OPQ)
+        auto quant_error = [&](const IVFIndexPQ& idx) {
+            double err = 0.0;
+            std::vector<float> r(A.d), y(A.d);
+            for (int c = 0; c < idx.centroids.n; ++c)
+                for (size_t k = 0; k < idx.ids[c].size(); ++k) {
+                    const float* x = A.row(idx.ids[c][k]);
+                    for (int j = 0; j < A.d; ++j) r[j] = x[j] - idx.centroids.row(c)[j];
+                    for (int j = 0; j < A.d; ++j) {
+                        y[j] = r[j];
+                        if (idx.opq.n > 0) {
+                            y[j] = 0.0f;
+                            for (int t = 0; t < A.d; ++t) y[j] += idx.opq.row(j)[t] * r[t];
+                        }
+                    }
+                    const uint8_t* code = idx.codes[c].data() + k * idx.pq.code_size();
+                    for (int j = 0; j < A.d; ++j) {
+                        const int si = j / idx.pq.dsub;
+                        const float e = y[j] - idx.pq.C[si].row(pq_code(code, si, idx.pq.nbits))[j % idx.pq.dsub];
+                        err += double(e) * e;
+                    }
+                }
+            return err;
+        };
+
+        IVFIndexPQ plain = build_ivf_pq(A, 4, 4, 4, 3, -1, km);
+        IVFIndexPQ opq = build_ivf_pq(A, 4, 4, 4, 3, -1, km, 5);
+        const double e_plain = quant_error(plain), e_opq = quant_error(opq);
+        if (!(e_opq < 0.9 * e_plain)) {
+            std::cerr << "OPQ quantization error " << e_opq << " not below plain PQ " << e_plain << "\n";
+            ++failures;
+        }
+
+        //ADC distance of every result = ||P(q - c) - yhat||^2 (||q - c|| is rotation invariant)
+        std::vector<float> qa(A.d);
+        for (int j = 0; j < A.d; ++j) qa[j] = g(rng) * (j < 4 ? 8.0f : 0.5f);
+        const TopNPQ ro = ivf_pq_query_topN(opq, A, qa.data(), opq.centroids.n, 20);
+        for (size_t t = 0; t < ro.ids.size(); ++t)
+            for (int c = 0; c < opq.centroids.n; ++c)
+                for (size_t k = 0; k < opq.ids[c].size(); ++k) {
+                    if (opq.ids[c][k] != ro.ids[t]) continue;
+                    const uint8_t* code = opq.codes[c].data() + k * opq.pq.code_size();
+                    double d2 = 0.0;
+                    for (int j = 0; j < A.d; ++j) {
+                        double y = 0.0;
+                        for (int u = 0; u < A.d; ++u) y += opq.opq.row(j)[u] * (qa[u] - opq.centroids.row(c)[u]);
+                        const int si = j / opq.pq.dsub;
+                        const float yh = opq.pq.C[si].row(pq_code(code, si, opq.pq.nbits))[j % opq.pq.dsub];
+                        d2 += (y - yh) * (y - yh);
+                    }
+                    if (std::fabs(std::sqrt(d2) - ro.dists[t]) > 1e-3 * (1.0 + std::sqrt(d2))) {
+                        std::cerr << "OPQ ADC distance " << ro.dists[t] << " != rotated reconstruction distance " << std::sqrt(d2) << "\n";
+                        ++failures;
+                    }
+                }
+
+        save_ivf_pq("test_ivf_index.bin", opq, A.n, A.d);
+        IVFIndexPQ opq_loaded = load_ivf_pq("test_ivf_index.bin", A.n, A.d);
+        std::remove("test_ivf_index.bin");
+        const TopNPQ rl = ivf_pq_query_topN(opq_loaded, A, qa.data(), opq_loaded.centroids.n, 20);
+        if (rl.ids != ro.ids || rl.dists != ro.dists) {
+            std::cerr << "loaded OPQ index gives different answers\n";
+            ++failures;
+        }
+    }
+
+    //OPQ with dims that are 0 in every point (MNIST borders) and several Jacobi blocks: P is
+    //orthogonal, and the same for any thread count
+    {
+        Matrix Z;
+        Z.n = 1000; Z.d = 48;
+        Z.a.assign((size_t)Z.n * Z.d, 0.0f);
+        for (int i = 0; i < Z.n; ++i)
+            for (int j = 4; j < 40; ++j) Z.row(i)[j] = g(rng) * (j < 10 ? 6.0f : 1.0f) + 3.0f * (i % 3);
+        KMeansParams km3 = km;
+        km3.threads = 3;
+        const IVFIndexPQ z1 = build_ivf_pq(Z, 3, 4, 4, 2, -1, km, 2);
+        const IVFIndexPQ z3 = build_ivf_pq(Z, 3, 4, 4, 2, -1, km3, 2);
+        if (z1.opq.a != z3.opq.a) {
+            std::cerr << "OPQ rotation depends on the thread count\n";
+            ++failures;
+        }
+        double worst = 0.0; //max |P P^T - I|
+        for (int i = 0; i < Z.d; ++i)
+            for (int j = 0; j < Z.d; ++j) {
+                double dot = 0.0;
+                for (int t = 0; t < Z.d; ++t) dot += (double)z1.opq.row(i)[t] * z1.opq.row(j)[t];
+                worst = std::max(worst, std::fabs(dot - (i == j ? 1.0 : 0.0)));
+            }
+        if (worst > 1e-4) {
+            std::cerr << "OPQ rotation with zero dims is not orthogonal (|P P^T - I| = " << worst << ")\n";
+            ++failures;
+        }
+    }
+
+    //IVFFlat save / load round trip
+    for (bool contiguous : {false, true}) {
+        IVFIndexFlat flat = build_ivf_flat(X, 8, 1, -1, contiguous, km);
+        save_ivf_flat("test_ivf_index.bin", flat, X.n, X.d);
+        IVFIndexFlat flat_loaded = load_ivf_flat("test_ivf_index.bin", X.n, X.d);
+        for (int nprobe : {1, 3, 8}) {
+            const TopN a = ivf_flat_query_topN(flat, X, q.data(), nprobe, 10);
+            const TopN b = ivf_flat_query_topN(flat_loaded, X, q.data(), nprobe, 10);
+            const float R = a.dists.back();
+            if (b.ids != a.ids || b.dists != a.dists ||
+                ivf_flat_query_range(flat_loaded, X, q.data(), nprobe, R) != ivf_flat_query_range(flat, X, q.data(), nprobe, R)) {
+                std::cerr << "loaded IVFFlat index gives different answers (contiguous " << contiguous << ")\n";
+                ++failures;
+            }
+        }
+
+        //corrupted lists: an id past the base, and (contiguous) a list that no longer matches its offsets
+        IVFIndexFlat bad = flat;
+        bad.lists[0][0] = X.n;
+        IVFIndexFlat moved = flat;
+        moved.lists[1].push_back(moved.lists[0].back());
+        moved.lists[0].pop_back();
+        for (const IVFIndexFlat* broken : {&bad, &moved}) {
+            if (broken == &moved && !contiguous) continue;
+            save_ivf_flat("test_ivf_index.bin", *broken, X.n, X.d);
+            try {
+                load_ivf_flat("test_ivf_index.bin", X.n, X.d);
+                std::cerr << "corrupted IVFFlat index was accepted (contiguous " << contiguous << ")\n";
+                ++failures;
+            } catch (const std::runtime_error&) {}
+        }
+        std::remove("test_ivf_index.bin");
+    }
+
+    //a contiguous uint8 index queried with a float base: the float copy is empty, rows come from the base
+    {
+        MatrixU8 B; B.n = 400; B.d = 16; B.a.resize((size_t)B.n * B.d);
+        for (int i = 0; i < B.n; ++i)
+            for (int j = 0; j < B.d; ++j) B.row(i)[j] = (uint8_t)std::min(255.0f, std::max(0.0f, 40.0f * (i % 5) + 8.0f * g(rng) + 20.0f));
+        const Matrix Bf = to_float(B);
+        const IVFIndexFlat u8 = build_ivf_flat(B, 4, 1, -1, true, km);
+        const IVFIndexFlat ids_only = build_ivf_flat(B, 4, 1, -1, false, km);
+        std::vector<float> qf(B.d, 60.0f);
+        const TopN a = ivf_flat_query_topN(u8, Bf, qf.data(), 2, 10);
+        const TopN b = ivf_flat_query_topN(ids_only, Bf, qf.data(), 2, 10);
+        if (a.ids != b.ids || a.dists != b.dists ||
+            ivf_flat_query_range(u8, Bf, qf.data(), 2, 100.0f) != ivf_flat_query_range(ids_only, Bf, qf.data(), 2, 100.0f)) {
+            std::cerr << "uint8 contiguous IVFFlat queried with a float base gives different answers\n";
+            ++failures;
+        }
+    }
+
+    if (failures) return 1;
+    std::cout << "IVFPQ OK (" << res.ids.size() << " results, nn dist=" << res.dists[0] << ")\n";
+}
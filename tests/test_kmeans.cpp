@@ -0,0 +1,72 @@
+#include "kmeans.hpp"
+#include <iostream>
+#include <random>
+
+//k-means must give bit-identical centroids and assignments for any thread count,
+//and Hamerly must reproduce Lloyd exactly
+
+int main() {
+    std::mt19937 rng(3);
+    std::normal_distribution<float> g(0.0f, 1.0f);
+
+    Matrix X;
+    X.n = 3000; X.d = 16;
+    X.a.resize((size_t)X.n * X.d);
+    for (int i = 0; i < X.n; ++i)
+        for (int j = 0; j < X.d; ++j) X.row(i)[j] = g(rng) + 5.0f * (i % 7); // 7 blobs
+
+    KMeansParams p;
+    p.k = 20;
+    p.max_iters = 15;
+    p.threads = 1;
+    KMeansResult ref = kmeans_train(X, p);
+
+    int failures = 0;
+    for (int threads : {2, 3, 8}) {
+        p.threads = threads;
+        KMeansResult r = kmeans_train(X, p);
+        if (r.centroids.a != ref.centroids.a || r.assign != ref.assign || r.iters != ref.iters) {
+            std::cerr << "k-means differs with " << threads << " threads\n";
+            ++failures;
+        }
+    }
+
+    for (int subset : {-1, 1000}) {
+        p.threads = 1;
+        p.train_subset = subset;
+        p.algo = KMeansAlgo::Lloyd;
+        KMeansResult lloyd = kmeans_train(X, p);
+        p.algo = KMeansAlgo::Hamerly;
+        KMeansResult r = kmeans_train(X, p);
+        if (r.centroids.a != lloyd.centroids.a || r.assign != lloyd.assign || r.iters != lloyd.iters ||
+            r.final_sse != lloyd.final_sse) {
+            std::cerr << "Hamerly differs from Lloyd (train_subset=" << subset << ")\n";
+            ++failures;
+        }
+    }
+
+    // mini-batch: thread-independent as well, and close to Lloyd on well separated blobs
+    p.algo = KMeansAlgo::Lloyd;
+    p.train_subset = -1;
+    p.threads = 1;
+    const float lloyd_sse = kmeans_train(X, p).final_sse; // SSE over all points
+    p.batch_size = 256;
+    p.batch_iters = 100;
+    KMeansResult mb = kmeans_train(X, p);
+    for (int threads : {2, 8}) {
+        p.threads = threads;
+        KMeansResult r = kmeans_train(X, p);
+        if (r.centroids.a != mb.centroids.a || r.assign != mb.assign || r.iters != mb.iters) {
+            std::cerr << "mini-batch k-means differs with " << threads << " threads\n";
+            ++failures;
+        }
+    }
+    if (!(mb.final_sse < 1.2f * lloyd_sse)) {
+        std::cerr << "mini-batch SSE " << mb.final_sse << " too far from Lloyd " << lloyd_sse << "\n";
+        ++failures;
+    }
+
+    if (failures) return 1;
+    std::cout << "KMeans OK (" << ref.iters << " iterations, sse=" << ref.final_sse << ")" << std::endl;
+    return 0;
+}
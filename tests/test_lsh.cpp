@@ -1,5 +1,12 @@
 #include "lsh.h"
+#include "test_helpers.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
 
 int main() {
     vutils::initRand(42);
@@ -21,4 +28,111 @@ int main() {
     std::cout << "Neighbors in radius 3: ";
     for (int i : range) std::cout << i << " ";
     std::cout << std::endl;
+
+    //index file round trip: a loaded index answers like the built one
+    index.saveIndex("test_lsh_index.bin");
+    lsh::LSH loaded(2, 4, 5, 4.0);
+    loaded.loadIndex("test_lsh_index.bin", data);
+    std::remove("test_lsh_index.bin");
+    auto again = loaded.searchKNN(query, 1);
+    std::cout << "Loaded index NN: " << again[0].first << std::endl;
+    if (again != approx) { std::cerr << "loaded index gives different answers\n"; return 1; }
+
+    //a file whose last entry points past the dataset is rejected
+    index.saveIndex("test_lsh_index.bin");
+    {
+        std::fstream f("test_lsh_index.bin", std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(-8, std::ios::end); //last Entry {index, id}
+        const unsigned past = static_cast<unsigned>(data.size());
+        f.write(reinterpret_cast<const char*>(&past), sizeof(past));
+    }
+    try {
+        lsh::LSH corrupt(2, 4, 5, 4.0);
+        corrupt.loadIndex("test_lsh_index.bin", data);
+        std::cerr << "corrupt index file was accepted\n";
+        return 1;
+    } catch (const std::runtime_error&) {}
+    std::remove("test_lsh_index.bin");
+
+    //so is a file whose first g-function has modulus M = 0 (the first copy of the default prime)
+    index.saveIndex("test_lsh_index.bin");
+    {
+        std::fstream f("test_lsh_index.bin", std::ios::in | std::ios::out | std::ios::binary);
+        const std::string bytes((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        const uint64_t prime = 4294967291ULL, zero = 0;
+        const size_t at = bytes.find(std::string(reinterpret_cast<const char*>(&prime), sizeof(prime)));
+        if (at == std::string::npos) { std::cerr << "g-function modulus not found in the index file\n"; return 1; }
+        f.clear(); //reading to the end set eofbit
+        f.seekp(static_cast<std::streamoff>(at));
+        f.write(reinterpret_cast<const char*>(&zero), sizeof(zero));
+    }
+    try {
+        lsh::LSH corrupt(2, 4, 5, 4.0);
+        corrupt.loadIndex("test_lsh_index.bin", data);
+        std::cerr << "index file with M = 0 was accepted\n";
+        return 1;
+    } catch (const std::runtime_error&) {}
+    std::remove("test_lsh_index.bin");
+
+    //an empty dataset with an explicit large table size (sparse tables, no keys) loads back
+    {
+        lsh::LSH empty(2, 4, 5, 4.0, 1 << 20);
+        empty.buildIndex(Matrix());
+        empty.saveIndex("test_lsh_index.bin");
+        lsh::LSH empty_loaded(2, 4, 5, 4.0);
+        empty_loaded.loadIndex("test_lsh_index.bin", Matrix());
+        std::remove("test_lsh_index.bin");
+        if (!empty_loaded.searchKNN(query.data(), 1).empty()) { std::cerr << "empty index returned results\n"; return 1; }
+    }
+
+    //multi-probe only adds buckets: every neighbour found without probing is still found
+    index.setProbes(4);
+    auto probed = index.searchRadius(query, 100.0);
+    index.setProbes(0);
+    for (int i : index.searchRadius(query, 100.0))
+        if (std::find(probed.begin(), probed.end(), i) == probed.end()) {
+            std::cerr << "multi-probe lost neighbour " << i << "\n";
+            return 1;
+        }
+    std::cout << "Multi-probe candidates: " << probed.size() << std::endl;
+
+    //a strided view (a header value before each row, like fvecs) is read in place and answers
+    //like the copied vector-of-vectors rows
+    Matrix rows;
+    rows.n = 4;
+    rows.d = 3;
+    for (const auto& p : data) { rows.a.push_back(-1.0f); rows.a.insert(rows.a.end(), p.begin(), p.end()); }
+    Matrix strided;
+    strided.n = 4;
+    strided.d = 2;
+    strided.view = rows.a.data() + 1;
+    strided.stride = 3;
+    lsh::LSH viewed(2, 4, 5, 4.0);
+    viewed.buildIndex(strided);
+    if (viewed.searchKNN(query.data(), 1) != approx || viewed.searchRadius(query.data(), 3.0) != range) {
+        std::cerr << "strided Matrix base gives different answers\n";
+        return 1;
+    }
+
+    //a parallel build writes the same index file as a serial one
+    const Matrix big = lattice_points(40000);
+    auto build_bytes = [&](int threads) {
+        return built_index_bytes([] { return lsh::LSH(2, 4, 5, 4.0); }, big, threads, "test_lsh_build.bin");
+    };
+    if (build_bytes(1) != build_bytes(4)) { std::cerr << "parallel build differs from serial build\n"; return 1; }
+
+    //a query far from every point matches no ID: the fallback stages fire but stay within the budget
+    {
+        lsh::LSH idx(2, 4, 5, 4.0);
+        idx.setFallback(8, 50);
+        idx.buildIndex(big);
+        const float far[2] = {1e6f, -1e6f};
+        const auto res = idx.searchKNN(far, 10);
+        const auto st = idx.fallbackStats();
+        if (st.queries != 1 || st.widened != 1 || st.scored > 50 || res.size() > 10) {
+            std::cerr << "fallback: widened " << st.widened << ", scored " << st.scored << " of " << big.n << "\n";
+            return 1;
+        }
+        std::cout << "Fallback candidates: " << st.scored << " (relaxed " << st.relaxed << ")" << std::endl;
+    }
 }
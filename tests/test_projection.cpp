@@ -0,0 +1,38 @@
+#include "projection.hpp"
+#include <iostream>
+#include <random>
+#include <vector>
+
+//A point must get the same h-values whether it is hashed alone (queries) or inside a
+//build block (hashBatch): a narrow w puts many of them next to a bucket boundary.
+
+int main() {
+    std::mt19937 rng(11);
+    std::normal_distribution<float> g(0.0f, 1.0f);
+
+    const int k = 13, d = 37, n = 517; // odd sizes: tile tails and SIMD remainders
+    const double w = 0.01;
+    RandomProjections P(k, d, w);
+    std::uniform_real_distribution<double> u(0.0, w);
+    for (int i = 0; i < k; ++i) {
+        for (int j = 0; j < d; ++j) P.row(i)[j] = g(rng);
+        P.offset(i) = u(rng);
+    }
+
+    std::vector<float> X((size_t)n * d);
+    for (float& x : X) x = 10.0f * g(rng);
+
+    std::vector<int> H((size_t)n * k), h(k);
+    P.hashBatch(X.data(), (size_t)d, n, H.data());
+    int failures = 0;
+    for (int j = 0; j < n; ++j) {
+        P.hash(X.data() + (size_t)j * d, h.data());
+        for (int i = 0; i < k; ++i)
+            if (h[i] != H[(size_t)j * k + i]) {
+                std::cerr << "point " << j << ", h_" << i << ": hash " << h[i] << " != hashBatch " << H[(size_t)j * k + i] << "\n";
+                ++failures;
+            }
+    }
+    if (failures) return 1;
+    std::cout << "Projections OK (" << n << " points x " << k << " functions)\n";
+}
@@ -0,0 +1,38 @@
+#include "topn.hpp"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+
+//bounded top-N against a full sort, for capacities on both sides of the
+//sorted-buffer / heap switch (with many duplicate distances to exercise ties)
+
+int main() {
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> uni(0, 200);
+
+    int failures = 0;
+    for (int cap : {0, 1, 5, TopNHeap<float>::kSortedMax, TopNHeap<float>::kSortedMax + 1, 100}) {
+        for (int n : {0, 3, 50, 1000}) {
+            std::vector<std::pair<float, int>> all;
+            TopNHeap<float> best(cap);
+            for (int i = 0; i < n; ++i) {
+                float d = static_cast<float>(uni(rng));
+                all.emplace_back(d, i);
+                best.push(d, i);
+            }
+            std::sort(all.begin(), all.end());
+            all.resize(std::min<size_t>(all.size(), cap));
+
+            if (best.take_sorted() != all) {
+                std::cerr << "top-N mismatch: capacity=" << cap << " n=" << n << "\n";
+                ++failures;
+            }
+        }
+    }
+
+    if (failures) { std::cerr << failures << " failures\n"; return 1; }
+    std::cout << "TopN OK" << std::endl;
+    return 0;
+}